@@ -0,0 +1,93 @@
+#include "sheet.h"
+#include <stdlib.h>
+#include <string.h>
+
+// the TEXT produced while a formula is evaluated only lives until the result
+// is known, so it is taken from an arena: allocation just bumps a pointer,
+// nothing is freed on its own and resetting the arena makes its blocks
+// available to the next evaluation
+#define ARENA_BLOCK_SIZE 4096
+
+struct _ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    char data[];
+};
+
+void initArena(Arena *arena) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->used = 0;
+    arena->allocations = 0;
+}
+
+void resetArena(Arena *arena) {
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+void freeArena(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    initArena(arena);
+}
+
+char *arenaAlloc(Arena *arena, size_t size) {
+    while (arena->current == NULL ||
+           arena->used + size > arena->current->size) {
+        ArenaBlock *next = arena->current == NULL ? arena->first :
+                                                    arena->current->next;
+        // put a new block in front of the next one if that is too small
+        if (next == NULL || next->size < size) {
+            size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            ArenaBlock *block = malloc(sizeof(ArenaBlock) + blockSize);
+            block->size = blockSize;
+            block->next = next;
+            if (arena->current == NULL) {
+                arena->first = block;
+            } else {
+                arena->current->next = block;
+            }
+            next = block;
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+    char *ptr = arena->current->data + arena->used;
+    arena->used += size;
+    arena->allocations++;
+    return ptr;
+}
+
+// a TEXT value with room for the given number of characters (and the
+// terminating '\0'), which is stored in the value itself if it is short enough
+Value allocText(size_t length, Arena *arena) {
+    Value value;
+    value.type = TYPE_TEXT;
+    value.small = length <= SMALL_TEXT_LENGTH;
+    if (!value.small) {
+        value.data.text = arena != NULL ? arenaAlloc(arena, length + 1) :
+                                          malloc(length + 1);
+    }
+    return value;
+}
+
+Value makeText(const char *text, size_t length, Arena *arena) {
+    Value value = allocText(length, arena);
+    memcpy(AS_TEXT(value), text, length);
+    AS_TEXT(value)[length] = '\0';
+    return value;
+}
+
+// copy TEXT that is borrowed (or lives in an arena) to the heap,
+// so that the value can outlive the evaluation
+Value ownValue(Value value) {
+    if (IS_LONG_TEXT(value)) {
+        return makeText(value.data.text, strlen(value.data.text), NULL);
+    }
+    return value;
+}
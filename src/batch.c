@@ -0,0 +1,138 @@
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// headless mode: sheet --eval file.sht [--output file] [--export file.csv]
+// [--threads N] [--profile file]; the sheet (or a CSV or TSV file) is
+// loaded, recalculated and the value of every populated cell is written out
+// as "address<TAB>value", row by row, without using curses (see
+// writeEscaped()); with --export, the values are written as CSV (TSV if the
+// name ends with .tsv) instead, or as well if --output is given; with
+// --profile (or SHEET_PROFILE set), the evaluation is profiled (loading and
+// a full recalculation) and the counters are written to the given file
+
+static int compareCells(const void *a, const void *b) {
+    const Cell *first = *(Cell * const *)a;
+    const Cell *second = *(Cell * const *)b;
+    if (first->y != second->y) {
+        return first->y < second->y ? -1 : 1;
+    }
+    return first->x < second->x ? -1 : first->x > second->x;
+}
+
+// write a value on a single line: backslashes, tabs and line breaks are
+// written as \\, \t, \n and \r
+static void writeEscaped(FILE *output, const char *text) {
+    for (; *text != '\0'; text++) {
+        if (*text == '\t') {
+            fputs("\\t", output);
+        } else if (*text == '\n') {
+            fputs("\\n", output);
+        } else if (*text == '\r') {
+            fputs("\\r", output);
+        } else if (*text == '\\') {
+            fputs("\\\\", output);
+        } else {
+            putc(*text, output);
+        }
+    }
+}
+
+static void writeValues(FILE *output) {
+    size_t count = 0, capacity = 256;
+    Cell **cells = malloc(capacity * sizeof(Cell *));
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        if (strlen(cell->formula) == 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            cells = realloc(cells, capacity * sizeof(Cell *));
+        }
+        cells[count++] = cell;
+    }
+    qsort(cells, count, sizeof(Cell *), compareCells);
+
+    char name[16], buffer[NUMBER_LENGTH];
+    for (size_t i = 0; i < count; i++) {
+        fprintf(output, "%s\t", cellName(cells[i]->x, cells[i]->y, name));
+        writeEscaped(output, cellText(cells[i], buffer));
+        putc('\n', output);
+    }
+    free(cells);
+}
+
+int runBatch(int argc, char *argv[]) {
+    char *fileName = NULL, *outputName = NULL, *exportName = NULL;
+    char *profileName = getenv("SHEET_PROFILE");
+    unsigned threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--eval") == 0 && i + 1 < argc) {
+            fileName = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            exportName = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileName = argv[++i];
+        } else {
+            fprintf(stderr, "unknown argument: %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (fileName == NULL) {
+        fprintf(stderr, "usage: %s --eval file.sht [--output file] "
+                "[--export file.csv] [--threads N] [--profile file]\n",
+                argv[0]);
+        return 2;
+    }
+
+    startPool(threads);
+    if (profileName != NULL) {
+        startProfiling();
+    }
+    char separator = csvSeparator(fileName);
+    if (separator != '\0' ? !importCSV(fileName, separator, NULL) :
+        !loadSheet(fileName, NULL)) {
+        fprintf(stderr, "cannot read %s\n", fileName);
+        stopPool();
+        return 1;
+    }
+    if (profileName != NULL) {
+        // sheets in the new format are loaded without evaluating anything
+        recalculateAll(NULL);
+        if (!writeProfile(profileName)) {
+            fprintf(stderr, "cannot write %s\n", profileName);
+        }
+    }
+
+    int status = 0;
+    if (exportName != NULL) {
+        separator = csvSeparator(exportName);
+        if (!exportCSV(exportName, separator == '\0' ? ',' : separator)) {
+            fprintf(stderr, "cannot write %s\n", exportName);
+            status = 1;
+        }
+    }
+    if (exportName == NULL || outputName != NULL) {
+        FILE *output = outputName == NULL ? stdout : fopen(outputName, "w");
+        if (output == NULL) {
+            fprintf(stderr, "cannot write %s\n", outputName);
+            status = 1;
+        } else {
+            writeValues(output);
+            if (output != stdout) {
+                fclose(output);
+            }
+        }
+    }
+
+    clearCells();
+    stopPool();
+    return status;
+}
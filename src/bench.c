@@ -0,0 +1,303 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// engine benchmarks (make bench): synthetic sheets are generated in memory
+// and the time of parsing, full and incremental recalculation, loading,
+// saving and rendering them is measured; the results are written as JSON,
+// one entry per benchmark with the throughput and the latency percentiles
+
+#define CHAIN_LENGTH 10000
+#define DIAMOND_WIDTH 100
+#define DIAMOND_DEPTH 100
+#define RANGE_COLS 26
+#define RANGE_ROWS 1000
+#define RANGE_FORMULAS 100
+#define CONCAT_ROWS 2000
+// the mixed sheet which is saved and loaded
+#define FILE_COLS 200
+#define FILE_ROWS 250
+
+#define RECALC_RUNS 10
+#define EDIT_RUNS 100
+#define FILE_RUNS 10
+#define RENDER_RUNS 1000
+
+// long enough for any of the formulas generated here
+#define BENCH_FORMULA_LENGTH 80
+
+typedef struct {
+    double *samples; // latencies in seconds
+    size_t length, capacity;
+} Samples;
+
+static FILE *output;
+static bool firstResult = TRUE;
+// keeps the rendering from being optimized away
+static volatile size_t renderSink;
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void addSample(Samples *samples, double latency) {
+    if (samples->length == samples->capacity) {
+        samples->capacity = samples->capacity == 0 ? 64 :
+                            samples->capacity * 2;
+        samples->samples = realloc(samples->samples,
+                                   samples->capacity * sizeof(double));
+    }
+    samples->samples[samples->length++] = latency;
+}
+
+static int compareSamples(const void *a, const void *b) {
+    double first = *(const double *)a, second = *(const double *)b;
+    return first < second ? -1 : first > second;
+}
+
+// write the results of a benchmark and forget the samples
+static void report(const char *sheet, const char *name, size_t cells,
+                   Samples *samples) {
+    double total = 0;
+    for (size_t i = 0; i < samples->length; i++) {
+        total += samples->samples[i];
+    }
+    qsort(samples->samples, samples->length, sizeof(double), compareSamples);
+    size_t p99 = samples->length * 99 / 100;
+    if (p99 >= samples->length) {
+        p99 = samples->length - 1;
+    }
+    fprintf(output, "%s\n    {\"sheet\": \"%s\", \"benchmark\": \"%s\", "
+            "\"cells\": %zu, \"ops\": %zu, \"ops_per_sec\": %.3f, "
+            "\"p50_us\": %.3f, \"p99_us\": %.3f}",
+            firstResult ? "" : ",", sheet, name, cells, samples->length,
+            samples->length / total,
+            samples->samples[samples->length / 2] * 1e6,
+            samples->samples[p99] * 1e6);
+    firstResult = FALSE;
+    samples->length = 0;
+}
+
+static size_t countCells(void) {
+    size_t count = 0;
+    CellIter iter = { 0 };
+    while (nextCell(&iter) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+// put a formula in a cell without recalculating anything
+static void put(unsigned x, unsigned y, const char *formula) {
+    setFormula(touchCell(x, y), formula);
+}
+
+static void makeChain(void) {
+    char formula[BENCH_FORMULA_LENGTH];
+    put(0, 0, "1");
+    for (unsigned y = 1; y < CHAIN_LENGTH; y++) {
+        sprintf(formula, "=SUM(A%u,1)", y);
+        put(0, y, formula);
+    }
+}
+
+// every cell depends on two cells of the row above it
+static void makeDiamond(void) {
+    char formula[BENCH_FORMULA_LENGTH], first[16], second[16];
+    for (unsigned x = 0; x < DIAMOND_WIDTH; x++) {
+        put(x, 0, "1");
+    }
+    for (unsigned y = 1; y < DIAMOND_DEPTH; y++) {
+        for (unsigned x = 0; x < DIAMOND_WIDTH; x++) {
+            cellName(x, y - 1, first);
+            cellName((x + 1) % DIAMOND_WIDTH, y - 1, second);
+            sprintf(formula, "=SUM(%s,MUL(%s,2))", first, second);
+            put(x, y, formula);
+        }
+    }
+}
+
+// a block of numbers folded by many range formulas
+static void makeRanges(void) {
+    char formula[BENCH_FORMULA_LENGTH], last[16];
+    const char *funcs[] = { "SUM", "MIN", "MAX", "MUL" };
+    for (unsigned x = 0; x < RANGE_COLS; x++) {
+        for (unsigned y = 0; y < RANGE_ROWS; y++) {
+            sprintf(formula, "%u", (x * 7919 + y * 104729) % 1000);
+            put(x, y, formula);
+        }
+    }
+    cellName(RANGE_COLS - 1, RANGE_ROWS - 1, last);
+    for (unsigned i = 0; i < RANGE_FORMULAS; i++) {
+        sprintf(formula, "=%s(A1:%s)", funcs[i % 4], last);
+        put(RANGE_COLS, i, formula);
+    }
+}
+
+static void makeConcat(void) {
+    char formula[BENCH_FORMULA_LENGTH];
+    put(0, 0, "item number");
+    for (unsigned y = 1; y < CONCAT_ROWS; y++) {
+        sprintf(formula, "=CONCAT(A1,TEXT(%u))", y);
+        put(1, y, formula);
+        sprintf(formula, "=CONCAT(B%u,CONCAT(\" - \",TEXT(FLOAT(B%u))))",
+                y + 1, y + 1);
+        put(2, y, formula);
+        sprintf(formula, "=CONCAT(C%u,C%u)", y + 1, y + 1);
+        put(3, y, formula);
+    }
+}
+
+// a mix of numbers, text and formulas
+static void makeFile(void) {
+    char formula[BENCH_FORMULA_LENGTH], left[16], up[16];
+    for (unsigned y = 0; y < FILE_ROWS; y++) {
+        for (unsigned x = 0; x < FILE_COLS; x++) {
+            if (x == 0 || y == 0) {
+                sprintf(formula, "%u", x + y);
+            } else if ((x + y) % 5 == 0) {
+                sprintf(formula, "text %u", x * y);
+            } else {
+                cellName(x - 1, y, left);
+                cellName(x, y - 1, up);
+                sprintf(formula, "=SUM(INT(%s),INT(%s))", left, up);
+            }
+            put(x, y, formula);
+        }
+    }
+}
+
+// time compiling every formula of the sheet
+static void benchParse(const char *sheet, size_t cells, Samples *samples) {
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        char *text = formulaText(cell->formula, cell->x, cell->y);
+        double start = now();
+        Formula *formula = compile(text, cell->x, cell->y);
+        addSample(samples, now() - start);
+        freeFormula(formula);
+        free(text);
+    }
+    report(sheet, "parse", cells, samples);
+}
+
+static void benchFullRecalc(const char *sheet, size_t cells,
+                            Samples *samples) {
+    for (int i = 0; i < RECALC_RUNS; i++) {
+        double start = now();
+        recalculateAll(NULL);
+        addSample(samples, now() - start);
+    }
+    report(sheet, "full_recalc", cells, samples);
+}
+
+// change the value of a single cell, alternating between two numbers
+static void benchEdit(const char *sheet, size_t cells, unsigned x,
+                      unsigned y, Samples *samples) {
+    for (int i = 0; i < EDIT_RUNS; i++) {
+        double start = now();
+        Cell *cell = touchCell(x, y);
+        setFormula(cell, i % 2 == 0 ? "2" : "1");
+        recalculate(cell, NULL);
+        addSample(samples, now() - start);
+    }
+    report(sheet, "incremental_recalc", cells, samples);
+}
+
+// format the cells visible on the screen the way the user interface does
+static void benchRender(const char *sheet, size_t cells, Samples *samples) {
+    char buffer[NUMBER_LENGTH], line[SIZE * 9 + 1];
+    for (int i = 0; i < RENDER_RUNS; i++) {
+        double start = now();
+        for (unsigned y = 0; y < SIZE; y++) {
+            for (unsigned x = 0; x < SIZE; x++) {
+                Cell *cell = findCell(x, y);
+                snprintf(line + x * 9, 10, "%-9.9s",
+                         cell == NULL ? "" : cellText(cell, buffer));
+            }
+            renderSink += line[0];
+        }
+        addSample(samples, now() - start);
+    }
+    report(sheet, "render", cells, samples);
+}
+
+static void benchFiles(const char *sheet, size_t cells, const char *path,
+                       Samples *samples) {
+    for (int i = 0; i < FILE_RUNS; i++) {
+        double start = now();
+        saveSheet(path, 0, 0);
+        addSample(samples, now() - start);
+    }
+    report(sheet, "save", cells, samples);
+
+    for (int i = 0; i < FILE_RUNS; i++) {
+        clearCells();
+        double start = now();
+        loadSheet(path, NULL);
+        addSample(samples, now() - start);
+    }
+    report(sheet, "load", cells, samples);
+    remove(path);
+}
+
+static void runSheet(const char *sheet, void (*make)(void), unsigned editX,
+                     unsigned editY, const char *path, Samples *samples) {
+    make();
+    size_t cells = countCells();
+    benchParse(sheet, cells, samples);
+    benchFullRecalc(sheet, cells, samples);
+    benchEdit(sheet, cells, editX, editY, samples);
+    benchRender(sheet, cells, samples);
+    if (path != NULL) {
+        benchFiles(sheet, cells, path, samples);
+    }
+    clearCells();
+}
+
+int main(int argc, char *argv[]) {
+    char *outputName = NULL, *path = "bench.sht";
+    unsigned threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputName = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--output file] [--threads N] "
+                    "[--file scratch.sht]\n", argv[0]);
+            return 2;
+        }
+    }
+    output = outputName == NULL ? stdout : fopen(outputName, "w");
+    if (output == NULL) {
+        fprintf(stderr, "cannot write %s\n", outputName);
+        return 1;
+    }
+
+    startPool(threads);
+    Samples samples = { NULL, 0, 0 };
+    fprintf(output, "{\"threads\": %u, \"results\": [", poolSize());
+    runSheet("chain", makeChain, 0, CHAIN_LENGTH / 2, NULL, &samples);
+    runSheet("diamond", makeDiamond, DIAMOND_WIDTH / 2, DIAMOND_DEPTH / 2,
+             NULL, &samples);
+    runSheet("ranges", makeRanges, 0, 0, NULL, &samples);
+    runSheet("concat", makeConcat, 0, 0, NULL, &samples);
+    runSheet("file", makeFile, FILE_COLS / 2, FILE_ROWS / 2, path, &samples);
+    fprintf(output, "\n]}\n");
+    stopPool();
+
+    free(samples.samples);
+    if (output != stdout) {
+        fclose(output);
+    }
+    return 0;
+}
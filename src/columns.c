@@ -0,0 +1,151 @@
+#include "sheet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// a structure-of-arrays copy of the values of the cells: every column is
+// split into pages of PAGE_ROWS rows holding the INT and FLOAT values in
+// contiguous arrays, a type tag per row (0 for rows holding nothing) and
+// a bitmap of the rows holding a number; pages are allocated only when at
+// least one of their rows holds a value, so range folds scan 8 bytes per
+// cell instead of whole cells scattered around the heap
+#define PAGE_ROWS 1024
+#define PAGE_WORDS (PAGE_ROWS / 64)
+#define NUM_PAGES (MAX_ROWS / PAGE_ROWS)
+
+typedef struct {
+    long long ints[PAGE_ROWS];
+    double fps[PAGE_ROWS];
+    char types[PAGE_ROWS];
+    unsigned long long numeric[PAGE_WORDS];
+    unsigned count; // rows with a type tag
+    unsigned nans; // FLOAT rows holding NaN
+} Page;
+
+static Page ***columns = NULL;
+
+static Page *findPage(unsigned x, unsigned y) {
+    if (columns == NULL || columns[x] == NULL) {
+        return NULL;
+    }
+    return columns[x][y / PAGE_ROWS];
+}
+
+static void clearRow(Page *page, unsigned row) {
+    if (page->types[row] == TYPE_FLOAT && isnan(page->fps[row])) {
+        page->nans--;
+    }
+    if (page->types[row] != 0) {
+        page->count--;
+    }
+    page->types[row] = 0;
+    page->numeric[row / 64] &= ~(1ULL << row % 64);
+}
+
+// copy the value of the cell to its column; this is not thread-safe
+// (rows share the words of the bitmap), it is called by recalculate()
+// for the cells of a level only once the whole level has been evaluated;
+// the lookup indexes holding the cell are dropped on the way
+void updateColumn(const Cell *cell) {
+    invalidateLookups(cell->x, cell->y);
+    if (columns == NULL) {
+        columns = calloc(MAX_COLS, sizeof(Page **));
+    }
+    if (columns[cell->x] == NULL) {
+        columns[cell->x] = calloc(NUM_PAGES, sizeof(Page *));
+    }
+    Page **page = &columns[cell->x][cell->y / PAGE_ROWS];
+    if (*page == NULL) {
+        *page = calloc(1, sizeof(Page));
+    }
+
+    unsigned row = cell->y % PAGE_ROWS;
+    clearRow(*page, row);
+    (*page)->types[row] = cell->value.type;
+    (*page)->count++;
+    if (cell->value.type == TYPE_INT) {
+        (*page)->ints[row] = AS_INT(cell->value);
+        (*page)->numeric[row / 64] |= 1ULL << row % 64;
+    } else if (cell->value.type == TYPE_FLOAT) {
+        (*page)->fps[row] = AS_FLOAT(cell->value);
+        (*page)->numeric[row / 64] |= 1ULL << row % 64;
+        if (isnan(AS_FLOAT(cell->value))) {
+            (*page)->nans++;
+        }
+    }
+}
+
+// forget the value of a cell which is being freed
+void clearColumn(unsigned x, unsigned y) {
+    invalidateLookups(x, y);
+    Page *page = findPage(x, y);
+    if (page == NULL) {
+        return;
+    }
+    clearRow(page, y % PAGE_ROWS);
+    if (page->count == 0) {
+        free(page);
+        columns[x][y / PAGE_ROWS] = NULL;
+    }
+}
+
+void clearColumns(void) {
+    if (columns == NULL) {
+        return;
+    }
+    for (unsigned x = 0; x < MAX_COLS; x++) {
+        if (columns[x] != NULL) {
+            for (unsigned i = 0; i < NUM_PAGES; i++) {
+                free(columns[x][i]);
+            }
+            free(columns[x]);
+        }
+    }
+    free(columns);
+    columns = NULL;
+}
+
+// check whether all bits from first to last (inclusive) are set
+static bool allNumeric(const Page *page, unsigned first, unsigned last) {
+    for (unsigned word = first / 64; word <= last / 64; word++) {
+        unsigned long long mask = ~0ULL;
+        if (word == first / 64) {
+            mask &= ~0ULL << first % 64;
+        }
+        if (word == last / 64 && last % 64 != 63) {
+            mask &= (1ULL << (last % 64 + 1)) - 1;
+        }
+        if ((page->numeric[word] & mask) != mask) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// find the values of column x from row y on, up to row last or the end
+// of the page, whichever comes first; returns FALSE unless all of them
+// are numbers of the same type
+bool numericSpan(unsigned x, unsigned y, unsigned last, ColumnSpan *span) {
+    Page *page = findPage(x, y);
+    if (page == NULL) {
+        return FALSE;
+    }
+    unsigned first = y % PAGE_ROWS;
+    unsigned end = last / PAGE_ROWS == y / PAGE_ROWS ?
+                   last % PAGE_ROWS : PAGE_ROWS - 1;
+    if (!allNumeric(page, first, end)) {
+        return FALSE;
+    }
+    char type = page->types[first];
+    for (unsigned row = first + 1; row <= end; row++) {
+        if (page->types[row] != type) {
+            return FALSE;
+        }
+    }
+    span->type = type;
+    span->length = end - first + 1;
+    span->values = type == TYPE_INT ? (const void *)(page->ints + first) :
+                                      (const void *)(page->fps + first);
+    span->hasNaN = type == TYPE_FLOAT && page->nans > 0;
+    return TRUE;
+}
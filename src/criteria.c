@@ -0,0 +1,292 @@
+#include "sheet.h"
+#include "funcs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+// the conditional aggregates (SUMIF, COUNTIF, AVERAGEIF, SUMIFS and
+// COUNTIFS); criteria written into the formula are compiled along with it,
+// the others every time they are evaluated; the ranges are then scanned
+// once, a block of rows at a time: every criterion narrows down a mask
+// of the rows of the block and the values left are folded right away
+//
+// numeric criteria are applied to spans of columns holding only numbers
+// with the vectorized kernels (see selectNumbers()), anything else is
+// matched cell by cell
+//
+// numbers only match numbers and TEXT only matches TEXT (ignoring case,
+// * and ? are wildcards when looking for equal TEXT); cells holding errors
+// never match, "<>" negates "=" and so matches everything else
+
+// rows of a block (the length of the masks)
+#define BLOCK_ROWS 256
+
+// the result of comparing a cell with a criterion it cannot be ordered with
+#define UNORDERED 2
+
+// criteria start with one of these (= is assumed if there is none)
+static const struct {
+    const char *symbol;
+    char op;
+} operators[] = {
+    { "<>", CRITERION_NE },
+    { "<=", CRITERION_LE },
+    { ">=", CRITERION_GE },
+    { "=", CRITERION_EQ },
+    { "<", CRITERION_LT },
+    { ">", CRITERION_GT }
+};
+
+// a number means an equal number, TEXT is parsed into the operator and
+// the operand; the TEXT of the operand is allocated in the arena
+bool compileCriterion(Value condition, Criterion *criterion, Arena *arena) {
+    criterion->op = CRITERION_EQ;
+    criterion->wildcard = FALSE;
+    if (condition.type == TYPE_INT || condition.type == TYPE_FLOAT) {
+        criterion->operand = condition;
+        return TRUE;
+    }
+    if (condition.type != TYPE_TEXT) {
+        return FALSE;
+    }
+    const char *text = AS_TEXT(condition);
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        size_t length = strlen(operators[i].symbol);
+        if (strncmp(text, operators[i].symbol, length) == 0) {
+            criterion->op = operators[i].op;
+            text += length;
+            break;
+        }
+    }
+    if (!inferNumber(text, &criterion->operand)) {
+        criterion->operand = makeText(text, strlen(text), arena);
+        criterion->wildcard = (criterion->op == CRITERION_EQ ||
+                               criterion->op == CRITERION_NE) &&
+                              strpbrk(text, "*?") != NULL;
+    }
+    return TRUE;
+}
+
+// free a criterion compiled into a formula (with the operand on the heap)
+void freeCriterion(Criterion *criterion) {
+    if (IS_LONG_TEXT(criterion->operand)) {
+        free(criterion->operand.data.text);
+    }
+    free(criterion);
+}
+
+static bool matchWildcard(const char *pattern, const char *text) {
+    const char *star = NULL, *resume = NULL;
+    while (*text != '\0') {
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = text;
+        } else if (*pattern != '\0' && (*pattern == '?' ||
+                   tolower((unsigned char)*pattern) ==
+                   tolower((unsigned char)*text))) {
+            pattern++;
+            text++;
+        } else if (star != NULL) {
+            pattern = star;
+            text = ++resume;
+        } else {
+            return FALSE;
+        }
+    }
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+static int compareText(const char *first, const char *second) {
+    const unsigned char *a = (const unsigned char *)first;
+    const unsigned char *b = (const unsigned char *)second;
+    while (*a != '\0' && tolower(*a) == tolower(*b)) {
+        a++;
+        b++;
+    }
+    int order = tolower(*a) - tolower(*b);
+    return order < 0 ? -1 : order > 0;
+}
+
+// order the value with respect to the operand (-1, 0, 1 or UNORDERED)
+static int compareOperand(const Criterion *criterion, Value value) {
+    Value operand = criterion->operand;
+    if (operand.type == TYPE_TEXT) {
+        if (value.type != TYPE_TEXT) {
+            return UNORDERED;
+        }
+        if (AS_TEXT(operand)[0] == '\0' || AS_TEXT(value)[0] == '\0') {
+            return AS_TEXT(operand)[0] == AS_TEXT(value)[0] ? 0 : UNORDERED;
+        }
+        if (criterion->wildcard) {
+            return matchWildcard(AS_TEXT(operand), AS_TEXT(value)) ?
+                   0 : UNORDERED;
+        }
+        return compareText(AS_TEXT(value), AS_TEXT(operand));
+    }
+    long long integer;
+    if (value.type == TYPE_INT && isIntegral(operand, &integer)) {
+        return AS_INT(value) < integer ? -1 : AS_INT(value) > integer;
+    }
+    if (value.type != TYPE_INT && value.type != TYPE_FLOAT) {
+        return UNORDERED;
+    }
+    double x = value.type == TYPE_INT ? AS_INT(value) : AS_FLOAT(value);
+    double y = operand.type == TYPE_INT ? AS_INT(operand) : AS_FLOAT(operand);
+    return x < y ? -1 : x > y ? 1 : x == y ? 0 : UNORDERED;
+}
+
+bool matchCriterion(const Criterion *criterion, Value value) {
+    if (value.type == TYPE_ERROR) {
+        return FALSE;
+    }
+    int order = compareOperand(criterion, value);
+    switch (criterion->op) {
+        case CRITERION_EQ: return order == 0;
+        case CRITERION_NE: return order != 0;
+        case CRITERION_LT: return order == -1;
+        case CRITERION_LE: return order == -1 || order == 0;
+        case CRITERION_GT: return order == 1;
+        default: return order == 1 || order == 0;
+    }
+}
+
+static Value readCell(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    return cell == NULL ? makeText("", 0, NULL) : cell->value;
+}
+
+// a span can be handed to the kernels if the criterion is numeric and
+// (for INT values) integral
+static bool isVectorizable(const Criterion *criterion, const ColumnSpan *span) {
+    long long integer;
+    if (criterion->operand.type == TYPE_TEXT) {
+        return FALSE;
+    }
+    return span->type == TYPE_FLOAT || isIntegral(criterion->operand, &integer);
+}
+
+// count the rows of the ranges (all of the same size) matching all of the
+// criteria, or sum (average) the values of the target range in those rows;
+// the sum is an INT unless a FLOAT was summed, FLOAT values are summed in
+// the same order as by SUM() (see kernels.c) and errors in the rows summed
+// are the result
+Value conditionalAggregate(int kind, const Range *target, const Range *ranges,
+                           const Criterion **criteria, unsigned count) {
+    unsigned width = ranges[0].x2 - ranges[0].x1 + 1;
+    unsigned height = ranges[0].y2 - ranges[0].y1 + 1;
+    unsigned char mask[BLOCK_ROWS];
+    long long ints[BLOCK_ROWS];
+    double fps[BLOCK_ROWS];
+    // the spans of the ranges and of the target (the last one)
+    ColumnSpan spans[MAX_CRITERIA + 1];
+    bool numeric[MAX_CRITERIA + 1];
+
+    Aggregate intSum, fpSum;
+    startAggregate(&intSum, AGGREGATE_SUM, TYPE_INT);
+    startAggregate(&fpSum, AGGREGATE_SUM, TYPE_FLOAT);
+    unsigned long long matched = 0, numInts = 0, numFps = 0;
+    Value ret;
+
+    for (unsigned dx = 0; dx < width; dx++) {
+        unsigned length;
+        for (unsigned dy = 0; dy < height; dy += length) {
+            length = height - dy < BLOCK_ROWS ? height - dy : BLOCK_ROWS;
+            // the block ends where a span of numbers does
+            for (unsigned k = 0; k <= count; k++) {
+                const Range *range = k < count ? &ranges[k] : target;
+                numeric[k] = range != NULL &&
+                             numericSpan(range->x1 + dx, range->y1 + dy,
+                                         range->y1 + dy + length - 1,
+                                         &spans[k]) &&
+                             (k == count ||
+                              isVectorizable(criteria[k], &spans[k]));
+                if (numeric[k] && spans[k].length < length) {
+                    length = spans[k].length;
+                }
+            }
+
+            memset(mask, 1, length);
+            for (unsigned k = 0; k < count; k++) {
+                if (numeric[k]) {
+                    selectNumbers(criteria[k], &spans[k], length, mask);
+                    continue;
+                }
+                for (unsigned i = 0; i < length; i++) {
+                    if (mask[i] && !matchCriterion(criteria[k],
+                            readCell(ranges[k].x1 + dx, ranges[k].y1 + dy + i))) {
+                        mask[i] = 0;
+                    }
+                }
+            }
+
+            if (target == NULL) {
+                for (unsigned i = 0; i < length; i++) {
+                    matched += mask[i];
+                }
+            } else if (numeric[count]) {
+                // gather the values selected and fold them all at once
+                unsigned selected = 0;
+                if (spans[count].type == TYPE_INT) {
+                    const long long *values = spans[count].values;
+                    for (unsigned i = 0; i < length; i++) {
+                        ints[selected] = values[i];
+                        selected += mask[i];
+                    }
+                    addToAggregate(&intSum, ints, selected);
+                    numInts += selected;
+                } else {
+                    const double *values = spans[count].values;
+                    for (unsigned i = 0; i < length; i++) {
+                        fps[selected] = values[i];
+                        selected += mask[i];
+                    }
+                    addToAggregate(&fpSum, fps, selected);
+                    numFps += selected;
+                }
+            } else {
+                for (unsigned i = 0; i < length; i++) {
+                    if (!mask[i]) {
+                        continue;
+                    }
+                    Value value = readCell(target->x1 + dx, target->y1 + dy + i);
+                    if (value.type == TYPE_ERROR) {
+                        return value;
+                    } else if (value.type == TYPE_INT) {
+                        addToAggregate(&intSum, &AS_INT(value), 1);
+                        numInts++;
+                    } else if (value.type == TYPE_FLOAT) {
+                        addToAggregate(&fpSum, &AS_FLOAT(value), 1);
+                        numFps++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (kind == CONDITIONAL_COUNT) {
+        ret.type = TYPE_INT;
+        AS_INT(ret) = matched;
+        return ret;
+    }
+    Value sum = finishAggregate(&intSum);
+    if (numFps > 0) {
+        double total = AS_INT(sum) + AS_FLOAT(finishAggregate(&fpSum));
+        sum.type = TYPE_FLOAT;
+        AS_FLOAT(sum) = total;
+    }
+    if (kind == CONDITIONAL_SUM) {
+        return sum;
+    }
+    if (numInts + numFps == 0) {
+        SET_ERROR(ret, ERROR_DIV_0);
+        return ret;
+    }
+    ret.type = TYPE_FLOAT;
+    AS_FLOAT(ret) = (sum.type == TYPE_INT ? AS_INT(sum) : AS_FLOAT(sum)) /
+                    (numInts + numFps);
+    return ret;
+}
@@ -0,0 +1,438 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// CSV (and TSV) files: records are separated by LF (or CRLF) and their
+// fields by the separator; in a CSV file a field starting with a double
+// quote is enclosed in quotes to hold commas or line breaks, "" standing
+// for a quote in it (a quote anywhere else is just a character), while
+// TSV has no quoting at all, so its fields cannot hold tabs or line
+// breaks; every field is read like text typed into its cell (so 12 is a
+// number and =SUM(A1:A9) a formula), empty fields leave their cells empty
+//
+// the file is imported a round of chunks at a time: the chunks are cut at
+// record boundaries (found by scanning them all at once from every state
+// they could start in, see scanChunk()) and parsed by the threads of the
+// pool straight into the values of their cells, then the cells of the
+// round are filled in one row after another;
+// only formulas are kept as text, to be loaded in bulk at the end (see
+// beginLoad()), so the import holds the text of the file's formulas until
+// then; the export writes the values row by row and only keeps the number
+// of fields of every row
+
+// bytes of the file parsed by a single task of the thread pool
+#define CHUNK_BYTES (256 * 1024)
+// chunks parsed in a round for every thread
+#define ROUND_CHUNKS 2
+
+// where the parser is in a field: at its start, in an unquoted field, in
+// a quoted one or right after a quote in a quoted field (which ends the
+// quotes unless another quote follows)
+#define FIELD_START 0
+#define FIELD_PLAIN 1
+#define FIELD_QUOTED 2
+#define FIELD_CLOSING 3
+#define NUM_STATES 4
+
+// a non-empty field parsed from the file
+typedef struct {
+    unsigned x, row; // the row counts from the first record of the chunk
+    const char *formula; // interned (NULL for a formula, kept as text)
+    size_t text; // where the formula starts in the texts of the chunk
+    Value result, value;
+} Field;
+
+// a part of the file parsed by a single task
+typedef struct {
+    size_t start, end; // the bytes of the file, whole records
+    // the state after the bytes up to the next chunk, for every state
+    // they could start in
+    int states[NUM_STATES];
+    Field *fields;
+    size_t numFields, fieldsCapacity;
+    char *texts; // the formulas, one after another, '\0'-terminated
+    size_t textsLength, textsCapacity;
+    char *field; // the field being parsed
+    size_t fieldLength, fieldCapacity;
+    unsigned rows; // number of records
+} Chunk;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    char separator;
+    bool quoting; // FALSE for TSV
+    Chunk *chunks;
+    unsigned numChunks;
+} Import;
+
+// the separator of the files named *.csv (comma) or *.tsv (tab), '\0' for
+// any other file
+char csvSeparator(const char *fileName) {
+    size_t length = strlen(fileName);
+    if (length >= 4 && strcasecmp(fileName + length - 4, ".csv") == 0) {
+        return ',';
+    }
+    if (length >= 4 && strcasecmp(fileName + length - 4, ".tsv") == 0) {
+        return '\t';
+    }
+    return '\0';
+}
+
+static void appendChars(char **chars, size_t *length, size_t *capacity,
+                        const char *text, size_t size) {
+    if (*length + size > *capacity) {
+        while (*length + size > *capacity) {
+            *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        }
+        *chars = realloc(*chars, *capacity);
+    }
+    memcpy(*chars + *length, text, size);
+    *length += size;
+}
+
+// the state of the parser after a character (see parseChunk())
+static int nextState(const Import *import, int state, char c) {
+    if (state == FIELD_QUOTED) {
+        return c == '"' ? FIELD_CLOSING : FIELD_QUOTED;
+    }
+    if (c == '"' && import->quoting &&
+        (state == FIELD_START || state == FIELD_CLOSING)) {
+        return FIELD_QUOTED;
+    }
+    return c == import->separator || c == '\n' ? FIELD_START : FIELD_PLAIN;
+}
+
+// the first record starting after the given byte, before which the parser
+// is in the given state
+static size_t nextRecord(const Import *import, size_t pos, int state) {
+    for (; pos < import->size; pos++) {
+        state = nextState(import, state, import->data[pos]);
+        if (state == FIELD_START && import->data[pos] == '\n') {
+            return pos + 1;
+        }
+    }
+    return import->size;
+}
+
+// find the state after the bytes of a chunk for every state it could start
+// in; these mostly end up the same at the first separator or line break,
+// from which a single state is followed
+static void scanChunk(size_t index, unsigned worker, void *arg) {
+    Import *import = arg;
+    Chunk *chunk = &import->chunks[index];
+    int *states = chunk->states;
+    for (int state = 0; state < NUM_STATES; state++) {
+        states[state] = state;
+    }
+    size_t pos = chunk->start;
+    bool same = FALSE;
+    for (; pos < chunk->end && !same; pos++) {
+        same = TRUE;
+        for (int state = 0; state < NUM_STATES; state++) {
+            states[state] = nextState(import, states[state],
+                                      import->data[pos]);
+            same = same && states[state] == states[0];
+        }
+    }
+    if (same) {
+        int state = states[0];
+        for (; pos < chunk->end; pos++) {
+            state = nextState(import, state, import->data[pos]);
+        }
+        for (int i = 0; i < NUM_STATES; i++) {
+            states[i] = state;
+        }
+    }
+}
+
+// store the field just parsed (unless it is empty)
+static void addField(Chunk *chunk, unsigned x) {
+    if (chunk->fieldLength == 0 || x >= MAX_COLS) {
+        chunk->fieldLength = 0;
+        return;
+    }
+    if (chunk->numFields == chunk->fieldsCapacity) {
+        chunk->fieldsCapacity = chunk->fieldsCapacity == 0 ? 256 :
+                                chunk->fieldsCapacity * 2;
+        chunk->fields = realloc(chunk->fields,
+                                chunk->fieldsCapacity * sizeof(Field));
+    }
+    Field *field = &chunk->fields[chunk->numFields++];
+    field->x = x;
+    field->row = chunk->rows;
+    appendChars(&chunk->field, &chunk->fieldLength, &chunk->fieldCapacity,
+                "", 1);
+    size_t length = chunk->fieldLength - 1;
+    if (chunk->field[0] == '=') {
+        // compiled once the cell is known
+        field->formula = NULL;
+        field->text = chunk->textsLength;
+        appendChars(&chunk->texts, &chunk->textsLength,
+                    &chunk->textsCapacity, chunk->field, length + 1);
+    } else {
+        // the position only matters for formulas
+        field->formula = internFormula(chunk->field, length, x, 0);
+        field->result = makeText(chunk->field, length, NULL);
+        field->value = castValue(field->result, TYPE_AUTO);
+    }
+    chunk->fieldLength = 0;
+}
+
+static void parseChunk(size_t index, unsigned worker, void *arg) {
+    Import *import = arg;
+    Chunk *chunk = &import->chunks[index];
+    const char *data = import->data;
+    char separator = import->separator;
+    chunk->numFields = chunk->textsLength = chunk->fieldLength = 0;
+    chunk->rows = 0;
+    unsigned x = 0;
+    int state = FIELD_START;
+    for (size_t pos = chunk->start; pos < chunk->end; pos++) {
+        char c = data[pos];
+        int previous = state;
+        state = nextState(import, state, c);
+        if (state == FIELD_QUOTED && previous != FIELD_QUOTED) {
+            // the opening quote, or the second quote of ""
+            if (previous == FIELD_CLOSING) {
+                appendChars(&chunk->field, &chunk->fieldLength,
+                            &chunk->fieldCapacity, "\"", 1);
+            }
+        } else if (state == FIELD_CLOSING) {
+            continue;
+        } else if (state != FIELD_START) {
+            // the line break of CRLF is dropped outside quotes
+            if (state == FIELD_QUOTED || c != '\r' || pos + 1 == chunk->end ||
+                data[pos + 1] != '\n') {
+                appendChars(&chunk->field, &chunk->fieldLength,
+                            &chunk->fieldCapacity, &data[pos], 1);
+            }
+        } else if (c == separator) {
+            addField(chunk, x++);
+        } else {
+            addField(chunk, x);
+            x = 0;
+            chunk->rows++;
+        }
+    }
+    // the last record of the file need not end with a line break
+    if (chunk->end > chunk->start && data[chunk->end - 1] != '\n') {
+        addField(chunk, x);
+        chunk->rows++;
+    }
+}
+
+// fill in the cells parsed from a chunk, whose first record is the given row
+static void storeChunk(Chunk *chunk, unsigned firstRow,
+                       void (*updated)(Cell *)) {
+    for (size_t i = 0; i < chunk->numFields; i++) {
+        Field *field = &chunk->fields[i];
+        if (firstRow + field->row >= MAX_ROWS) {
+            // past the last row of the sheet (the value shares the text)
+            if (field->formula != NULL) {
+                releaseFormula(field->formula);
+                if (IS_LONG_TEXT(field->result)) {
+                    free(field->result.data.text);
+                }
+            }
+            continue;
+        }
+        Cell *cell = touchCell(field->x, firstRow + field->row);
+        if (field->formula == NULL) {
+            loadFormula(cell, chunk->texts + field->text);
+            continue;
+        }
+        releaseFormula(cell->formula);
+        cell->formula = field->formula;
+        cell->compiled = NULL;
+        if (cell->type == TYPE_AUTO) {
+            setCellValues(cell, field->result, field->value);
+        } else {
+            setCellResult(cell, field->result);
+        }
+        updateColumn(cell);
+        if (updated != NULL) {
+            updated(cell);
+        }
+    }
+}
+
+// import a CSV (or TSV) file into an empty sheet, the callback (if any) is
+// called for every loaded cell; returns FALSE if the file could not be read
+bool importCSV(const char *fileName, char separator,
+               void (*updated)(Cell *)) {
+    int file = open(fileName, O_RDONLY);
+    if (file < 0) {
+        return FALSE;
+    }
+    struct stat info;
+    if (fstat(file, &info) != 0) {
+        close(file);
+        return FALSE;
+    }
+    Import import = { NULL, info.st_size, separator, separator != '\t',
+                      NULL, 0 };
+    if (import.size == 0) {
+        close(file);
+        return TRUE;
+    }
+    void *data = mmap(NULL, import.size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        return FALSE;
+    }
+    import.data = data;
+    import.numChunks = poolSize() * ROUND_CHUNKS;
+    import.chunks = calloc(import.numChunks, sizeof(Chunk));
+
+    beginLoad();
+    size_t pos = 0;
+    unsigned row = 0;
+    while (pos < import.size && row < MAX_ROWS) {
+        // the chunks of the round start at records: the state of the parser
+        // at the end of every chunk follows from the one at its start
+        unsigned count = 0;
+        for (; count < import.numChunks; count++) {
+            size_t start = pos + (size_t)count * CHUNK_BYTES;
+            if (start >= import.size) {
+                break;
+            }
+            import.chunks[count].start = start;
+            import.chunks[count].end = start + CHUNK_BYTES < import.size ?
+                                       start + CHUNK_BYTES : import.size;
+        }
+        if (import.quoting) {
+            runParallel(count, scanChunk, &import);
+        }
+        int state = FIELD_START;
+        for (unsigned i = 0; i < count; i++) {
+            Chunk *chunk = &import.chunks[i];
+            // without quotes every line break ends a record
+            state = import.quoting ? chunk->states[state] : FIELD_START;
+            // a record may run past the end of the next chunks
+            chunk->end = chunk->end < chunk->start ? chunk->start :
+                         nextRecord(&import, chunk->end, state);
+            if (i + 1 < count) {
+                import.chunks[i + 1].start = chunk->end;
+            }
+        }
+        runParallel(count, parseChunk, &import);
+
+        for (unsigned i = 0; i < count; i++) {
+            storeChunk(&import.chunks[i], row, updated);
+            row = row + import.chunks[i].rows < MAX_ROWS ?
+                  row + import.chunks[i].rows : MAX_ROWS;
+        }
+        pos = import.chunks[count - 1].end;
+    }
+    commitLoad(updated);
+
+    for (unsigned i = 0; i < import.numChunks; i++) {
+        free(import.chunks[i].fields);
+        free(import.chunks[i].texts);
+        free(import.chunks[i].field);
+    }
+    free(import.chunks);
+    munmap(data, import.size);
+    return TRUE;
+}
+
+// write a field, quoted if it holds commas, quotes or line breaks; TSV has
+// no quotes, so tabs and line breaks are written as spaces
+static void writeField(FILE *file, const char *text, char separator) {
+    if (separator == '\t') {
+        for (; *text != '\0'; text++) {
+            putc(strchr("\t\r\n", *text) != NULL ? ' ' : *text, file);
+        }
+        return;
+    }
+    if (strchr(text, separator) == NULL && strpbrk(text, "\"\r\n") == NULL) {
+        fputs(text, file);
+        return;
+    }
+    putc('"', file);
+    for (; *text != '\0'; text++) {
+        if (*text == '"') {
+            putc('"', file);
+        }
+        putc(*text, file);
+    }
+    putc('"', file);
+}
+
+// the value of a cell as exported: numbers are written in full (the
+// shortest way that reads back the same), unlike the three decimals shown
+// by cellText(), so they survive being imported again
+static const char *exportText(const Cell *cell, char *buffer) {
+    if (cell->result.type == TYPE_INT) {
+        sprintf(buffer, "%lld", AS_INT(cell->result));
+    } else if (cell->result.type == TYPE_FLOAT) {
+        double number = AS_FLOAT(cell->result);
+        sprintf(buffer, "%.15g", number);
+        if (strtod(buffer, NULL) != number) {
+            sprintf(buffer, "%.17g", number);
+        }
+    } else {
+        return cellText(cell, buffer);
+    }
+    return buffer;
+}
+
+// export the values of the cells holding data, row by row
+// from A1 on; returns FALSE if the file could not be written
+bool exportCSV(const char *fileName, char separator) {
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL) {
+        return FALSE;
+    }
+
+    // the number of fields of every row
+    unsigned *widths = NULL;
+    size_t rows = 0;
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        if (cell->formula[0] == '\0') {
+            continue;
+        }
+        if (cell->y >= rows) {
+            size_t grown = rows == 0 ? 256 : rows;
+            while (grown <= cell->y) {
+                grown *= 2;
+            }
+            widths = realloc(widths, grown * sizeof(unsigned));
+            memset(widths + rows, 0, (grown - rows) * sizeof(unsigned));
+            rows = grown;
+        }
+        if (cell->x >= widths[cell->y]) {
+            widths[cell->y] = cell->x + 1;
+        }
+    }
+    while (rows > 0 && widths[rows - 1] == 0) {
+        rows--;
+    }
+
+    char buffer[NUMBER_LENGTH];
+    for (unsigned y = 0; y < rows; y++) {
+        for (unsigned x = 0; x < widths[y]; x++) {
+            if (x > 0) {
+                putc(separator, file);
+            }
+            cell = findCell(x, y);
+            if (cell != NULL && cell->formula[0] != '\0') {
+                writeField(file, exportText(cell, buffer), separator);
+            }
+        }
+        putc('\n', file);
+    }
+    free(widths);
+    bool success = !ferror(file);
+    return fclose(file) == 0 && success;
+}
@@ -0,0 +1,593 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// levels smaller than this are not worth spreading among threads
+#define PARALLEL_THRESHOLD 64
+// number of cells evaluated by a single task of the thread pool
+#define CHUNK_SIZE 16
+// runs of cells sharing a formula shorter than this are evaluated cell by
+// cell, longer ones are split into tasks of at most MAX_RUN cells
+#define MIN_RUN 8
+#define MAX_RUN 4096
+// marks of the cells of the level being cut into tasks (in their pending
+// counts, which are 0 for the cells of a level)
+#define IN_LEVEL ((unsigned)-1)
+#define IN_RUN ((unsigned)-2)
+// number of cells evaluated by a background recalculation between the
+// moments it lets the user interface at the sheet
+#define SLICE_SIZE 256
+
+// this is needed to allow the user to force types for cells
+char types[NUM_TYPES] = {TYPE_AUTO, TYPE_INT, TYPE_FLOAT, TYPE_TEXT};
+
+// growable list of cells taking part in a recalculation
+typedef struct {
+    Cell **cells;
+    size_t length, capacity;
+} CellList;
+
+// cells whose formulas were set during a bulk load; they are kept by
+// position since linking the dependencies may free cells left empty
+static Position *loaded = NULL;
+static size_t numLoaded = 0, loadedCapacity = 0;
+
+static void pushCell(CellList *list, Cell *cell) {
+    if (list->length == list->capacity) {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->cells = realloc(list->cells, list->capacity * sizeof(Cell *));
+    }
+    list->cells[list->length++] = cell;
+}
+
+// give the cell its (interned) formula, replacing the one it held
+static void replaceFormula(Cell *cell, const char *formula) {
+    const char *interned = internFormula(formula, strlen(formula), cell->x,
+                                         cell->y);
+    releaseFormula(cell->formula);
+    cell->formula = interned;
+    cell->compiled = compiledFormula(interned, cell->x, cell->y);
+}
+
+// compile a new formula for the cell and link it with its dependencies
+// (a formula held by other cells is already compiled)
+void setFormula(Cell *cell, const char *formula) {
+    replaceFormula(cell, formula);
+    linkRefs(cell->compiled, cell->x, cell->y);
+}
+
+// store the result of the cell's formula; if an error was thrown,
+// "freeze" the cell, input needs to be entered again
+void storeResult(Cell *cell, Value value) {
+    if (value.type == TYPE_ERROR) {
+        cell->type = TYPE_ERROR;
+    } else {
+        cell->type = types[cell->curType];
+    }
+    setCellResult(cell, value);
+}
+
+// run the cell's formula and store its result
+void evaluateCell(Cell *cell, Arena *arena) {
+    storeResult(cell, evaluate(cell->compiled, cell->x, cell->y, arena));
+}
+
+// a part of a level evaluated by a single task of the thread pool: a chunk
+// of cells or a run of cells sharing a formula (see evaluateRun())
+typedef struct {
+    size_t start, length;
+    bool run;
+} Task;
+
+// a level of cells along with the arenas of the workers evaluating it
+typedef struct {
+    CellList cells;
+    Arena *arenas;
+    Task *tasks;
+    size_t numTasks, tasksCapacity;
+    Cell **order; // the cells being reordered by planLevel()
+    size_t capacity;
+} Level;
+
+static void addTask(Level *level, size_t start, size_t length, bool run) {
+    if (level->numTasks == level->tasksCapacity) {
+        level->tasksCapacity = level->tasksCapacity == 0 ?
+                               16 : level->tasksCapacity * 2;
+        level->tasks = realloc(level->tasks,
+                               level->tasksCapacity * sizeof(Task));
+    }
+    Task *task = &level->tasks[level->numTasks++];
+    task->start = start;
+    task->length = length;
+    task->run = run;
+}
+
+// the cell of the level holding the same formula as the given cell, dy
+// rows below it (NULL if there is none); the cells of the level being
+// planned are marked in their pending counts, which are 0 otherwise
+static Cell *runNeighbor(const Cell *cell, int dy) {
+    if ((dy < 0 && cell->y == 0) || cell->y + dy >= MAX_ROWS) {
+        return NULL;
+    }
+    Cell *neighbor = findCell(cell->x, cell->y + dy);
+    if (neighbor == NULL || neighbor->formula != cell->formula ||
+        (neighbor->pending != IN_LEVEL && neighbor->pending != IN_RUN)) {
+        return NULL;
+    }
+    return neighbor;
+}
+
+// cut the level into tasks: runs of at least MIN_RUN cells holding the
+// same formula one below another, evaluated a column at a time if the
+// formula allows it (see isColumnFormula()), and chunks of CHUNK_SIZE
+// other cells; the runs are moved to the front of the level (the order of
+// the cells of a level does not matter); the profiler times every cell by
+// itself, so there are no runs while it runs
+static void planLevel(Level *level) {
+    Cell **cells = level->cells.cells;
+    size_t length = level->cells.length, marked = 0, runCells = 0;
+    level->numTasks = 0;
+    for (size_t i = 0; i < length && length >= MIN_RUN && !profiling; i++) {
+        Cell *cell = cells[i];
+        if (cell->formula[0] != '=') {
+            continue;
+        }
+        if (cell->compiled == NULL) {
+            cell->compiled = compiledFormula(cell->formula, cell->x, cell->y);
+        }
+        if (isColumnFormula(cell->compiled)) {
+            cell->pending = IN_LEVEL;
+            marked++;
+        }
+    }
+    if (marked >= MIN_RUN) {
+        if (level->capacity < length) {
+            level->capacity = length;
+            level->order = realloc(level->order, length * sizeof(Cell *));
+        }
+        // every run is found from its first cell
+        for (size_t i = 0; i < length; i++) {
+            Cell *first = cells[i];
+            if (first->pending != IN_LEVEL || runNeighbor(first, 1) == NULL ||
+                runNeighbor(first, -1) != NULL) {
+                continue;
+            }
+            size_t count = 2;
+            while (runNeighbor(first, count) != NULL) {
+                count++;
+            }
+            if (count < MIN_RUN) {
+                continue;
+            }
+            for (size_t j = 0; j < count; j++) {
+                Cell *cell = j == 0 ? first : runNeighbor(first, j);
+                cell->compiled = first->compiled;
+                cell->pending = IN_RUN;
+                level->order[runCells + j] = cell;
+                if (j % MAX_RUN == 0) {
+                    addTask(level, runCells + j, count - j < MAX_RUN ?
+                            count - j : MAX_RUN, TRUE);
+                }
+            }
+            runCells += count;
+        }
+    }
+    if (runCells > 0) {
+        size_t other = runCells;
+        for (size_t i = 0; i < length; i++) {
+            if (cells[i]->pending != IN_RUN) {
+                level->order[other++] = cells[i];
+            }
+        }
+        memcpy(cells, level->order, length * sizeof(Cell *));
+    }
+    for (size_t i = 0; i < length && marked > 0; i++) {
+        cells[i]->pending = 0;
+    }
+    for (size_t i = runCells; i < length; i += CHUNK_SIZE) {
+        addTask(level, i, length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE,
+                FALSE);
+    }
+}
+
+// evaluate a task's cells, which do not depend on each other
+static void evaluateTask(size_t index, unsigned worker, void *arg) {
+    Level *level = arg;
+    Task *task = &level->tasks[index];
+    Cell **cells = level->cells.cells + task->start;
+    Arena *arena = &level->arenas[worker];
+    if (task->run) {
+        evaluateRun(cells, task->length, arena);
+        return;
+    }
+    for (size_t i = 0; i < task->length; i++) {
+        Cell *cell = cells[i];
+        if (cell->compiled == NULL) {
+            cell->compiled = compiledFormula(cell->formula, cell->x, cell->y);
+        }
+        evaluateCell(cell, arena);
+    }
+}
+
+static void markCell(Cell *cell, void *list) {
+    if (!cell->dirty) {
+        cell->dirty = TRUE;
+        pushCell(list, cell);
+    }
+}
+
+// collect the cell and everything that (transitively) depends on it
+static void markDirty(Cell *root, CellList *list) {
+    size_t i = list->length;
+    markCell(root, list);
+    for (; i < list->length; i++) {
+        forEachDependent(list->cells[i], markCell, list);
+    }
+}
+
+static void countPending(Cell *cell, void *arg) {
+    if (cell->dirty) {
+        cell->pending++;
+    }
+}
+
+// the cell is ready once all of its dirty precedents have been evaluated
+static void releasePending(Cell *cell, void *ready) {
+    if (cell->dirty && --cell->pending == 0) {
+        pushCell(ready, cell);
+    }
+}
+
+static bool yieldSheet(void);
+
+// evaluate the dirty cells in topological order (Kahn's algorithm), so each
+// of them exactly once; the ones that never become ready are part of
+// (or depend on) a cycle; the callback (if any) is called for every
+// recalculated cell
+//
+// the cells in the ready queue only depend on cells evaluated before them,
+// so they are taken level by level and evaluated in parallel (if the thread
+// pool was started), the callback is then called from the calling thread
+//
+// in the background, levels are cut into slices between which the sheet is
+// unlocked; if the recalculation gets cancelled meanwhile, FALSE is returned
+// and the cells which were not evaluated yet are left dirty
+static bool recalculateDirty(CellList dirty, void (*updated)(Cell *),
+                             bool background) {
+    CellList ready = { NULL, 0, 0 };
+    // every worker has an arena of its own, kept for the whole recalculation
+    Arena *arenas = malloc(poolSize() * sizeof(Arena));
+    for (unsigned i = 0; i < poolSize(); i++) {
+        initArena(&arenas[i]);
+    }
+
+    // count the dirty precedents of every dirty cell (all dependents of
+    // a dirty cell are dirty, so it is enough to follow their edges)
+    for (size_t i = 0; i < dirty.length; i++) {
+        dirty.cells[i]->pending = 0;
+        if (profiling) {
+            resetDepth(dirty.cells[i]);
+        }
+    }
+    for (size_t i = 0; i < dirty.length; i++) {
+        forEachDependent(dirty.cells[i], countPending, NULL);
+    }
+    for (size_t i = 0; i < dirty.length; i++) {
+        if (dirty.cells[i]->pending == 0) {
+            pushCell(&ready, dirty.cells[i]);
+        }
+    }
+
+    Level level = { { NULL, 0, 0 }, arenas, NULL, 0, 0, NULL, 0 };
+    size_t start = 0;
+    bool finished = TRUE;
+    while (start < ready.length) {
+        size_t end = ready.length;
+        if (background) {
+            if (start > 0 && !yieldSheet()) {
+                finished = FALSE;
+                break;
+            }
+            if (end - start > SLICE_SIZE) {
+                end = start + SLICE_SIZE;
+            }
+        }
+        level.cells.cells = ready.cells + start;
+        level.cells.length = end - start;
+        planLevel(&level);
+        if (poolSize() > 1 && level.cells.length >= PARALLEL_THRESHOLD) {
+            runParallel(level.numTasks, evaluateTask, &level);
+        } else {
+            for (size_t i = 0; i < level.numTasks; i++) {
+                evaluateTask(i, 0, &level);
+            }
+        }
+
+        for (size_t i = start; i < end; i++) {
+            Cell *cell = ready.cells[i];
+            cell->dirty = FALSE;
+            updateColumn(cell);
+            if (updated != NULL) {
+                updated(cell);
+            }
+            if (profiling) {
+                forEachDependent(cell, profileDepth, cell);
+            }
+            forEachDependent(cell, releasePending, &ready);
+        }
+        start = end;
+    }
+
+    // whatever is left could not be ordered
+    for (size_t i = 0; finished && i < dirty.length; i++) {
+        Cell *cell = dirty.cells[i];
+        if (cell->dirty) {
+            Value error;
+            SET_ERROR(error, ERROR_CYCLE);
+            cell->type = TYPE_ERROR;
+            setCellResult(cell, error);
+            updateColumn(cell);
+            cell->dirty = FALSE;
+            if (updated != NULL) {
+                updated(cell);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < poolSize(); i++) {
+        freeArena(&arenas[i]);
+    }
+    free(arenas);
+    free(level.tasks);
+    free(level.order);
+    free(ready.cells);
+    return finished;
+}
+
+// recalculate the cell and all cells depending on it
+void recalculate(Cell *root, void (*updated)(Cell *)) {
+    CellList dirty = { NULL, 0, 0 };
+    markDirty(root, &dirty);
+    recalculateDirty(dirty, updated, FALSE);
+    free(dirty.cells);
+}
+
+// bulk loading: formulas set between beginLoad() and commitLoad() are only
+// compiled, their dependencies are then linked in a single pass and all of
+// them are recalculated at once, in topological order, so loading takes time
+// proportional to the number of cells no matter how they depend on each other
+void beginLoad(void) {
+    numLoaded = 0;
+}
+
+void loadFormula(Cell *cell, const char *formula) {
+    replaceFormula(cell, formula);
+    // the dirty flag marks the cells queued for linking
+    if (!cell->dirty) {
+        cell->dirty = TRUE;
+        if (numLoaded == loadedCapacity) {
+            loadedCapacity = loadedCapacity == 0 ? 64 : loadedCapacity * 2;
+            loaded = realloc(loaded, loadedCapacity * sizeof(Position));
+        }
+        loaded[numLoaded].x = cell->x;
+        loaded[numLoaded].y = cell->y;
+        numLoaded++;
+    }
+}
+
+void commitLoad(void (*updated)(Cell *)) {
+    for (size_t i = 0; i < numLoaded; i++) {
+        Cell *cell = findCell(loaded[i].x, loaded[i].y);
+        if (cell != NULL) {
+            cell->dirty = FALSE;
+            linkRefs(cell->compiled, cell->x, cell->y);
+        }
+    }
+
+    CellList dirty = { NULL, 0, 0 };
+    for (size_t i = 0; i < numLoaded; i++) {
+        Cell *cell = findCell(loaded[i].x, loaded[i].y);
+        if (cell != NULL && !cell->dirty) {
+            markDirty(cell, &dirty);
+        }
+    }
+    recalculateDirty(dirty, updated, FALSE);
+    free(dirty.cells);
+
+    free(loaded);
+    loaded = NULL;
+    numLoaded = loadedCapacity = 0;
+}
+
+// recalculate every cell holding a formula or a value
+void recalculateAll(void (*updated)(Cell *)) {
+    CellList dirty = { NULL, 0, 0 };
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        if (!cell->dirty && cell->formula[0] != '\0') {
+            markDirty(cell, &dirty);
+        }
+    }
+    recalculateDirty(dirty, updated, FALSE);
+    free(dirty.cells);
+}
+
+// background recalculation (for the user interface): edits are made between
+// beginEdit() and endEdit(), which queues the edited cell for recalculation
+// by a thread of its own; a new edit cancels the recalculation in progress,
+// whose dirty cells are then recalculated along with the new ones
+//
+// the sheet is guarded by a lock, held by the background thread except
+// between slices; the turnstile makes it hand the lock over to the user
+// interface whenever that waits for it, so that it never waits for longer
+// than a slice takes
+static pthread_t recalcThread;
+static pthread_mutex_t sheetLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t turnstile = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueChanged = PTHREAD_COND_INITIALIZER;
+static Position *requests = NULL;
+static size_t numRequests = 0, requestsCapacity = 0;
+static bool cancelled = FALSE, stopping = FALSE, busy = FALSE;
+static void (*backgroundUpdated)(Cell *) = NULL;
+
+static void pushPosition(Position **list, size_t *length, size_t *capacity,
+                         unsigned x, unsigned y) {
+    if (*length == *capacity) {
+        *capacity = *capacity == 0 ? 16 : *capacity * 2;
+        *list = realloc(*list, *capacity * sizeof(Position));
+    }
+    (*list)[*length].x = x;
+    (*list)[*length].y = y;
+    (*length)++;
+}
+
+void lockSheet(void) {
+    pthread_mutex_lock(&turnstile);
+    pthread_mutex_lock(&sheetLock);
+    pthread_mutex_unlock(&turnstile);
+}
+
+void unlockSheet(void) {
+    pthread_mutex_unlock(&sheetLock);
+}
+
+// let the user interface at the sheet, returns FALSE if the recalculation
+// was cancelled meanwhile
+static bool yieldSheet(void) {
+    unlockSheet();
+    lockSheet();
+    pthread_mutex_lock(&queueLock);
+    bool carryOn = !cancelled;
+    pthread_mutex_unlock(&queueLock);
+    return carryOn;
+}
+
+static void *recalculateInBackground(void *arg) {
+    // the edited cells are freed once recalculated if they were left empty;
+    // all of them are kept by position since an edit may free cells
+    Position *roots = NULL, *leftovers = NULL;
+    size_t numRoots = 0, rootsCapacity = 0;
+    size_t numLeftovers = 0, leftoversCapacity = 0;
+
+    pthread_mutex_lock(&queueLock);
+    while (TRUE) {
+        while (numRequests == 0 && !stopping) {
+            pthread_cond_wait(&queueChanged, &queueLock);
+        }
+        if (stopping) {
+            break;
+        }
+        for (size_t i = 0; i < numRequests; i++) {
+            pushPosition(&roots, &numRoots, &rootsCapacity,
+                         requests[i].x, requests[i].y);
+        }
+        numRequests = 0;
+        cancelled = FALSE;
+        pthread_mutex_unlock(&queueLock);
+
+        lockSheet();
+        CellList dirty = { NULL, 0, 0 };
+        for (size_t i = 0; i < numLeftovers; i++) {
+            Cell *cell = findCell(leftovers[i].x, leftovers[i].y);
+            if (cell != NULL && cell->dirty) {
+                pushCell(&dirty, cell);
+            }
+        }
+        for (size_t i = 0; i < numRoots; i++) {
+            Cell *cell = findCell(roots[i].x, roots[i].y);
+            if (cell != NULL) {
+                markDirty(cell, &dirty);
+            }
+        }
+        // the edits made while the sheet is let go may free the cells (see
+        // releaseCell()), so the ones left dirty are found by position
+        numLeftovers = 0;
+        for (size_t i = 0; i < dirty.length; i++) {
+            pushPosition(&leftovers, &numLeftovers, &leftoversCapacity,
+                         dirty.cells[i]->x, dirty.cells[i]->y);
+        }
+        bool finished = recalculateDirty(dirty, backgroundUpdated, TRUE);
+        free(dirty.cells);
+        if (finished) {
+            for (size_t i = 0; i < numRoots; i++) {
+                releaseCell(roots[i].x, roots[i].y);
+            }
+            numRoots = 0;
+            numLeftovers = 0;
+        } else {
+            size_t kept = 0;
+            for (size_t i = 0; i < numLeftovers; i++) {
+                Cell *cell = findCell(leftovers[i].x, leftovers[i].y);
+                if (cell != NULL && cell->dirty) {
+                    leftovers[kept++] = leftovers[i];
+                }
+            }
+            numLeftovers = kept;
+        }
+        unlockSheet();
+
+        pthread_mutex_lock(&queueLock);
+        busy = numRequests > 0;
+        pthread_cond_broadcast(&queueChanged);
+    }
+    pthread_mutex_unlock(&queueLock);
+    free(roots);
+    free(leftovers);
+    return NULL;
+}
+
+// start the background thread, the callback is called (with the sheet
+// locked) for every cell it recalculates
+void startRecalculation(void (*updated)(Cell *)) {
+    backgroundUpdated = updated;
+    stopping = FALSE;
+    pthread_create(&recalcThread, NULL, recalculateInBackground, NULL);
+}
+
+void stopRecalculation(void) {
+    pthread_mutex_lock(&queueLock);
+    stopping = TRUE;
+    cancelled = TRUE;
+    pthread_cond_broadcast(&queueChanged);
+    pthread_mutex_unlock(&queueLock);
+    pthread_join(recalcThread, NULL);
+}
+
+// cancel the recalculation in progress and lock the sheet for an edit
+void beginEdit(void) {
+    pthread_mutex_lock(&queueLock);
+    cancelled = TRUE;
+    pthread_mutex_unlock(&queueLock);
+    lockSheet();
+}
+
+// unlock the sheet and recalculate the edited cell in the background
+void endEdit(unsigned x, unsigned y) {
+    pthread_mutex_lock(&queueLock);
+    pushPosition(&requests, &numRequests, &requestsCapacity, x, y);
+    cancelled = TRUE;
+    busy = TRUE;
+    pthread_cond_broadcast(&queueChanged);
+    pthread_mutex_unlock(&queueLock);
+    unlockSheet();
+}
+
+bool recalculating(void) {
+    pthread_mutex_lock(&queueLock);
+    bool result = busy;
+    pthread_mutex_unlock(&queueLock);
+    return result;
+}
+
+// wait until all edits have been recalculated
+void waitRecalculation(void) {
+    pthread_mutex_lock(&queueLock);
+    while (busy) {
+        pthread_cond_wait(&queueChanged, &queueLock);
+    }
+    pthread_mutex_unlock(&queueLock);
+}
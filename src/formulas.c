@@ -0,0 +1,308 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// the formulas of the cells, interned in their relative form (see
+// makeRelative()): all of the cells holding the same formula relative to
+// their position, such as a column of =MUL(B1,C1), =MUL(B2,C2) and so on,
+// point to a single copy of its text, which also keeps the formula
+// compiled (cells and ranges are compiled relative to the cell running the
+// code, see placeRange()); the copies are counted and freed along with the
+// last cell holding them
+//
+// the text handed out is the last member of its entry, so the entry is
+// found from the text alone; the empty formula is not interned at all
+
+// the table grows once it holds this many formulas per bucket
+#define MAX_LOAD 2
+// the table is split by the top bits of the hashes into shards, each with
+// its own lock, so that threads interning formulas at the same time (see
+// importCSV()) rarely wait for one another
+#define SHARD_BITS 6
+#define NUM_SHARDS (1 << SHARD_BITS)
+
+typedef struct _Interned {
+    struct _Interned *next; // in the same bucket
+    unsigned hash;
+    unsigned refs; // number of cells holding the formula
+    size_t length;
+    Formula *compiled; // NULL until some cell needs it
+    char text[];
+} Interned;
+
+typedef struct {
+    Interned **buckets;
+    size_t numBuckets, numFormulas;
+    pthread_mutex_t lock; // also guards the counts of the formulas
+} Shard;
+
+static Shard shards[NUM_SHARDS];
+static pthread_once_t shardsReady = PTHREAD_ONCE_INIT;
+// guards the compiled forms
+static pthread_mutex_t formulaLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char emptyFormula[] = "";
+static Formula *emptyCompiled = NULL;
+
+static Interned *findEntry(const char *text) {
+    return (Interned *)(text - offsetof(Interned, text));
+}
+
+// FNV-1a
+static unsigned hashFormula(const char *text, size_t length) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void initShards(void) {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+static Shard *findShard(unsigned hash) {
+    return &shards[hash >> (32 - SHARD_BITS)];
+}
+
+static void growBuckets(Shard *shard) {
+    size_t size = shard->numBuckets == 0 ? 16 : shard->numBuckets * 2;
+    Interned **grown = calloc(size, sizeof(Interned *));
+    for (size_t i = 0; i < shard->numBuckets; i++) {
+        Interned *entry = shard->buckets[i];
+        while (entry != NULL) {
+            Interned *next = entry->next;
+            entry->next = grown[entry->hash & (size - 1)];
+            grown[entry->hash & (size - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = grown;
+    shard->numBuckets = size;
+}
+
+// a growing string (not terminated)
+typedef struct {
+    char *chars;
+    size_t length, capacity;
+} Text;
+
+static void append(Text *text, const char *chars, size_t length) {
+    if (text->length + length > text->capacity) {
+        while (text->length + length > text->capacity) {
+            text->capacity = text->capacity == 0 ? 64 : text->capacity * 2;
+        }
+        text->chars = realloc(text->chars, text->capacity);
+    }
+    memcpy(text->chars + text->length, chars, length);
+    text->length += length;
+}
+
+// the same as the parser: the address of a cell within the sheet, made of
+// capital letters and digits only (e.g. B7, not B7X or B0)
+static bool isAddress(const char *chars, size_t length, unsigned *x,
+                      unsigned *y) {
+    unsigned long col = 0, row = 0;
+    size_t i = 0;
+    for (; i < length && isupper((unsigned char)chars[i]); i++) {
+        if (col <= MAX_COLS) {
+            col = col * 26 + (chars[i] - ALPHA_BASE + 1);
+        }
+    }
+    if (i == 0 || i == length) {
+        return FALSE;
+    }
+    for (; i < length && isdigit((unsigned char)chars[i]); i++) {
+        if (row <= MAX_ROWS) {
+            row = row * 10 + (chars[i] - DIGIT_BASE);
+        }
+    }
+    if (i < length || col > MAX_COLS || row == 0 || row > MAX_ROWS) {
+        return FALSE;
+    }
+    *x = col - 1;
+    *y = row - 1;
+    return TRUE;
+}
+
+// the relative form of the formula entered in the cell at x, y: the cells
+// it reads are written as offsets from that cell (R[-1]C[2] is a row above
+// and two columns to the right) and [ is doubled, so that nothing else
+// reads like an offset; TEXT which is not a formula only has [ doubled
+//
+// words are looked for the way the parser does: a word of letters, digits
+// and dots is an address if it looks like one and does not name
+// a function, except in TEXT literals; whatever the parser reads
+// differently fails to compile wherever it is
+static void makeRelative(Text *relative, const char *formula, size_t length,
+                         unsigned x, unsigned y) {
+    bool quoted = FALSE;
+    size_t i = 0;
+    while (i < length) {
+        char c = formula[i];
+        if (c == '[') {
+            append(relative, "[[", 2);
+            i++;
+            continue;
+        }
+        if (formula[0] != '=' || quoted || c == '"' ||
+            !(isalnum((unsigned char)c) || c == '.')) {
+            append(relative, formula + i++, 1);
+            if (quoted && c == '\\' && i < length &&
+                (formula[i] == '\\' || formula[i] == '"')) {
+                append(relative, formula + i++, 1);
+            } else if (c == '"' && formula[0] == '=') {
+                quoted = !quoted;
+            }
+            continue;
+        }
+        size_t end = i;
+        while (end < length && (isalnum((unsigned char)formula[end]) ||
+                                formula[end] == '.')) {
+            end++;
+        }
+        unsigned cellX, cellY;
+        if ((end == length || formula[end] != '(') &&
+            isAddress(formula + i, end - i, &cellX, &cellY)) {
+            char offsets[32];
+            append(relative, offsets,
+                   sprintf(offsets, "R[%d]C[%d]", (int)(cellY - y),
+                           (int)(cellX - x)));
+        } else {
+            append(relative, formula + i, end - i);
+        }
+        i = end;
+    }
+}
+
+// the formula the way it was entered in the cell at x, y (the reverse of
+// makeRelative()), allocated on the heap
+char *formulaText(const char *formula, unsigned x, unsigned y) {
+    Text text = { NULL, 0, 0 };
+    const char *cur = formula;
+    while (*cur != '\0') {
+        int dx, dy, length = 0;
+        char name[16];
+        if (cur[0] == '[') {
+            append(&text, cur, 1);
+            cur += 2;
+        } else if (cur[0] == 'R' && cur[1] == '[' &&
+                   sscanf(cur, "R[%d]C[%d]%n", &dy, &dx, &length) == 2 &&
+                   length > 0) {
+            cellName(x + dx, y + dy, name);
+            append(&text, name, strlen(name));
+            cur += length;
+        } else {
+            append(&text, cur++, 1);
+        }
+    }
+    append(&text, "", 1);
+    return text.chars;
+}
+
+// the shared copy of the formula entered in the cell at x, y (of the given
+// length, it does not need to be terminated), in its relative form; every
+// call has to be paired with releaseFormula()
+const char *internFormula(const char *formula, size_t length, unsigned x,
+                          unsigned y) {
+    if (length == 0) {
+        return emptyFormula;
+    }
+    // TEXT without [ is its own relative form
+    Text relative = { NULL, 0, 0 };
+    const char *text = formula;
+    if (formula[0] == '=' || memchr(formula, '[', length) != NULL) {
+        makeRelative(&relative, formula, length, x, y);
+        text = relative.chars;
+        length = relative.length;
+    }
+
+    unsigned hash = hashFormula(text, length);
+    pthread_once(&shardsReady, initShards);
+    Shard *shard = findShard(hash);
+    pthread_mutex_lock(&shard->lock);
+    if (shard->numFormulas >= shard->numBuckets * MAX_LOAD) {
+        growBuckets(shard);
+    }
+    Interned **bucket = &shard->buckets[hash & (shard->numBuckets - 1)];
+    Interned *entry;
+    for (entry = *bucket; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->text, text, length) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        entry = malloc(sizeof(Interned) + length + 1);
+        entry->hash = hash;
+        entry->refs = 0;
+        entry->length = length;
+        entry->compiled = NULL;
+        memcpy(entry->text, text, length);
+        entry->text[length] = '\0';
+        entry->next = *bucket;
+        *bucket = entry;
+        shard->numFormulas++;
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&shard->lock);
+    free(relative.chars);
+    return entry->text;
+}
+
+void releaseFormula(const char *formula) {
+    if (formula[0] == '\0') {
+        return;
+    }
+    Interned *entry = findEntry(formula);
+    Shard *shard = findShard(entry->hash);
+    pthread_mutex_lock(&shard->lock);
+    if (--entry->refs > 0) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    Interned **link = &shard->buckets[entry->hash & (shard->numBuckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    shard->numFormulas--;
+    pthread_mutex_unlock(&shard->lock);
+    freeFormula(entry->compiled);
+    free(entry);
+}
+
+// the compiled form of an interned formula, compiled the first time it is
+// needed (by the cell at x, y); cells evaluated in parallel may compile it
+// at the same time, only the first copy is kept
+const Formula *compiledFormula(const char *formula, unsigned x, unsigned y) {
+    Formula **compiled = formula[0] == '\0' ? &emptyCompiled :
+                         &findEntry(formula)->compiled;
+    pthread_mutex_lock(&formulaLock);
+    Formula *existing = *compiled;
+    pthread_mutex_unlock(&formulaLock);
+    if (existing != NULL) {
+        return existing;
+    }
+
+    char *text = formulaText(formula, x, y);
+    Formula *fresh = compile(text, x, y);
+    free(text);
+    pthread_mutex_lock(&formulaLock);
+    if (*compiled == NULL) {
+        *compiled = fresh;
+        fresh = NULL;
+    }
+    existing = *compiled;
+    pthread_mutex_unlock(&formulaLock);
+    freeFormula(fresh);
+    return existing;
+}
@@ -1,289 +1,737 @@
+#define _POSIX_C_SOURCE 200809L
 #include "sheet.h"
 #include "funcs.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
 
-const char *funcNames[NUM_FUNCS] = {
-    "INT",
-    "FLOAT",
-    "TEXT",
-    "NEG",
-    "SUM",
-    "SUB",
-    "MUL",
-    "DIV",
-    "MIN",
-    "MAX",
-    "CONCAT"
-};
+// size of the hash table of function names (a power of two, at least twice
+// the number of functions)
+#define FUNCTION_TABLE_SIZE 64
 
-// these accept (from the user's point of view) only a single argument
-const char *unaryFuncNames[NUM_FUNCS] = {
-    "INT",
-    "FLOAT",
-    "TEXT",
-    "NEG",
-    "",
-    "",
-    "",
-    "",
-    "",
-    "",
-    ""
-};
+// bits of the arguments at even and odd positions (counted from 0)
+#define EVEN_ARGS 0x55555555u
+#define ODD_ARGS 0xAAAAAAAAu
+
+Value INT(Arena *, const Value *, unsigned);
+Value FLOAT(Arena *, const Value *, unsigned);
+Value TEXT(Arena *, const Value *, unsigned);
+Value NEG(Arena *, const Value *, unsigned);
+Value sumAll(Arena *, const Value *, unsigned);
+Value subAll(Arena *, const Value *, unsigned);
+Value mulAll(Arena *, const Value *, unsigned);
+Value divAll(Arena *, const Value *, unsigned);
+Value minAll(Arena *, const Value *, unsigned);
+Value maxAll(Arena *, const Value *, unsigned);
+Value concatAll(Arena *, const Value *, unsigned);
+Value POWER(Arena *, const Value *, unsigned);
+Value EQ(Arena *, const Value *, unsigned);
+Value NE(Arena *, const Value *, unsigned);
+Value LT(Arena *, const Value *, unsigned);
+Value LTE(Arena *, const Value *, unsigned);
+Value GT(Arena *, const Value *, unsigned);
+Value GTE(Arena *, const Value *, unsigned);
+Value VLOOKUP(Arena *, const Value *, unsigned);
+Value HLOOKUP(Arena *, const Value *, unsigned);
+Value MATCH(Arena *, const Value *, unsigned);
+Value XLOOKUP(Arena *, const Value *, unsigned);
+Value SUMIF(Arena *, const Value *, unsigned);
+Value COUNTIF(Arena *, const Value *, unsigned);
+Value AVERAGEIF(Arena *, const Value *, unsigned);
+Value SUMIFS(Arena *, const Value *, unsigned);
+Value COUNTIFS(Arena *, const Value *, unsigned);
+Value SUM(Arena *, Value, Value);
+Value SUB(Arena *, Value, Value);
+Value MUL(Arena *, Value, Value);
+Value DIV(Arena *, Value, Value);
+Value MIN(Arena *, Value, Value);
+Value MAX(Arena *, Value, Value);
+Value CONCAT(Arena *, Value, Value);
 
-Value (*funcPtrs[NUM_FUNCS])(Value, Value) = {
-    INT,
-    FLOAT,
-    TEXT,
-    NEG,
-    SUM,
-    SUB,
-    MUL,
-    DIV,
-    MIN,
-    MAX,
-    CONCAT
+// the registry of functions; a new function only needs an entry here
+const Function functions[] = {
+    { "INT", 1, 1, "IFTE", INT, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "FLOAT", 1, 1, "IFTE", FLOAT, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "TEXT", 1, 1, "IFTE", TEXT, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "NEG", 1, 1, "IFTE", NEG, NULL, AGGREGATE_NONE, COLUMN_NEG, 0, 0 },
+    { "SUM", 2, VARIADIC, "IF", sumAll, SUM, AGGREGATE_SUM, COLUMN_SUM, 0, 0 },
+    { "SUB", 2, VARIADIC, "IF", subAll, SUB, AGGREGATE_NONE, COLUMN_SUB,
+      0, 0 },
+    { "MUL", 2, VARIADIC, "IF", mulAll, MUL, AGGREGATE_MUL, COLUMN_MUL, 0, 0 },
+    { "DIV", 2, VARIADIC, "IF", divAll, DIV, AGGREGATE_NONE, COLUMN_DIV,
+      0, 0 },
+    { "MIN", 2, VARIADIC, "IF", minAll, MIN, AGGREGATE_MIN, COLUMN_MIN, 0, 0 },
+    { "MAX", 2, VARIADIC, "IF", maxAll, MAX, AGGREGATE_MAX, COLUMN_MAX, 0, 0 },
+    { "CONCAT", 2, VARIADIC, "T", concatAll, CONCAT, AGGREGATE_NONE,
+      COLUMN_NONE, 0, 0 },
+    { "POWER", 2, 2, "IFTE", POWER, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "EQ", 2, 2, "IFTE", EQ, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "NE", 2, 2, "IFTE", NE, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "LT", 2, 2, "IFTE", LT, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "LTE", 2, 2, "IFTE", LTE, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "GT", 2, 2, "IFTE", GT, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "GTE", 2, 2, "IFTE", GTE, NULL, AGGREGATE_NONE, COLUMN_NONE, 0, 0 },
+    { "VLOOKUP", 3, 4, "IFTRE", VLOOKUP, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 1, 0 },
+    { "HLOOKUP", 3, 4, "IFTRE", HLOOKUP, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 1, 0 },
+    { "MATCH", 2, 3, "IFTRE", MATCH, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 1, 0 },
+    { "XLOOKUP", 3, 5, "IFTRE", XLOOKUP, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 1 | 1 << 2, 0 },
+    { "SUMIF", 2, 3, "IFTRCE", SUMIF, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 0 | 1 << 2, 1 << 1 },
+    { "COUNTIF", 2, 2, "IFTRCE", COUNTIF, NULL, AGGREGATE_NONE, COLUMN_NONE,
+      1 << 0, 1 << 1 },
+    { "AVERAGEIF", 2, 3, "IFTRCE", AVERAGEIF, NULL, AGGREGATE_NONE,
+      COLUMN_NONE, 1 << 0 | 1 << 2, 1 << 1 },
+    { "SUMIFS", 3, 1 + 2 * MAX_CRITERIA, "IFTRCE", SUMIFS, NULL,
+      AGGREGATE_NONE, COLUMN_NONE, 1 << 0 | ODD_ARGS, EVEN_ARGS & ~1u },
+    { "COUNTIFS", 2, 2 * MAX_CRITERIA, "IFTRCE", COUNTIFS, NULL,
+      AGGREGATE_NONE, COLUMN_NONE, EVEN_ARGS, ODD_ARGS }
 };
 
+const int numFunctions = sizeof(functions) / sizeof(functions[0]);
+
+// open addressing, slots hold the index of the function plus one
+static int functionTable[FUNCTION_TABLE_SIZE];
+static pthread_once_t tableOnce = PTHREAD_ONCE_INIT;
+
+// FNV-1a
+static unsigned hashName(const char *name, int len) {
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void buildTable(void) {
+    for (int i = 0; i < numFunctions; i++) {
+        unsigned slot = hashName(functions[i].name, strlen(functions[i].name));
+        while (functionTable[slot % FUNCTION_TABLE_SIZE] != 0) {
+            slot++;
+        }
+        functionTable[slot % FUNCTION_TABLE_SIZE] = i + 1;
+    }
+}
+
+// look up the index of a function by its name (-1 if there is none)
+int findFunction(const char *name, int len) {
+    pthread_once(&tableOnce, buildTable);
+    for (unsigned slot = hashName(name, len);
+         functionTable[slot % FUNCTION_TABLE_SIZE] != 0; slot++) {
+        const char *candidate =
+            functions[functionTable[slot % FUNCTION_TABLE_SIZE] - 1].name;
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0') {
+            return functionTable[slot % FUNCTION_TABLE_SIZE] - 1;
+        }
+    }
+    return -1;
+}
+
+// call a function; the arguments accepted by its entry point are passed to
+// it all at once, the rest of them are folded in one by one
+Value callFunction(Arena *arena, int func, const Value *args, unsigned argc) {
+    const Function *function = &functions[func];
+    unsigned accepted = 0;
+    while (accepted < argc &&
+           strchr(function->accepts, args[accepted].type) != NULL) {
+        accepted++;
+    }
+    if (accepted == argc || function->step == NULL) {
+        return function->call(arena, args, argc);
+    }
+    Value value = accepted > 1 ? function->call(arena, args, accepted) : args[0];
+    for (unsigned i = accepted > 1 ? accepted : 1; i < argc; i++) {
+        value = function->step(arena, value, args[i]);
+    }
+    return value;
+}
 
 // this helps with error bubbling
 bool errorCheck(Value *ret, Value arg1, Value arg2) {
     if (arg1.type == TYPE_ERROR) {
         *ret = arg1;
-        if (arg2.type == TYPE_TEXT) {
-            free(AS_TEXT(arg2));
-        }
         return TRUE;
     }
     if (arg2.type == TYPE_ERROR) {
         *ret = arg2;
-        if (arg1.type == TYPE_TEXT) {
-            free(AS_TEXT(arg1));
-        }
         return TRUE;
     }
     return FALSE;
 }
 
-// memory freeing helper
-void freeStrings(Value arg1, Value arg2) {
-    if (arg1.type == TYPE_TEXT) {
-        free(AS_TEXT(arg1));
-    }
-    if (arg2.type == TYPE_TEXT) {
-        free(AS_TEXT(arg2));
-    }
-}
-
 // conversion to INT (unary)
-Value INT(Value arg1, Value arg2) {
+Value INT(Arena *arena, const Value *args, unsigned argc) {
+    Value arg1 = args[0];
     if (arg1.type == TYPE_FLOAT) {
         arg1.type = TYPE_INT;
         AS_INT(arg1) = AS_FLOAT(arg1);
     } else if (arg1.type == TYPE_TEXT) {
         arg1.type = TYPE_INT;
-        char *text = AS_TEXT(arg1);
-        AS_INT(arg1) = strtoll(text, NULL, 10);
-        free(text);
+        AS_INT(arg1) = strtoll(AS_TEXT(arg1), NULL, 10);
     }
     return arg1;
 }
 
-// helper
-long long toInt(Value arg1) {
-    Value arg2;
-    return AS_INT(INT(arg1, arg2));
-}
-
 // convert to FLOAT (unary)
-Value FLOAT(Value arg1, Value arg2) {
+Value FLOAT(Arena *arena, const Value *args, unsigned argc) {
+    Value arg1 = args[0];
     if (arg1.type == TYPE_INT) {
         arg1.type = TYPE_FLOAT;
         AS_FLOAT(arg1) = AS_INT(arg1);
     } else if (arg1.type == TYPE_TEXT) {
         arg1.type = TYPE_FLOAT;
-        char *text = AS_TEXT(arg1);
-        AS_FLOAT(arg1) = strtod(text, NULL);
-        free(text);
+        AS_FLOAT(arg1) = strtod(AS_TEXT(arg1), NULL);
     }
     return arg1;
 }
 
-// helper
-double toFloat(Value arg1) {
-    Value arg2;
-    return AS_FLOAT(FLOAT(arg1, arg2));
-}
-
 // convert to TEXT (unary)
-Value TEXT(Value arg1, Value arg2) {
+Value TEXT(Arena *arena, const Value *args, unsigned argc) {
+    Value arg1 = args[0];
     if (arg1.type == TYPE_TEXT || arg1.type == TYPE_ERROR) {
         return arg1;
     }
 
-    Value ret;
-    ret.type = TYPE_TEXT;
-
+    char buffer[NUMBER_LENGTH];
+    int length;
     if (arg1.type == TYPE_INT) {
-        ALLOC_SPRINTF(AS_TEXT(ret), "%lld", AS_INT(arg1));
-    } else if (arg1.type == TYPE_FLOAT) {
-        ALLOC_SPRINTF(AS_TEXT(ret), "%.3lf", AS_FLOAT(arg1));
+        length = sprintf(buffer, "%lld", AS_INT(arg1));
+    } else {
+        length = sprintf(buffer, "%.3lf", AS_FLOAT(arg1));
     }
-
-    return ret;
+    return makeText(buffer, length, arena);
 }
 
 // negation (unary, accepts either INT or FLOAT)
-Value NEG(Value arg1, Value arg2) {
+Value NEG(Arena *arena, const Value *args, unsigned argc) {
+    Value arg1 = args[0];
     if (arg1.type == TYPE_INT) {
         AS_INT(arg1) = -AS_INT(arg1);
     } else if (arg1.type == TYPE_FLOAT) {
         AS_FLOAT(arg1) = -AS_FLOAT(arg1);
     } else if (arg1.type == TYPE_TEXT) {
-        free(AS_TEXT(arg1));
         SET_ERROR(arg1, ERROR_BAD_ARG);
     }
     return arg1;
 }
 
-// function that helps determine whether
-// at least one of the arguments received is of type FLOAT
-bool useFloat(Value arg1, Value arg2) {
-    return (arg1.type == TYPE_FLOAT && arg2.type == TYPE_FLOAT) ||
-           (arg1.type == TYPE_FLOAT && arg2.type == TYPE_INT) ||
-           (arg1.type == TYPE_INT && arg2.type == TYPE_FLOAT);
-}
+// fold INT and FLOAT values in a single loop, INT until the first FLOAT and
+// then FLOAT, the same way a chain of binary operations would
+#define FOLD_SUM 0
+#define FOLD_SUB 1
+#define FOLD_MUL 2
+#define FOLD_DIV 3
+#define FOLD_MIN 4
+#define FOLD_MAX 5
 
-// sum (from the user's point of view, this accepts two or more arguments)
-Value SUM(Value arg1, Value arg2) {
-    Value ret;
-    if (!errorCheck(&ret, arg1, arg2)) {
-        if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = toFloat(arg1) + toFloat(arg2);
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = toInt(arg1) + toInt(arg2);
-        } else {
-            freeStrings(arg1, arg2);
-            SET_ERROR(ret, ERROR_BAD_ARG);
+static Value foldNumbers(int op, const Value *args, unsigned argc) {
+    Value ret = args[0];
+    unsigned i = 1;
+    if (ret.type == TYPE_INT) {
+        long long acc = AS_INT(ret);
+        for (; i < argc && args[i].type == TYPE_INT; i++) {
+            long long value = AS_INT(args[i]);
+            switch (op) {
+                case FOLD_SUM: acc += value; break;
+                case FOLD_SUB: acc -= value; break;
+                case FOLD_MUL: acc *= value; break;
+                case FOLD_DIV:
+                    // the one quotient that does not fit (and traps) fails
+                    // the same way as a division by zero
+                    if (value == 0 || (value == -1 && acc == LLONG_MIN)) {
+                        SET_ERROR(ret, ERROR_DIV_0);
+                        return ret;
+                    }
+                    acc /= value;
+                    break;
+                case FOLD_MIN: acc = value < acc ? value : acc; break;
+                case FOLD_MAX: acc = value > acc ? value : acc; break;
+            }
+        }
+        AS_INT(ret) = acc;
+        if (i == argc) {
+            return ret;
         }
+        ret.type = TYPE_FLOAT;
+        AS_FLOAT(ret) = acc;
     }
+    double acc = AS_FLOAT(ret);
+    for (; i < argc; i++) {
+        double value = args[i].type == TYPE_INT ?
+                       AS_INT(args[i]) : AS_FLOAT(args[i]);
+        switch (op) {
+            case FOLD_SUM: acc += value; break;
+            case FOLD_SUB: acc -= value; break;
+            case FOLD_MUL: acc *= value; break;
+            case FOLD_DIV:
+                if (value == 0) {
+                    SET_ERROR(ret, ERROR_DIV_0);
+                    return ret;
+                }
+                acc /= value;
+                break;
+            case FOLD_MIN: acc = fmin(acc, value); break;
+            case FOLD_MAX: acc = fmax(acc, value); break;
+        }
+    }
+    AS_FLOAT(ret) = acc;
     return ret;
 }
 
-// subtraction (with more than 2 args, the way they are ordered matters)
-Value SUB(Value arg1, Value arg2) {
+bool isNumber(Value arg) {
+    return arg.type == TYPE_INT || arg.type == TYPE_FLOAT;
+}
+
+// the binary steps of variadic functions, these accept any arguments;
+// the numbers are folded the same way as by the entry points
+Value foldStep(int op, Value arg1, Value arg2) {
     Value ret;
     if (!errorCheck(&ret, arg1, arg2)) {
-        if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = toFloat(arg1) - toFloat(arg2);
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = toInt(arg1) - toInt(arg2);
+        if (isNumber(arg1) && isNumber(arg2)) {
+            Value args[] = { arg1, arg2 };
+            ret = foldNumbers(op, args, 2);
         } else {
-            freeStrings(arg1, arg2);
             SET_ERROR(ret, ERROR_BAD_ARG);
         }
     }
     return ret;
 }
 
+// sum (from the user's point of view, this accepts two or more arguments)
+Value SUM(Arena *arena, Value arg1, Value arg2) {
+    return foldStep(FOLD_SUM, arg1, arg2);
+}
+
+// subtraction (with more than 2 args, the way they are ordered matters)
+Value SUB(Arena *arena, Value arg1, Value arg2) {
+    return foldStep(FOLD_SUB, arg1, arg2);
+}
+
 // multiplication (2+ args)
-Value MUL(Value arg1, Value arg2) {
+Value MUL(Arena *arena, Value arg1, Value arg2) {
+    return foldStep(FOLD_MUL, arg1, arg2);
+}
+
+// division (2+ args, "throws" an error on attempts to divide by zero)
+Value DIV(Arena *arena, Value arg1, Value arg2) {
+    Value ret;
+    if (!errorCheck(&ret, arg1, arg2) &&
+        ((arg2.type == TYPE_INT && AS_INT(arg2) == 0) ||
+         (arg2.type == TYPE_FLOAT && AS_FLOAT(arg2) == 0))) {
+        SET_ERROR(ret, ERROR_DIV_0);
+        return ret;
+    }
+    return foldStep(FOLD_DIV, arg1, arg2);
+}
+
+// minimum value of 2+ supplied arguments
+Value MIN(Arena *arena, Value arg1, Value arg2) {
+    return foldStep(FOLD_MIN, arg1, arg2);
+}
+
+// maximum value of 2+ supplied arguments
+Value MAX(Arena *arena, Value arg1, Value arg2) {
+    return foldStep(FOLD_MAX, arg1, arg2);
+}
+
+// concatenation of 2+ TEXT values
+Value CONCAT(Arena *arena, Value arg1, Value arg2) {
     Value ret;
     if (!errorCheck(&ret, arg1, arg2)) {
-        if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = toFloat(arg1) * toFloat(arg2);
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = toInt(arg1) * toInt(arg2);
+        if (arg1.type == TYPE_TEXT && arg2.type == TYPE_TEXT) {
+            size_t length1 = strlen(AS_TEXT(arg1));
+            size_t length2 = strlen(AS_TEXT(arg2));
+            ret = allocText(length1 + length2, arena);
+            memcpy(AS_TEXT(ret), AS_TEXT(arg1), length1);
+            memcpy(AS_TEXT(ret) + length1, AS_TEXT(arg2), length2 + 1);
         } else {
-            freeStrings(arg1, arg2);
             SET_ERROR(ret, ERROR_BAD_ARG);
         }
     }
     return ret;
 }
+// the entry points of variadic functions, these take only INT and FLOAT
+// values (TEXT for CONCAT)
+Value sumAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_SUM, args, argc);
+}
 
-// division (2+ args, "throws" an error on attempts to divide by zero)
-Value DIV(Value arg1, Value arg2) {
+Value subAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_SUB, args, argc);
+}
+
+Value mulAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_MUL, args, argc);
+}
+
+Value divAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_DIV, args, argc);
+}
+
+Value minAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_MIN, args, argc);
+}
+
+Value maxAll(Arena *arena, const Value *args, unsigned argc) {
+    return foldNumbers(FOLD_MAX, args, argc);
+}
+
+// the result is allocated once, however many values are joined
+Value concatAll(Arena *arena, const Value *args, unsigned argc) {
+    size_t length = 0;
+    for (unsigned i = 0; i < argc; i++) {
+        length += strlen(AS_TEXT(args[i]));
+    }
+    Value ret = allocText(length, arena);
+    char *text = AS_TEXT(ret);
+    for (unsigned i = 0; i < argc; i++) {
+        size_t argLength = strlen(AS_TEXT(args[i]));
+        memcpy(text, AS_TEXT(args[i]), argLength);
+        text += argLength;
+    }
+    *text = '\0';
+    return ret;
+}
+
+// exponentiation; an INT raised to a non-negative INT power stays an INT
+// (wrapping around like MUL), anything else is a FLOAT
+Value POWER(Arena *arena, const Value *args, unsigned argc) {
     Value ret;
-    if (!errorCheck(&ret, arg1, arg2)) {
-        if ((arg2.type == TYPE_INT && AS_INT(arg2) == 0) ||
-            (arg2.type == TYPE_FLOAT && AS_FLOAT(arg2) == 0)) {
-                SET_ERROR(ret, ERROR_DIV_0);
-        } else if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = toFloat(arg1) / toFloat(arg2);
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = toInt(arg1) / toInt(arg2);
-        } else {
-            freeStrings(arg1, arg2);
-            SET_ERROR(ret, ERROR_BAD_ARG);
+    if (errorCheck(&ret, args[0], args[1])) {
+        return ret;
+    }
+    if (!isNumber(args[0]) || !isNumber(args[1])) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
+        return ret;
+    }
+    if (args[0].type == TYPE_INT && args[1].type == TYPE_INT &&
+        AS_INT(args[1]) >= 0) {
+        unsigned long long base = AS_INT(args[0]), result = 1;
+        for (long long exponent = AS_INT(args[1]); exponent > 0;
+             exponent >>= 1) {
+            if (exponent & 1) {
+                result *= base;
+            }
+            base *= base;
         }
+        ret.type = TYPE_INT;
+        AS_INT(ret) = result;
+        return ret;
+    }
+    double base = args[0].type == TYPE_INT ? AS_INT(args[0]) :
+                                             AS_FLOAT(args[0]);
+    double exponent = args[1].type == TYPE_INT ? AS_INT(args[1]) :
+                                                 AS_FLOAT(args[1]);
+    if (base == 0 && exponent < 0) {
+        SET_ERROR(ret, ERROR_DIV_0);
+        return ret;
+    }
+    ret.type = TYPE_FLOAT;
+    AS_FLOAT(ret) = pow(base, exponent);
+    // such as the square root of a negative number
+    if (isnan(AS_FLOAT(ret)) && !isnan(base) && !isnan(exponent)) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
     }
     return ret;
 }
 
-// minimum value of 2+ supplied arguments
-Value MIN(Value arg1, Value arg2) {
+// the order of two values for the comparisons: numbers come before TEXT,
+// which is compared ignoring case; NaN is neither smaller nor larger than
+// anything, but not equal either (2 is returned)
+int orderValues(Value first, Value second) {
+    bool text1 = first.type == TYPE_TEXT, text2 = second.type == TYPE_TEXT;
+    if (text1 != text2) {
+        return text1 ? 1 : -1;
+    }
+    if (text1) {
+        const unsigned char *a = (const unsigned char *)AS_TEXT(first);
+        const unsigned char *b = (const unsigned char *)AS_TEXT(second);
+        while (*a != '\0' && tolower(*a) == tolower(*b)) {
+            a++;
+            b++;
+        }
+        return tolower(*a) < tolower(*b) ? -1 : tolower(*a) > tolower(*b);
+    }
+    if (first.type == TYPE_INT && second.type == TYPE_INT) {
+        return AS_INT(first) < AS_INT(second) ? -1 :
+               AS_INT(first) > AS_INT(second);
+    }
+    double x = first.type == TYPE_INT ? AS_INT(first) : AS_FLOAT(first);
+    double y = second.type == TYPE_INT ? AS_INT(second) : AS_FLOAT(second);
+    return x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+}
+
+// the comparisons (the = <> < <= > >= operators) give an INT, 1 or 0
+Value compare(const Value *args, bool less, bool equal, bool greater) {
     Value ret;
-    if (!errorCheck(&ret, arg1, arg2)) {
-        if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = fmin(toFloat(arg1), toFloat(arg2));
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = fmin(toInt(arg1), toInt(arg2));
-        } else {
-            freeStrings(arg1, arg2);
-            SET_ERROR(ret, ERROR_BAD_ARG);
+    if (errorCheck(&ret, args[0], args[1])) {
+        return ret;
+    }
+    int order = orderValues(args[0], args[1]);
+    ret.type = TYPE_INT;
+    AS_INT(ret) = (order < 0 && less) || (order == 0 && equal) ||
+                  (order == 1 && greater);
+    return ret;
+}
+
+Value EQ(Arena *arena, const Value *args, unsigned argc) {
+    return compare(args, FALSE, TRUE, FALSE);
+}
+
+Value NE(Arena *arena, const Value *args, unsigned argc) {
+    Value ret = compare(args, FALSE, TRUE, FALSE);
+    if (ret.type == TYPE_INT) {
+        AS_INT(ret) = !AS_INT(ret);
+    }
+    return ret;
+}
+
+Value LT(Arena *arena, const Value *args, unsigned argc) {
+    return compare(args, TRUE, FALSE, FALSE);
+}
+
+Value LTE(Arena *arena, const Value *args, unsigned argc) {
+    return compare(args, TRUE, TRUE, FALSE);
+}
+
+Value GT(Arena *arena, const Value *args, unsigned argc) {
+    return compare(args, FALSE, FALSE, TRUE);
+}
+
+Value GTE(Arena *arena, const Value *args, unsigned argc) {
+    return compare(args, FALSE, TRUE, TRUE);
+}
+
+// lookups take any arguments, the first error among them is the result
+bool findError(const Value *args, unsigned argc, Value *ret) {
+    for (unsigned i = 0; i < argc; i++) {
+        if (args[i].type == TYPE_ERROR) {
+            *ret = args[i];
+            return TRUE;
         }
     }
+    return FALSE;
+}
+
+// a number given as a position or a mode (FLOAT is truncated)
+bool getInteger(Value arg, long long *integer) {
+    if (arg.type == TYPE_INT) {
+        *integer = AS_INT(arg);
+    } else if (arg.type == TYPE_FLOAT) {
+        *integer = AS_FLOAT(arg);
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+bool isVector(Range range) {
+    return range.x1 == range.x2 || range.y1 == range.y2;
+}
+
+// the value of a cell found by a lookup (borrowed, like any argument)
+Value lookupResult(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    return cell == NULL ? makeText("", 0, NULL) : cell->value;
+}
+
+// find the value in the first column (or row) of the table and return
+// the value at the given position of the row (or column) found; the match
+// is approximate (the closest smaller value) unless the last argument is 0
+Value tableLookup(const Value *args, unsigned argc, bool vertical) {
+    Value ret;
+    if (findError(args, argc, &ret)) {
+        return ret;
+    }
+    long long index, approximate = 1;
+    if (args[1].type != TYPE_RANGE || !getInteger(args[2], &index) ||
+        (argc > 3 && !getInteger(args[3], &approximate))) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
+        return ret;
+    }
+    Range table = AS_RANGE(args[1]), vector = table;
+    unsigned size = vertical ? table.x2 - table.x1 + 1 :
+                               table.y2 - table.y1 + 1;
+    if (index < 1 || index > size) {
+        SET_ERROR(ret, ERROR_OUT_OF_BOUNDS);
+        return ret;
+    }
+    if (vertical) {
+        vector.x2 = vector.x1;
+    } else {
+        vector.y2 = vector.y1;
+    }
+    long offset = lookupValue(vector, args[0], approximate != 0 ?
+                              MATCH_SMALLER : MATCH_EXACT, TRUE);
+    if (offset < 0) {
+        SET_ERROR(ret, ERROR_NOT_FOUND);
+        return ret;
+    }
+    if (vertical) {
+        return lookupResult(table.x1 + index - 1, table.y1 + offset);
+    }
+    return lookupResult(table.x1 + offset, table.y1 + index - 1);
+}
+
+// VLOOKUP(value, table, column[, approximate])
+Value VLOOKUP(Arena *arena, const Value *args, unsigned argc) {
+    return tableLookup(args, argc, TRUE);
+}
+
+// HLOOKUP(value, table, row[, approximate])
+Value HLOOKUP(Arena *arena, const Value *args, unsigned argc) {
+    return tableLookup(args, argc, FALSE);
+}
+
+// MATCH(value, row or column[, type]), the position of the value; type 1
+// (the default) finds the closest smaller value, -1 the closest larger one
+// and 0 only an equal one
+Value MATCH(Arena *arena, const Value *args, unsigned argc) {
+    Value ret;
+    if (findError(args, argc, &ret)) {
+        return ret;
+    }
+    long long type = 1;
+    if (args[1].type != TYPE_RANGE || !isVector(AS_RANGE(args[1])) ||
+        (argc > 2 && !getInteger(args[2], &type))) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
+        return ret;
+    }
+    long offset = lookupValue(AS_RANGE(args[1]), args[0], type > 0 ?
+                              MATCH_SMALLER : type < 0 ? MATCH_LARGER :
+                              MATCH_EXACT, TRUE);
+    if (offset < 0) {
+        SET_ERROR(ret, ERROR_NOT_FOUND);
+        return ret;
+    }
+    ret.type = TYPE_INT;
+    AS_INT(ret) = offset + 1;
     return ret;
 }
 
-// maximum value of 2+ supplied arguments
-Value MAX(Value arg1, Value arg2) {
+// XLOOKUP(value, row or column, results[, if not found[, mode]]), the value
+// at the position of the first match in the results (of the same height or
+// width); mode 0 (the default) only finds an equal value, -1 the closest
+// smaller one and 1 the closest larger one
+Value XLOOKUP(Arena *arena, const Value *args, unsigned argc) {
     Value ret;
-    if (!errorCheck(&ret, arg1, arg2)) {
-        if (useFloat(arg1, arg2)) {
-            ret.type = TYPE_FLOAT;
-            AS_FLOAT(ret) = fmax(toFloat(arg1), toFloat(arg2));
-        } else if (arg1.type == TYPE_INT && arg2.type == TYPE_INT) {
-            ret.type = TYPE_INT;
-            AS_INT(ret) = fmax(toInt(arg1), toInt(arg2));
-        } else {
-            freeStrings(arg1, arg2);
-            SET_ERROR(ret, ERROR_BAD_ARG);
+    if (findError(args, argc, &ret)) {
+        return ret;
+    }
+    long long mode = MATCH_EXACT;
+    if (args[1].type != TYPE_RANGE || args[2].type != TYPE_RANGE ||
+        !isVector(AS_RANGE(args[1])) ||
+        (argc > 4 && (!getInteger(args[4], &mode) || mode < -1 || mode > 1))) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
+        return ret;
+    }
+    Range vector = AS_RANGE(args[1]), results = AS_RANGE(args[2]);
+    bool vertical = vector.x1 == vector.x2;
+    if (vertical ? results.y2 - results.y1 != vector.y2 - vector.y1 :
+                   results.x2 - results.x1 != vector.x2 - vector.x1) {
+        SET_ERROR(ret, ERROR_BAD_ARG);
+        return ret;
+    }
+    long offset = lookupValue(vector, args[0], mode, FALSE);
+    if (offset < 0) {
+        if (argc > 3) {
+            return args[3];
         }
+        SET_ERROR(ret, ERROR_NOT_FOUND);
+        return ret;
     }
-    return ret;
+    if (vertical) {
+        return lookupResult(results.x1, results.y1 + offset);
+    }
+    return lookupResult(results.x1 + offset, results.y1);
 }
 
-// concatenation of 2+ TEXT values
-Value CONCAT(Value arg1, Value arg2) {
+bool isSameSize(Range first, Range second) {
+    return first.x2 - first.x1 == second.x2 - second.x1 &&
+           first.y2 - first.y1 == second.y2 - second.y1;
+}
+
+// the arguments of the conditional aggregates are pairs of a range and
+// a criterion, the criteria not compiled along with the formula are
+// compiled here; the target range (if any) is the one whose values
+// are summed, it has to have the same size as the others
+Value conditional(Arena *arena, int kind, const Value *target,
+                  const Value *pairs, unsigned count) {
     Value ret;
-    if (!errorCheck(&ret, arg1, arg2)) {
-        if (arg1.type == TYPE_TEXT && arg2.type == TYPE_TEXT) {
-            ret.type = TYPE_TEXT;
-            char *arg1text = AS_TEXT(arg1);
-            char *arg2text = AS_TEXT(arg2);
-            char *retText = AS_TEXT(ret) =
-                    malloc(strlen(arg1text) + strlen(arg2text) + 1);
-            strcpy(retText, arg1text);
-            strcat(retText, arg2text);
-            freeStrings(arg1, arg2);
+    if ((target != NULL && findError(target, 1, &ret)) ||
+        findError(pairs, 2 * count, &ret)) {
+        return ret;
+    }
+    Range ranges[MAX_CRITERIA];
+    Criterion compiled[MAX_CRITERIA];
+    const Criterion *criteria[MAX_CRITERIA];
+    for (unsigned k = 0; k < count; k++) {
+        Value range = pairs[2 * k], criterion = pairs[2 * k + 1];
+        if (range.type != TYPE_RANGE ||
+            (target != NULL && target->type != TYPE_RANGE) ||
+            !isSameSize(AS_RANGE(range), target != NULL ?
+                        AS_RANGE(*target) : AS_RANGE(pairs[0]))) {
+            SET_ERROR(ret, ERROR_BAD_ARG);
+            return ret;
+        }
+        ranges[k] = AS_RANGE(range);
+        if (criterion.type == TYPE_CRITERION) {
+            criteria[k] = criterion.data.criterion;
+        } else if (compileCriterion(criterion, &compiled[k], arena)) {
+            criteria[k] = &compiled[k];
         } else {
             SET_ERROR(ret, ERROR_BAD_ARG);
+            return ret;
         }
     }
-    return ret;
+    return conditionalAggregate(kind, target != NULL ? &AS_RANGE(*target) :
+                                NULL, ranges, criteria, count);
+}
+
+// SUMIF(range, criterion[, sum range]), the sum of the values (of the sum
+// range, if given) in the cells of the range matching the criterion
+Value SUMIF(Arena *arena, const Value *args, unsigned argc) {
+    return conditional(arena, CONDITIONAL_SUM, &args[argc > 2 ? 2 : 0],
+                       args, 1);
+}
+
+// COUNTIF(range, criterion), the number of cells matching the criterion
+Value COUNTIF(Arena *arena, const Value *args, unsigned argc) {
+    return conditional(arena, CONDITIONAL_COUNT, NULL, args, 1);
+}
+
+// AVERAGEIF(range, criterion[, average range]), like SUMIF() but divided
+// by the number of values summed
+Value AVERAGEIF(Arena *arena, const Value *args, unsigned argc) {
+    return conditional(arena, CONDITIONAL_AVERAGE, &args[argc > 2 ? 2 : 0],
+                       args, 1);
+}
+
+// SUMIFS(sum range, range, criterion, ...), the sum of the values in the
+// rows matching all of the criteria
+Value SUMIFS(Arena *arena, const Value *args, unsigned argc) {
+    Value ret;
+    if (argc % 2 == 0) {
+        SET_ERROR(ret, ERROR_TOO_FEW_ARGS);
+        return ret;
+    }
+    return conditional(arena, CONDITIONAL_SUM, &args[0], args + 1, argc / 2);
+}
+
+// COUNTIFS(range, criterion, ...), the number of rows matching all of
+// the criteria
+Value COUNTIFS(Arena *arena, const Value *args, unsigned argc) {
+    Value ret;
+    if (argc % 2 != 0) {
+        SET_ERROR(ret, ERROR_TOO_FEW_ARGS);
+        return ret;
+    }
+    return conditional(arena, CONDITIONAL_COUNT, NULL, args, argc / 2);
 }
@@ -1,17 +1,65 @@
-#define NUM_FUNCS 11
-
-Value INT(Value, Value);
-Value FLOAT(Value, Value);
-Value TEXT(Value, Value);
-Value NEG(Value, Value);
-Value SUM(Value, Value);
-Value SUB(Value, Value);
-Value MUL(Value, Value);
-Value DIV(Value, Value);
-Value MIN(Value, Value);
-Value MAX(Value, Value);
-Value CONCAT(Value, Value);
-
-extern const char *funcNames[NUM_FUNCS];
-extern const char *unaryFuncNames[NUM_FUNCS];
-extern Value (*funcPtrs[NUM_FUNCS])(Value, Value);
+// vectorized folds of ranges holding only INT or only FLOAT values
+#define AGGREGATE_NONE -1
+#define AGGREGATE_SUM 0
+#define AGGREGATE_MUL 1
+#define AGGREGATE_MIN 2
+#define AGGREGATE_MAX 3
+#define AGGREGATE_LANES 4
+
+// element-wise arithmetic on columns of INT or FLOAT values (the kernels
+// evaluating runs of cells sharing a formula, see runs.c)
+#define COLUMN_NONE -1
+#define COLUMN_SUM 0
+#define COLUMN_SUB 1
+#define COLUMN_MUL 2
+#define COLUMN_DIV 3
+#define COLUMN_MIN 4
+#define COLUMN_MAX 5
+#define COLUMN_NEG 6
+
+// no limit on the number of arguments
+#define VARIADIC ((unsigned)-1)
+
+// most pairs of a range and a criterion taken by SUMIFS and COUNTIFS
+#define MAX_CRITERIA 15
+
+// a function available in formulas; the entry point takes all of the
+// arguments at once and is only called when every one of them has one of
+// the accepted types (so it needs no error checks), any other call is
+// folded from left to right with the binary step instead, which handles
+// errors and bad arguments (functions without it accept every type)
+typedef struct {
+    const char *name;
+    unsigned minArgs, maxArgs;
+    const char *accepts; // types of the arguments taken by the entry point
+    Value (*call)(Arena *, const Value *, unsigned);
+    Value (*step)(Arena *, Value, Value); // NULL for fixed arity
+    int aggregate; // the kernel folding ranges of numbers (or AGGREGATE_NONE)
+    int column; // the kernel applied to columns of numbers (or COLUMN_NONE)
+    unsigned rangeArgs; // bits of the arguments taking ranges as they are
+    unsigned criteriaArgs; // bits of the arguments compiled into criteria
+} Function;
+
+extern const Function functions[];
+extern const int numFunctions;
+
+int findFunction(const char *, int);
+Value callFunction(Arena *, int, const Value *, unsigned);
+
+typedef struct {
+    int func;
+    char type;
+    long long ints[AGGREGATE_LANES];
+    double fps[AGGREGATE_LANES];
+    long long tailInts[AGGREGATE_LANES];
+    double tailFps[AGGREGATE_LANES];
+    unsigned tailLength;
+} Aggregate;
+
+void startAggregate(Aggregate *, int, char);
+void addToAggregate(Aggregate *, const void *, size_t);
+Value finishAggregate(Aggregate *);
+void selectNumbers(const Criterion *, const ColumnSpan *, size_t,
+                   unsigned char *);
+void applyInts(int, long long *, const long long *, size_t, unsigned char *);
+void applyFloats(int, double *, const double *, size_t, unsigned char *);
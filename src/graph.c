@@ -0,0 +1,302 @@
+#include "sheet.h"
+#include <stdlib.h>
+
+// the dependency graph: every cell keeps the cells and ranges its formula
+// reads (its precedents); a cell read on its own keeps the cells reading it
+// in its refs array, while a range is registered in an interval index, so
+// that referencing a range costs the same no matter how many rows it spans
+// (and does not allocate the empty cells)
+//
+// the index holds an interval tree for every column: a range read by
+// a formula is stored as the interval of its rows in the trees of all of
+// its columns; the formulas reading a cell through a range are then found
+// with a stabbing query on the tree of the cell's column, in O(k log n)
+// time for n ranges of which k contain the cell (a range costs a node per
+// column, whole columns are cheap while whole rows are not)
+//
+// the trees are treaps ordered by the first row of the interval, every node
+// holds the greatest last row found in its subtree to prune the queries
+
+typedef struct _IntervalNode {
+    unsigned y1, y2; // the rows of the range
+    unsigned x, y; // the cell reading it
+    Cell *cell; // ditto (it is not freed while it has precedents)
+    unsigned maxY2;
+    unsigned priority;
+    struct _IntervalNode *left, *right;
+} IntervalNode;
+
+static IntervalNode **trees = NULL;
+static unsigned seed = 2463534242u;
+
+static bool isSingleCell(Range range) {
+    return range.x1 == range.x2 && range.y1 == range.y2;
+}
+
+// xorshift, the treaps only need the priorities to be scattered
+static unsigned nextPriority(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// nodes are ordered by all of their fields, equal nodes are interchangeable
+static int compareNodes(const IntervalNode *first, const IntervalNode *second) {
+    unsigned a[] = { first->y1, first->y2, first->y, first->x };
+    unsigned b[] = { second->y1, second->y2, second->y, second->x };
+    for (int i = 0; i < 4; i++) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static void updateNode(IntervalNode *node) {
+    node->maxY2 = node->y2;
+    if (node->left != NULL && node->left->maxY2 > node->maxY2) {
+        node->maxY2 = node->left->maxY2;
+    }
+    if (node->right != NULL && node->right->maxY2 > node->maxY2) {
+        node->maxY2 = node->right->maxY2;
+    }
+}
+
+// split the tree into the nodes ordered before the key and the rest
+static void splitTree(IntervalNode *root, const IntervalNode *key,
+                      IntervalNode **left, IntervalNode **right) {
+    if (root == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+    if (compareNodes(root, key) < 0) {
+        splitTree(root->right, key, &root->right, right);
+        *left = root;
+    } else {
+        splitTree(root->left, key, left, &root->left);
+        *right = root;
+    }
+    updateNode(root);
+}
+
+// join two trees, the nodes of the first one are ordered before the others
+static IntervalNode *mergeTrees(IntervalNode *left, IntervalNode *right) {
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+    if (left->priority > right->priority) {
+        left->right = mergeTrees(left->right, right);
+        updateNode(left);
+        return left;
+    }
+    right->left = mergeTrees(left, right->left);
+    updateNode(right);
+    return right;
+}
+
+static IntervalNode *insertNode(IntervalNode *root, IntervalNode *node) {
+    if (root == NULL) {
+        return node;
+    }
+    if (node->priority > root->priority) {
+        splitTree(root, node, &node->left, &node->right);
+        updateNode(node);
+        return node;
+    }
+    if (compareNodes(node, root) < 0) {
+        root->left = insertNode(root->left, node);
+    } else {
+        root->right = insertNode(root->right, node);
+    }
+    updateNode(root);
+    return root;
+}
+
+// remove one node equal to the key (if any)
+static IntervalNode *removeNode(IntervalNode *root, const IntervalNode *key) {
+    if (root == NULL) {
+        return NULL;
+    }
+    int order = compareNodes(key, root);
+    if (order == 0) {
+        IntervalNode *rest = mergeTrees(root->left, root->right);
+        free(root);
+        return rest;
+    }
+    if (order < 0) {
+        root->left = removeNode(root->left, key);
+    } else {
+        root->right = removeNode(root->right, key);
+    }
+    updateNode(root);
+    return root;
+}
+
+static void freeTree(IntervalNode *root) {
+    if (root != NULL) {
+        freeTree(root->left);
+        freeTree(root->right);
+        free(root);
+    }
+}
+
+// visit the cells reading the ranges of the tree that contain the cell
+static void stabTree(const IntervalNode *root, const Cell *cell,
+                     void (*visit)(Cell *, void *), void *arg) {
+    // no interval of the subtree reaches the row of the cell
+    if (root == NULL || root->maxY2 < cell->y) {
+        return;
+    }
+    stabTree(root->left, cell, visit, arg);
+    // the intervals of the right subtree start after this one
+    if (root->y1 > cell->y) {
+        return;
+    }
+    // a range containing the cell reading it does not make a cycle
+    if (root->y2 >= cell->y && root->cell != cell) {
+        visit(root->cell, arg);
+    }
+    stabTree(root->right, cell, visit, arg);
+}
+
+static void addRecord(Range range, Cell *cell) {
+    if (trees == NULL) {
+        trees = calloc(MAX_COLS, sizeof(IntervalNode *));
+    }
+    for (unsigned col = range.x1; col <= range.x2; col++) {
+        IntervalNode *node = malloc(sizeof(IntervalNode));
+        node->y1 = range.y1;
+        node->y2 = range.y2;
+        node->x = cell->x;
+        node->y = cell->y;
+        node->cell = cell;
+        node->priority = nextPriority();
+        node->left = node->right = NULL;
+        updateNode(node);
+        trees[col] = insertNode(trees[col], node);
+    }
+}
+
+static void removeRecord(Range range, unsigned x, unsigned y) {
+    IntervalNode key;
+    key.y1 = range.y1;
+    key.y2 = range.y2;
+    key.x = x;
+    key.y = y;
+    for (unsigned col = range.x1; col <= range.x2; col++) {
+        trees[col] = removeNode(trees[col], &key);
+    }
+}
+
+// a formula reading the same cell twice is added twice, which is harmless
+// since it is removed twice as well
+static void addRef(RefList *list, unsigned x, unsigned y) {
+    if (list->length == list->capacity) {
+        list->capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        list->cells = realloc(list->cells, list->capacity * sizeof(Position));
+    }
+    list->cells[list->length].x = x;
+    list->cells[list->length].y = y;
+    list->length++;
+}
+
+// the order of the array does not matter, the last entry fills the gap
+static void removeRef(RefList *list, unsigned x, unsigned y) {
+    for (unsigned i = 0; i < list->length; i++) {
+        if (list->cells[i].x == x && list->cells[i].y == y) {
+            list->cells[i] = list->cells[--list->length];
+            break;
+        }
+    }
+    if (list->length == 0) {
+        free(list->cells);
+        list->cells = NULL;
+        list->capacity = 0;
+    }
+}
+
+// register the range (or cell) as a dependency of the given cell
+void linkRange(Range range, unsigned x, unsigned y) {
+    Cell *cell = touchCell(x, y);
+    if (cell->numPrecedents % 4 == 0) {
+        cell->precedents = realloc(cell->precedents,
+                                   (cell->numPrecedents + 4) * sizeof(Range));
+    }
+    cell->precedents[cell->numPrecedents++] = range;
+
+    if (!isSingleCell(range)) {
+        addRecord(range, cell);
+    } else if (range.x1 != x || range.y1 != y) {
+        addRef(&touchCell(range.x1, range.y1)->refs, x, y);
+    }
+}
+
+// remove the dependencies of the given cell
+void unlinkRefs(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    if (cell == NULL) {
+        return;
+    }
+    Range *precedents = cell->precedents;
+    unsigned numPrecedents = cell->numPrecedents;
+    cell->precedents = NULL;
+    cell->numPrecedents = 0;
+
+    for (unsigned i = 0; i < numPrecedents; i++) {
+        Range range = precedents[i];
+        if (!isSingleCell(range)) {
+            removeRecord(range, x, y);
+        } else if (range.x1 != x || range.y1 != y) {
+            Cell *src = findCell(range.x1, range.y1);
+            if (src != NULL) {
+                removeRef(&src->refs, x, y);
+                // the source cell might have been kept only for this reference
+                releaseCell(range.x1, range.y1);
+            }
+        }
+    }
+    free(precedents);
+}
+
+// register the cells read by the formula as dependencies of the given cell,
+// replacing the ones registered for its previous formula
+void linkRefs(const Formula *formula, unsigned x, unsigned y) {
+    unlinkRefs(x, y);
+    for (unsigned i = 0; i < formula->length; i++) {
+        const Instr *instr = &formula->code[i];
+        if (instr->op == OP_CELL || instr->op == OP_RANGE) {
+            linkRange(placeRange(AS_RANGE(instr->value), x, y), x, y);
+        }
+    }
+}
+
+// call visit() for every cell reading the given one, directly or through
+// a range (a cell is visited once for every time its formula reads it)
+void forEachDependent(const Cell *cell, void (*visit)(Cell *, void *),
+                      void *arg) {
+    for (unsigned i = 0; i < cell->refs.length; i++) {
+        Cell *dst = findCell(cell->refs.cells[i].x, cell->refs.cells[i].y);
+        if (dst != NULL) {
+            visit(dst, arg);
+        }
+    }
+    if (trees != NULL) {
+        stabTree(trees[cell->x], cell, visit, arg);
+    }
+}
+
+// forget all ranges (when all cells are freed)
+void clearRanges(void) {
+    if (trees == NULL) {
+        return;
+    }
+    for (unsigned col = 0; col < MAX_COLS; col++) {
+        freeTree(trees[col]);
+    }
+    free(trees);
+    trees = NULL;
+}
@@ -0,0 +1,375 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// layout of the v2 file format (all numbers are little-endian):
+// - header: the signature (8 bytes), the cursor position (x, y), the number
+//   of cells, of dependency ranges and of bytes of strings (4 bytes each)
+// - cells: fixed-width records of x, y, formula offset and length, text
+//   scroll (4 bytes each), type, forced type, result type (1 byte each and
+//   1 byte of padding), the result (8 bytes: INT, FLOAT, error code or text
+//   offset and length), the first dependency range and their number (4 each)
+// - dependencies: the ranges read by the formulas (x1, y1, x2, y2)
+// - strings: the formulas and the TEXT results (offsets are relative to
+//   the beginning of this section)
+// the results are stored, so loading does not need to recalculate anything
+#define HEADER_SIZE 28
+#define RECORD_SIZE 40
+#define RANGE_SIZE 16
+
+// growable buffer of bytes for writing a file section
+typedef struct {
+    unsigned char *data;
+    size_t length, capacity;
+} Buffer;
+
+char language = LANG_EN;
+
+char *errors[2][NUM_ERRORS] = {
+    {
+        "INCORRECT FORMULA!", "TOO MANY ARGUMENTS!", "TOO FEW ARGUMENTS!",
+        "INCORRECT ARGUMENT!", "TOO FEW ARGUMENTS!", "DIVISION BY ZERO!",
+        "OUT OF BOUNDS!", "INFINITE CYCLE!", "NO SUCH FUNCTION!",
+        "NOT FOUND!"
+    },
+    {
+        "BLEDNA FORMULA!", "ZA DUZO ARGUMENTOW!", "ZA MALO ARGUMENTOW!",
+        "NIEPOPRAWNY ARGUMENT!", "ZA MALO ARGUMENTOW!", "DZIELENIE PRZEZ ZERO!",
+        "WYJSCIE POZA ZAKRES!", "NIESKONCZONY CYKL!", "NIEISTNIEJACA FUNKCJA!",
+        "NIE ZNALEZIONO!"
+    }
+};
+
+// format a value for display; numbers are printed to the buffer,
+// otherwise the returned text is owned by the value (or is an error message)
+const char *formatValue(const Value *value, char *buffer) {
+    if (value->type == TYPE_INT) {
+        sprintf(buffer, "%lld", AS_INT(*value));
+    } else if (value->type == TYPE_FLOAT) {
+        sprintf(buffer, "%.3lf", AS_FLOAT(*value));
+    } else if (value->type == TYPE_TEXT) {
+        return AS_TEXT(*value);
+    } else {
+        return errors[language][GET_ERROR(*value)];
+    }
+    return buffer;
+}
+
+// the cell's result as displayed
+const char *cellText(const Cell *cell, char *buffer) {
+    return formatValue(&cell->result, buffer);
+}
+
+// write the address of a cell (such as AB12) to the buffer
+char *cellName(unsigned x, unsigned y, char *buffer) {
+    char letters[4];
+    int i = 0;
+    for (x++; x > 0; x = (x - 1) / 26) {
+        letters[i++] = ALPHA_BASE + (x - 1) % 26;
+    }
+    int j = 0;
+    while (i > 0) {
+        buffer[j++] = letters[--i];
+    }
+    sprintf(buffer + j, "%u", y + 1);
+    return buffer;
+}
+
+static unsigned char *reserve(Buffer *buffer, size_t size) {
+    if (buffer->length + size > buffer->capacity) {
+        while (buffer->length + size > buffer->capacity) {
+            buffer->capacity = buffer->capacity == 0 ? 256 :
+                               buffer->capacity * 2;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->length += size;
+    return buffer->data + buffer->length - size;
+}
+
+static void put32(unsigned char *bytes, uint32_t number) {
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = number >> (8 * i);
+    }
+}
+
+static void put64(unsigned char *bytes, uint64_t number) {
+    put32(bytes, (uint32_t)number);
+    put32(bytes + 4, (uint32_t)(number >> 32));
+}
+
+static uint32_t get32(const unsigned char *bytes) {
+    return bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *bytes) {
+    return get32(bytes) | (uint64_t)get32(bytes + 4) << 32;
+}
+
+// whether the types of a cell read from a file are ones it can hold: the
+// forced type indexes types[] and the type is the forced one or ERROR
+static bool validTypes(char type, unsigned char curType) {
+    return curType < NUM_TYPES &&
+           (type == types[curType] || type == TYPE_ERROR);
+}
+
+// read the old format: the signature, the cursor position, then for every
+// cell its position and types (1 byte each), the text scroll and the length
+// of the formula (as '\0'-terminated decimal numbers) and the formula itself;
+// the formulas are loaded in bulk and recalculated once at the end
+static bool loadSheetV1(const unsigned char *data, size_t size,
+                        void (*updated)(Cell *)) {
+    size_t pos = strlen(FILE_SIGNATURE) + 2;
+    beginLoad();
+    while (pos + 4 < size) {
+        Cell *cell = touchCell(data[pos], data[pos + 1]);
+        if (validTypes(data[pos + 2], data[pos + 3])) {
+            cell->type = data[pos + 2];
+            cell->curType = data[pos + 3];
+        }
+        pos += 4;
+        size_t numbers[2] = { 0, 0 };
+        for (int i = 0; i < 2; i++) {
+            while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+                numbers[i] = numbers[i] * 10 + data[pos++] - '0';
+            }
+            pos++; // the terminating '\0'
+        }
+        cell->textScroll = numbers[0];
+        size_t length = numbers[1];
+        if (pos > size || length > size - pos) {
+            length = pos > size ? 0 : size - pos;
+        }
+        char *formula = strndup((const char *)data + pos, length);
+        pos += length;
+        loadFormula(cell, formula);
+        free(formula);
+    }
+    commitLoad(updated);
+    return TRUE;
+}
+
+// check that all offsets of the v2 file point inside it
+static bool validSheetV2(const unsigned char *data, size_t size) {
+    if (size < HEADER_SIZE) {
+        return FALSE;
+    }
+    uint64_t cells = get32(data + 16), ranges = get32(data + 20);
+    uint64_t stringSize = get32(data + 24);
+    if (HEADER_SIZE + cells * RECORD_SIZE + ranges * RANGE_SIZE +
+        stringSize > size) {
+        return FALSE;
+    }
+    const unsigned char *range = data + HEADER_SIZE + cells * RECORD_SIZE;
+    for (uint64_t i = 0; i < ranges; i++, range += RANGE_SIZE) {
+        if (get32(range) > get32(range + 8) || get32(range + 8) >= MAX_COLS ||
+            get32(range + 4) > get32(range + 12) ||
+            get32(range + 12) >= MAX_ROWS) {
+            return FALSE;
+        }
+    }
+    const unsigned char *record = data + HEADER_SIZE;
+    for (uint64_t i = 0; i < cells; i++, record += RECORD_SIZE) {
+        uint64_t formulaEnd = (uint64_t)get32(record + 8) + get32(record + 12);
+        uint64_t rangesEnd = (uint64_t)get32(record + 32) + get32(record + 36);
+        if (get32(record) >= MAX_COLS || get32(record + 4) >= MAX_ROWS ||
+            formulaEnd > stringSize || rangesEnd > ranges ||
+            !validTypes(record[20], record[21])) {
+            return FALSE;
+        }
+        if (record[22] == TYPE_TEXT &&
+            (uint64_t)get32(record + 24) + get32(record + 28) > stringSize) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// read the new format; the stored results are used as they are and
+// the formulas are only compiled once they need to be evaluated
+static bool loadSheetV2(const unsigned char *data, size_t size,
+                        void (*updated)(Cell *)) {
+    if (!validSheetV2(data, size)) {
+        return FALSE;
+    }
+    uint32_t cells = get32(data + 16), ranges = get32(data + 20);
+    const unsigned char *records = data + HEADER_SIZE;
+    const unsigned char *dependencies = records + (size_t)cells * RECORD_SIZE;
+    const char *strings = (const char *)dependencies +
+                          (size_t)ranges * RANGE_SIZE;
+
+    for (uint32_t i = 0; i < cells; i++) {
+        const unsigned char *record = records + (size_t)i * RECORD_SIZE;
+        Cell *cell = touchCell(get32(record), get32(record + 4));
+        const char *formula = internFormula(strings + get32(record + 8),
+                                            get32(record + 12), cell->x,
+                                            cell->y);
+        releaseFormula(cell->formula);
+        cell->formula = formula;
+        cell->compiled = NULL;
+        cell->textScroll = get32(record + 16);
+        cell->type = record[20];
+        cell->curType = record[21];
+
+        Value result;
+        uint64_t bits = get64(record + 24);
+        if (record[22] == TYPE_TEXT) {
+            result = makeText(strings + get32(record + 24),
+                              get32(record + 28), NULL);
+        } else if (record[22] == TYPE_FLOAT) {
+            result.type = TYPE_FLOAT;
+            memcpy(&AS_FLOAT(result), &bits, sizeof(double));
+        } else if (record[22] == TYPE_INT) {
+            result.type = TYPE_INT;
+            AS_INT(result) = (long long)bits;
+        } else {
+            SET_ERROR(result, bits < NUM_ERRORS ? (int)bits : ERROR_GENERAL);
+        }
+        setCellResult(cell, result);
+        updateColumn(cell);
+    }
+
+    // the dependencies can only be linked once all cells exist
+    for (uint32_t i = 0; i < cells; i++) {
+        const unsigned char *record = records + (size_t)i * RECORD_SIZE;
+        unsigned x = get32(record), y = get32(record + 4);
+        const unsigned char *range = dependencies +
+                                     (size_t)get32(record + 32) * RANGE_SIZE;
+        for (uint32_t j = 0; j < get32(record + 36); j++, range += RANGE_SIZE) {
+            Range value;
+            value.x1 = get32(range);
+            value.y1 = get32(range + 4);
+            value.x2 = get32(range + 8);
+            value.y2 = get32(range + 12);
+            linkRange(value, x, y);
+        }
+    }
+
+    if (updated != NULL) {
+        for (uint32_t i = 0; i < cells; i++) {
+            const unsigned char *record = records + (size_t)i * RECORD_SIZE;
+            updated(findCell(get32(record), get32(record + 4)));
+        }
+    }
+    return TRUE;
+}
+
+// load a sheet (in either format) from a file, the callback (if any) is
+// called for every loaded cell; returns FALSE if the file could not be read
+bool loadSheet(const char *fileName, void (*updated)(Cell *)) {
+    int file = open(fileName, O_RDONLY);
+    if (file < 0) {
+        return FALSE;
+    }
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < 8) {
+        close(file);
+        return FALSE;
+    }
+    size_t size = info.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        return FALSE;
+    }
+
+    bool success = FALSE;
+    if (memcmp(data, FILE_SIGNATURE_V2, 8) == 0) {
+        success = loadSheetV2(data, size, updated);
+    } else if (memcmp(data, FILE_SIGNATURE, 8) == 0) {
+        success = loadSheetV1(data, size, updated);
+    }
+    munmap(data, size);
+    return success;
+}
+
+// append the cell's record (and its formula, result and dependencies)
+static void saveCell(Cell *cell, Buffer *records, Buffer *ranges,
+                     Buffer *strings) {
+    unsigned char *record = reserve(records, RECORD_SIZE);
+    char *formula = formulaText(cell->formula, cell->x, cell->y);
+    size_t length = strlen(formula);
+    put32(record, cell->x);
+    put32(record + 4, cell->y);
+    put32(record + 8, strings->length);
+    put32(record + 12, length);
+    memcpy(reserve(strings, length), formula, length);
+    free(formula);
+    put32(record + 16, cell->textScroll);
+    record[20] = cell->type;
+    record[21] = cell->curType;
+    record[22] = cell->result.type;
+    record[23] = 0;
+
+    uint64_t bits = 0;
+    if (cell->result.type == TYPE_TEXT) {
+        const char *text = AS_TEXT(cell->result);
+        length = strlen(text);
+        bits = strings->length | (uint64_t)length << 32;
+        memcpy(reserve(strings, length), text, length);
+    } else if (cell->result.type == TYPE_FLOAT) {
+        memcpy(&bits, &AS_FLOAT(cell->result), sizeof(double));
+    } else {
+        bits = AS_INT(cell->result);
+    }
+    put64(record + 24, bits);
+
+    put32(record + 32, ranges->length / RANGE_SIZE);
+    for (unsigned i = 0; i < cell->numPrecedents; i++) {
+        unsigned char *range = reserve(ranges, RANGE_SIZE);
+        put32(range, cell->precedents[i].x1);
+        put32(range + 4, cell->precedents[i].y1);
+        put32(range + 8, cell->precedents[i].x2);
+        put32(range + 12, cell->precedents[i].y2);
+    }
+    put32(record + 36, cell->numPrecedents);
+}
+
+// save all cells holding data along with the cursor position (in the new
+// format, the sections are built in memory and written one after another)
+bool saveSheet(const char *fileName, unsigned curX, unsigned curY) {
+    FILE *file = fopen(fileName, "wb");
+    if (file == NULL) {
+        return FALSE;
+    }
+
+    Buffer records = { NULL, 0, 0 };
+    Buffer ranges = { NULL, 0, 0 };
+    Buffer strings = { NULL, 0, 0 };
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        if (strlen(cell->formula) > 0 || cell->type != TYPE_AUTO) {
+            saveCell(cell, &records, &ranges, &strings);
+        }
+    }
+
+    unsigned char header[HEADER_SIZE];
+    memcpy(header, FILE_SIGNATURE_V2, 8);
+    put32(header + 8, curX);
+    put32(header + 12, curY);
+    put32(header + 16, records.length / RECORD_SIZE);
+    put32(header + 20, ranges.length / RANGE_SIZE);
+    put32(header + 24, strings.length);
+    bool success = fwrite(header, HEADER_SIZE, 1, file) == 1 &&
+                   fwrite(records.data, 1, records.length, file) ==
+                   records.length &&
+                   fwrite(ranges.data, 1, ranges.length, file) ==
+                   ranges.length &&
+                   fwrite(strings.data, 1, strings.length, file) ==
+                   strings.length;
+    success = fclose(file) == 0 && success;
+
+    free(records.data);
+    free(ranges.data);
+    free(strings.data);
+    return success;
+}
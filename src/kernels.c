@@ -0,0 +1,642 @@
+#include "sheet.h"
+#include "funcs.h"
+#include <math.h>
+#include <limits.h>
+
+// vectorized folds of SUM, MUL, MIN and MAX over ranges holding only INT
+// or only FLOAT values; the values are fed in chunks (of any length) and
+// accumulated in AGGREGATE_LANES independent lanes: element i of the range
+// goes to lane i % AGGREGATE_LANES, except for the last
+// (length % AGGREGATE_LANES) elements, which are kept aside as the tail
+//
+// INT results are exactly the same as those of the sequential fold
+// (addition and multiplication wrap around and are therefore associative,
+// MIN and MAX do not depend on the order at all)
+//
+// FLOAT results are computed in a fixed order, which is the same for the
+// AVX2, SSE2 and scalar versions: every lane folds its elements in the order
+// they appear in the range, then the lanes are combined as
+// (lane 0 op lane 1) op (lane 2 op lane 3) and finally the tail is folded
+// in sequentially; for SUM and MUL this may differ from the left-to-right
+// fold in the last bits, MIN and MAX are only sensitive to the sign of zero
+// (ranges containing NaN are not passed to MIN and MAX, since the lanes
+// would not skip it the way fmin() and fmax() do)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+void startAggregate(Aggregate *aggregate, int func, char type) {
+    aggregate->func = func;
+    aggregate->type = type;
+    aggregate->tailLength = 0;
+    for (int i = 0; i < AGGREGATE_LANES; i++) {
+        if (func == AGGREGATE_SUM) {
+            aggregate->ints[i] = 0;
+            // -0.0 is the identity of addition, (-0.0) + (+0.0) is +0.0
+            aggregate->fps[i] = -0.0;
+        } else if (func == AGGREGATE_MUL) {
+            aggregate->ints[i] = 1;
+            aggregate->fps[i] = 1.0;
+        } else if (func == AGGREGATE_MIN) {
+            aggregate->ints[i] = LLONG_MAX;
+            aggregate->fps[i] = INFINITY;
+        } else {
+            aggregate->ints[i] = LLONG_MIN;
+            aggregate->fps[i] = -INFINITY;
+        }
+    }
+}
+
+static void foldIntsScalar(Aggregate *aggregate, const long long *values,
+                           size_t length) {
+    long long *lanes = aggregate->ints;
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        for (int j = 0; j < AGGREGATE_LANES; j++) {
+            long long value = values[i + j];
+            if (aggregate->func == AGGREGATE_SUM) {
+                lanes[j] = (unsigned long long)lanes[j] + value;
+            } else if (aggregate->func == AGGREGATE_MUL) {
+                lanes[j] = (unsigned long long)lanes[j] * value;
+            } else if (aggregate->func == AGGREGATE_MIN) {
+                lanes[j] = value < lanes[j] ? value : lanes[j];
+            } else {
+                lanes[j] = value > lanes[j] ? value : lanes[j];
+            }
+        }
+    }
+}
+
+static void foldFloatsScalar(Aggregate *aggregate, const double *values,
+                             size_t length) {
+    double *lanes = aggregate->fps;
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        for (int j = 0; j < AGGREGATE_LANES; j++) {
+            double value = values[i + j];
+            if (aggregate->func == AGGREGATE_SUM) {
+                lanes[j] += value;
+            } else if (aggregate->func == AGGREGATE_MUL) {
+                lanes[j] *= value;
+            } else if (aggregate->func == AGGREGATE_MIN) {
+                lanes[j] = value < lanes[j] ? value : lanes[j];
+            } else {
+                lanes[j] = value > lanes[j] ? value : lanes[j];
+            }
+        }
+    }
+}
+
+#ifdef HAVE_X86
+// there is no 64-bit integer comparison before SSE4.2 and no 64-bit integer
+// multiplication before AVX-512, these fall back to the scalar loop
+
+__attribute__((target("avx2")))
+static void foldIntsAVX2(Aggregate *aggregate, const long long *values,
+                         size_t length) {
+    if (aggregate->func == AGGREGATE_MUL) {
+        foldIntsScalar(aggregate, values, length);
+        return;
+    }
+    __m256i lanes = _mm256_loadu_si256((const __m256i *)aggregate->ints);
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(values + i));
+        if (aggregate->func == AGGREGATE_SUM) {
+            lanes = _mm256_add_epi64(lanes, value);
+        } else if (aggregate->func == AGGREGATE_MIN) {
+            __m256i greater = _mm256_cmpgt_epi64(lanes, value);
+            lanes = _mm256_blendv_epi8(lanes, value, greater);
+        } else {
+            __m256i greater = _mm256_cmpgt_epi64(value, lanes);
+            lanes = _mm256_blendv_epi8(lanes, value, greater);
+        }
+    }
+    _mm256_storeu_si256((__m256i *)aggregate->ints, lanes);
+}
+
+__attribute__((target("avx2")))
+static void foldFloatsAVX2(Aggregate *aggregate, const double *values,
+                           size_t length) {
+    __m256d lanes = _mm256_loadu_pd(aggregate->fps);
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        __m256d value = _mm256_loadu_pd(values + i);
+        if (aggregate->func == AGGREGATE_SUM) {
+            lanes = _mm256_add_pd(lanes, value);
+        } else if (aggregate->func == AGGREGATE_MUL) {
+            lanes = _mm256_mul_pd(lanes, value);
+        } else if (aggregate->func == AGGREGATE_MIN) {
+            lanes = _mm256_min_pd(value, lanes);
+        } else {
+            lanes = _mm256_max_pd(value, lanes);
+        }
+    }
+    _mm256_storeu_pd(aggregate->fps, lanes);
+}
+
+static void foldIntsSSE2(Aggregate *aggregate, const long long *values,
+                         size_t length) {
+    if (aggregate->func != AGGREGATE_SUM) {
+        foldIntsScalar(aggregate, values, length);
+        return;
+    }
+    __m128i low = _mm_loadu_si128((const __m128i *)aggregate->ints);
+    __m128i high = _mm_loadu_si128((const __m128i *)(aggregate->ints + 2));
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        low = _mm_add_epi64(low,
+                            _mm_loadu_si128((const __m128i *)(values + i)));
+        high = _mm_add_epi64(high,
+                             _mm_loadu_si128((const __m128i *)(values + i + 2)));
+    }
+    _mm_storeu_si128((__m128i *)aggregate->ints, low);
+    _mm_storeu_si128((__m128i *)(aggregate->ints + 2), high);
+}
+
+static void foldFloatsSSE2(Aggregate *aggregate, const double *values,
+                           size_t length) {
+    __m128d low = _mm_loadu_pd(aggregate->fps);
+    __m128d high = _mm_loadu_pd(aggregate->fps + 2);
+    for (size_t i = 0; i < length; i += AGGREGATE_LANES) {
+        __m128d first = _mm_loadu_pd(values + i);
+        __m128d second = _mm_loadu_pd(values + i + 2);
+        if (aggregate->func == AGGREGATE_SUM) {
+            low = _mm_add_pd(low, first);
+            high = _mm_add_pd(high, second);
+        } else if (aggregate->func == AGGREGATE_MUL) {
+            low = _mm_mul_pd(low, first);
+            high = _mm_mul_pd(high, second);
+        } else if (aggregate->func == AGGREGATE_MIN) {
+            low = _mm_min_pd(first, low);
+            high = _mm_min_pd(second, high);
+        } else {
+            low = _mm_max_pd(first, low);
+            high = _mm_max_pd(second, high);
+        }
+    }
+    _mm_storeu_pd(aggregate->fps, low);
+    _mm_storeu_pd(aggregate->fps + 2, high);
+}
+
+static bool hasAVX2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static void foldInts(Aggregate *aggregate, const long long *values,
+                     size_t length) {
+#ifdef HAVE_X86
+    if (hasAVX2()) {
+        foldIntsAVX2(aggregate, values, length);
+    } else {
+        foldIntsSSE2(aggregate, values, length);
+    }
+#else
+    foldIntsScalar(aggregate, values, length);
+#endif
+}
+
+static void foldFloats(Aggregate *aggregate, const double *values,
+                       size_t length) {
+#ifdef HAVE_X86
+    if (hasAVX2()) {
+        foldFloatsAVX2(aggregate, values, length);
+    } else {
+        foldFloatsSSE2(aggregate, values, length);
+    }
+#else
+    foldFloatsScalar(aggregate, values, length);
+#endif
+}
+
+// fold the next values of the range (of the type the aggregate was started
+// with) into the lanes; chunks can have any length, the elements that do
+// not fill a whole group of lanes are kept in the tail until the next call
+void addToAggregate(Aggregate *aggregate, const void *values, size_t length) {
+    const long long *ints = values;
+    const double *fps = values;
+    size_t i = 0;
+    // complete the group started by the previous chunk
+    if (aggregate->tailLength > 0) {
+        for (; i < length && aggregate->tailLength < AGGREGATE_LANES; i++) {
+            if (aggregate->type == TYPE_INT) {
+                aggregate->tailInts[aggregate->tailLength++] = ints[i];
+            } else {
+                aggregate->tailFps[aggregate->tailLength++] = fps[i];
+            }
+        }
+        if (aggregate->tailLength < AGGREGATE_LANES) {
+            return;
+        }
+        if (aggregate->type == TYPE_INT) {
+            foldIntsScalar(aggregate, aggregate->tailInts, AGGREGATE_LANES);
+        } else {
+            foldFloatsScalar(aggregate, aggregate->tailFps, AGGREGATE_LANES);
+        }
+        aggregate->tailLength = 0;
+    }
+
+    size_t body = (length - i) - (length - i) % AGGREGATE_LANES;
+    if (aggregate->type == TYPE_INT) {
+        foldInts(aggregate, ints + i, body);
+    } else {
+        foldFloats(aggregate, fps + i, body);
+    }
+    for (i += body; i < length; i++) {
+        if (aggregate->type == TYPE_INT) {
+            aggregate->tailInts[aggregate->tailLength++] = ints[i];
+        } else {
+            aggregate->tailFps[aggregate->tailLength++] = fps[i];
+        }
+    }
+}
+
+static long long combineInts(int func, long long first, long long second) {
+    if (func == AGGREGATE_SUM) {
+        return (unsigned long long)first + second;
+    } else if (func == AGGREGATE_MUL) {
+        return (unsigned long long)first * second;
+    } else if (func == AGGREGATE_MIN) {
+        return second < first ? second : first;
+    }
+    return second > first ? second : first;
+}
+
+static double combineFloats(int func, double first, double second) {
+    if (func == AGGREGATE_SUM) {
+        return first + second;
+    } else if (func == AGGREGATE_MUL) {
+        return first * second;
+    } else if (func == AGGREGATE_MIN) {
+        return fmin(first, second);
+    }
+    return fmax(first, second);
+}
+
+// combine the lanes and fold in the tail
+Value finishAggregate(Aggregate *aggregate) {
+    Value value;
+    value.type = aggregate->type;
+    int func = aggregate->func;
+    if (aggregate->type == TYPE_INT) {
+        long long *lanes = aggregate->ints;
+        AS_INT(value) = combineInts(func, combineInts(func, lanes[0], lanes[1]),
+                                    combineInts(func, lanes[2], lanes[3]));
+        for (unsigned i = 0; i < aggregate->tailLength; i++) {
+            AS_INT(value) = combineInts(func, AS_INT(value),
+                                        aggregate->tailInts[i]);
+        }
+    } else {
+        double *lanes = aggregate->fps;
+        AS_FLOAT(value) = combineFloats(func,
+                                        combineFloats(func, lanes[0], lanes[1]),
+                                        combineFloats(func, lanes[2], lanes[3]));
+        for (unsigned i = 0; i < aggregate->tailLength; i++) {
+            AS_FLOAT(value) = combineFloats(func, AS_FLOAT(value),
+                                            aggregate->tailFps[i]);
+        }
+    }
+    return value;
+}
+
+// numeric criteria applied to a span of a column: selectNumbers() clears
+// the bytes of the mask for the rows not satisfying the criterion; INT
+// values are compared with the operand as integers (it must be integral),
+// FLOAT values as doubles, where NaN only satisfies CRITERION_NE
+
+static bool testInt(char op, long long value, long long operand) {
+    switch (op) {
+        case CRITERION_EQ: return value == operand;
+        case CRITERION_NE: return value != operand;
+        case CRITERION_LT: return value < operand;
+        case CRITERION_LE: return value <= operand;
+        case CRITERION_GT: return value > operand;
+        default: return value >= operand;
+    }
+}
+
+static bool testFloat(char op, double value, double operand) {
+    switch (op) {
+        case CRITERION_EQ: return value == operand;
+        case CRITERION_NE: return !(value == operand);
+        case CRITERION_LT: return value < operand;
+        case CRITERION_LE: return value <= operand;
+        case CRITERION_GT: return value > operand;
+        default: return value >= operand;
+    }
+}
+
+static void selectIntsScalar(char op, const long long *values, size_t length,
+                             long long operand, unsigned char *mask) {
+    for (size_t i = 0; i < length; i++) {
+        mask[i] &= testInt(op, values[i], operand);
+    }
+}
+
+static void selectFloatsScalar(char op, const double *values, size_t length,
+                               double operand, unsigned char *mask) {
+    for (size_t i = 0; i < length; i++) {
+        mask[i] &= testFloat(op, values[i], operand);
+    }
+}
+
+#ifdef HAVE_X86
+// the comparisons give four bits at a time, which are spread over the mask
+
+__attribute__((target("avx2")))
+static void selectIntsAVX2(char op, const long long *values, size_t length,
+                           long long operand, unsigned char *mask) {
+    __m256i broadcast = _mm256_set1_epi64x(operand);
+    size_t body = length - length % 4;
+    for (size_t i = 0; i < body; i += 4) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(values + i));
+        __m256i test;
+        if (op == CRITERION_EQ || op == CRITERION_NE) {
+            test = _mm256_cmpeq_epi64(value, broadcast);
+        } else if (op == CRITERION_GT || op == CRITERION_LE) {
+            test = _mm256_cmpgt_epi64(value, broadcast);
+        } else {
+            test = _mm256_cmpgt_epi64(broadcast, value);
+        }
+        int bits = _mm256_movemask_pd(_mm256_castsi256_pd(test));
+        // the complements of ==, > and <
+        if (op == CRITERION_NE || op == CRITERION_LE || op == CRITERION_GE) {
+            bits ^= 0xF;
+        }
+        for (int j = 0; j < 4; j++) {
+            mask[i + j] &= bits >> j & 1;
+        }
+    }
+    selectIntsScalar(op, values + body, length - body, operand, mask + body);
+}
+
+__attribute__((target("avx2")))
+static void selectFloatsAVX2(char op, const double *values, size_t length,
+                             double operand, unsigned char *mask) {
+    __m256d broadcast = _mm256_set1_pd(operand);
+    size_t body = length - length % 4;
+    for (size_t i = 0; i < body; i += 4) {
+        __m256d value = _mm256_loadu_pd(values + i);
+        __m256d test;
+        switch (op) {
+            case CRITERION_EQ:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_EQ_OQ);
+                break;
+            case CRITERION_NE:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_NEQ_UQ);
+                break;
+            case CRITERION_LT:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_LT_OQ);
+                break;
+            case CRITERION_LE:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_LE_OQ);
+                break;
+            case CRITERION_GT:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_GT_OQ);
+                break;
+            default:
+                test = _mm256_cmp_pd(value, broadcast, _CMP_GE_OQ);
+                break;
+        }
+        int bits = _mm256_movemask_pd(test);
+        for (int j = 0; j < 4; j++) {
+            mask[i + j] &= bits >> j & 1;
+        }
+    }
+    selectFloatsScalar(op, values + body, length - body, operand,
+                       mask + body);
+}
+#endif
+
+void selectNumbers(const Criterion *criterion, const ColumnSpan *span,
+                   size_t length, unsigned char *mask) {
+    if (span->type == TYPE_INT) {
+        long long operand = 0;
+        isIntegral(criterion->operand, &operand);
+#ifdef HAVE_X86
+        if (hasAVX2()) {
+            selectIntsAVX2(criterion->op, span->values, length, operand, mask);
+            return;
+        }
+#endif
+        selectIntsScalar(criterion->op, span->values, length, operand, mask);
+        return;
+    }
+    double operand = criterion->operand.type == TYPE_INT ?
+                     AS_INT(criterion->operand) :
+                     AS_FLOAT(criterion->operand);
+#ifdef HAVE_X86
+    if (hasAVX2()) {
+        selectFloatsAVX2(criterion->op, span->values, length, operand, mask);
+        return;
+    }
+#endif
+    selectFloatsScalar(criterion->op, span->values, length, operand, mask);
+}
+
+// element-wise arithmetic on columns: applyInts() and applyFloats() replace
+// every element of acc with the result of acc[i] op values[i] (-values[i]
+// for COLUMN_NEG), computing exactly what the functions would for a single
+// pair of numbers; the elements for which it fails (a division by zero or
+// LLONG_MIN / -1) are marked in the failed mask and left undefined, INT
+// divisions are not even attempted for the elements marked already
+//
+// FLOAT MIN and MAX go through fmin() and fmax(), which the vector
+// instructions do not match for NaN and signed zeros; INT MUL and DIV
+// have no vector instructions
+
+static void applyIntsScalar(int op, long long *acc, const long long *values,
+                            size_t length, unsigned char *failed) {
+    for (size_t i = 0; i < length; i++) {
+        long long value = values[i];
+        switch (op) {
+            case COLUMN_SUM:
+                acc[i] = (unsigned long long)acc[i] + value;
+                break;
+            case COLUMN_SUB:
+                acc[i] = (unsigned long long)acc[i] - value;
+                break;
+            case COLUMN_MUL:
+                acc[i] = (unsigned long long)acc[i] * value;
+                break;
+            case COLUMN_DIV:
+                // LLONG_MIN / -1 does not fit (and traps)
+                if (value == 0 || (value == -1 && acc[i] == LLONG_MIN)) {
+                    failed[i] = 1;
+                } else if (!failed[i]) {
+                    acc[i] /= value;
+                }
+                break;
+            case COLUMN_MIN:
+                acc[i] = value < acc[i] ? value : acc[i];
+                break;
+            case COLUMN_MAX:
+                acc[i] = value > acc[i] ? value : acc[i];
+                break;
+            default:
+                acc[i] = -(unsigned long long)value;
+                break;
+        }
+    }
+}
+
+static void applyFloatsScalar(int op, double *acc, const double *values,
+                              size_t length, unsigned char *failed) {
+    for (size_t i = 0; i < length; i++) {
+        double first = acc[i], value = values[i];
+        switch (op) {
+            case COLUMN_SUM: first += value; break;
+            case COLUMN_SUB: first -= value; break;
+            case COLUMN_MUL: first *= value; break;
+            case COLUMN_DIV:
+                if (value == 0) {
+                    failed[i] = 1;
+                }
+                first /= value;
+                break;
+            case COLUMN_MIN: first = fmin(first, value); break;
+            case COLUMN_MAX: first = fmax(first, value); break;
+            default: first = -value; break;
+        }
+        acc[i] = first;
+    }
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void applyIntsAVX2(int op, long long *acc, const long long *values,
+                          size_t length, unsigned char *failed) {
+    size_t body = length - length % 4;
+    for (size_t i = 0; i < body; i += 4) {
+        __m256i first = _mm256_loadu_si256((const __m256i *)(acc + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *)(values + i));
+        __m256i result;
+        if (op == COLUMN_SUM) {
+            result = _mm256_add_epi64(first, second);
+        } else if (op == COLUMN_SUB) {
+            result = _mm256_sub_epi64(first, second);
+        } else if (op == COLUMN_MIN) {
+            __m256i greater = _mm256_cmpgt_epi64(first, second);
+            result = _mm256_blendv_epi8(first, second, greater);
+        } else if (op == COLUMN_MAX) {
+            __m256i greater = _mm256_cmpgt_epi64(second, first);
+            result = _mm256_blendv_epi8(first, second, greater);
+        } else {
+            result = _mm256_sub_epi64(_mm256_setzero_si256(), second);
+        }
+        _mm256_storeu_si256((__m256i *)(acc + i), result);
+    }
+    applyIntsScalar(op, acc + body, values + body, length - body,
+                    failed + body);
+}
+
+__attribute__((target("avx2")))
+static void applyFloatsAVX2(int op, double *acc, const double *values,
+                            size_t length, unsigned char *failed) {
+    size_t body = length - length % 4;
+    for (size_t i = 0; i < body; i += 4) {
+        __m256d first = _mm256_loadu_pd(acc + i);
+        __m256d second = _mm256_loadu_pd(values + i);
+        __m256d result;
+        if (op == COLUMN_SUM) {
+            result = _mm256_add_pd(first, second);
+        } else if (op == COLUMN_SUB) {
+            result = _mm256_sub_pd(first, second);
+        } else if (op == COLUMN_MUL) {
+            result = _mm256_mul_pd(first, second);
+        } else if (op == COLUMN_DIV) {
+            __m256d zero = _mm256_cmp_pd(second, _mm256_setzero_pd(),
+                                         _CMP_EQ_OQ);
+            int bits = _mm256_movemask_pd(zero);
+            for (int j = 0; j < 4; j++) {
+                failed[i + j] |= bits >> j & 1;
+            }
+            result = _mm256_div_pd(first, second);
+        } else {
+            result = _mm256_xor_pd(second, _mm256_set1_pd(-0.0));
+        }
+        _mm256_storeu_pd(acc + i, result);
+    }
+    applyFloatsScalar(op, acc + body, values + body, length - body,
+                      failed + body);
+}
+
+static void applyIntsSSE2(int op, long long *acc, const long long *values,
+                          size_t length, unsigned char *failed) {
+    size_t body = length - length % 2;
+    for (size_t i = 0; i < body; i += 2) {
+        __m128i first = _mm_loadu_si128((const __m128i *)(acc + i));
+        __m128i second = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i result;
+        if (op == COLUMN_SUM) {
+            result = _mm_add_epi64(first, second);
+        } else if (op == COLUMN_SUB) {
+            result = _mm_sub_epi64(first, second);
+        } else {
+            result = _mm_sub_epi64(_mm_setzero_si128(), second);
+        }
+        _mm_storeu_si128((__m128i *)(acc + i), result);
+    }
+    applyIntsScalar(op, acc + body, values + body, length - body,
+                    failed + body);
+}
+
+static void applyFloatsSSE2(int op, double *acc, const double *values,
+                            size_t length, unsigned char *failed) {
+    size_t body = length - length % 2;
+    for (size_t i = 0; i < body; i += 2) {
+        __m128d first = _mm_loadu_pd(acc + i);
+        __m128d second = _mm_loadu_pd(values + i);
+        __m128d result;
+        if (op == COLUMN_SUM) {
+            result = _mm_add_pd(first, second);
+        } else if (op == COLUMN_SUB) {
+            result = _mm_sub_pd(first, second);
+        } else if (op == COLUMN_MUL) {
+            result = _mm_mul_pd(first, second);
+        } else if (op == COLUMN_DIV) {
+            int bits = _mm_movemask_pd(_mm_cmpeq_pd(second, _mm_setzero_pd()));
+            failed[i] |= bits & 1;
+            failed[i + 1] |= bits >> 1 & 1;
+            result = _mm_div_pd(first, second);
+        } else {
+            result = _mm_xor_pd(second, _mm_set1_pd(-0.0));
+        }
+        _mm_storeu_pd(acc + i, result);
+    }
+    applyFloatsScalar(op, acc + body, values + body, length - body,
+                      failed + body);
+}
+#endif
+
+void applyInts(int op, long long *acc, const long long *values,
+               size_t length, unsigned char *failed) {
+#ifdef HAVE_X86
+    if (op == COLUMN_SUM || op == COLUMN_SUB || op == COLUMN_NEG) {
+        if (hasAVX2()) {
+            applyIntsAVX2(op, acc, values, length, failed);
+        } else {
+            applyIntsSSE2(op, acc, values, length, failed);
+        }
+        return;
+    }
+    if ((op == COLUMN_MIN || op == COLUMN_MAX) && hasAVX2()) {
+        applyIntsAVX2(op, acc, values, length, failed);
+        return;
+    }
+#endif
+    applyIntsScalar(op, acc, values, length, failed);
+}
+
+void applyFloats(int op, double *acc, const double *values, size_t length,
+                 unsigned char *failed) {
+#ifdef HAVE_X86
+    if (op != COLUMN_MIN && op != COLUMN_MAX) {
+        if (hasAVX2()) {
+            applyFloatsAVX2(op, acc, values, length, failed);
+        } else {
+            applyFloatsSSE2(op, acc, values, length, failed);
+        }
+        return;
+    }
+#endif
+    applyFloatsScalar(op, acc, values, length, failed);
+}
@@ -0,0 +1,368 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+
+// indexes of the rows and columns searched by the lookup functions; every
+// vector (a part of a single row or column) searched for an exact match
+// gets a hash index, one searched for an approximate match gets a sorted
+// index; they are built the first time they are needed and dropped as
+// soon as a cell of the vector changes (see updateColumn()), so a lookup
+// into a table that did not change costs O(1) or O(log n)
+//
+// numbers only match numbers (an INT matches a FLOAT of the same value),
+// TEXT only matches TEXT (ignoring case); empty cells, errors and NaN are
+// never matched, and the cells do not need to be sorted for approximate
+// matches
+//
+// indexes are built by the workers evaluating the lookups, under a lock;
+// they are only dropped by the recalculation itself, which never does so
+// while a cell depending on the vector is being evaluated
+
+// vectors shorter than this are simply scanned
+#define INDEX_THRESHOLD 16
+
+#define NO_OFFSET ((unsigned)-1)
+
+typedef struct {
+    Value key;
+    unsigned hash;
+    unsigned offset; // position in the vector (NO_OFFSET for a free slot)
+} Entry;
+
+typedef struct _LookupIndex {
+    Range vector;
+    bool sorted;
+    Entry *entries; // the hash table, or the entries sorted by key and offset
+    unsigned length; // number of slots, or of entries
+    struct _LookupIndex *next;
+} LookupIndex;
+
+// the indexes of vectors inside a column are listed by the column,
+// those of vectors inside a row (spanning several columns) together
+static LookupIndex **columnIndexes = NULL;
+static LookupIndex *rowIndexes = NULL;
+static pthread_mutex_t lookupLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool isKey(Value value) {
+    return value.type == TYPE_INT ||
+           (value.type == TYPE_FLOAT && !isnan(AS_FLOAT(value))) ||
+           (value.type == TYPE_TEXT && AS_TEXT(value)[0] != '\0');
+}
+
+// FLOAT values holding an integer are compared (and hashed) as integers
+bool isIntegral(Value value, long long *integer) {
+    if (value.type == TYPE_INT) {
+        *integer = AS_INT(value);
+        return TRUE;
+    }
+    double fp = AS_FLOAT(value);
+    if (fp == floor(fp) && fp >= -9223372036854775808.0 &&
+        fp < 9223372036854775808.0) {
+        *integer = fp;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// numbers are ordered before TEXT
+static int compareKeys(Value first, Value second) {
+    bool text1 = first.type == TYPE_TEXT, text2 = second.type == TYPE_TEXT;
+    if (text1 != text2) {
+        return text1 ? 1 : -1;
+    }
+    if (text1) {
+        const unsigned char *a = (const unsigned char *)AS_TEXT(first);
+        const unsigned char *b = (const unsigned char *)AS_TEXT(second);
+        while (*a != '\0' && tolower(*a) == tolower(*b)) {
+            a++;
+            b++;
+        }
+        return tolower(*a) - tolower(*b);
+    }
+    long long a, b;
+    if (isIntegral(first, &a) && isIntegral(second, &b)) {
+        return a < b ? -1 : a > b;
+    }
+    double x = first.type == TYPE_INT ? AS_INT(first) : AS_FLOAT(first);
+    double y = second.type == TYPE_INT ? AS_INT(second) : AS_FLOAT(second);
+    return x < y ? -1 : x > y;
+}
+
+// FNV-1a over the lowercase TEXT or the bytes of the number
+static unsigned hashKey(Value key) {
+    unsigned hash = 2166136261u;
+    if (key.type == TYPE_TEXT) {
+        for (const char *c = AS_TEXT(key); *c != '\0'; c++) {
+            hash = (hash ^ (unsigned char)tolower((unsigned char)*c)) *
+                   16777619u;
+        }
+        return hash;
+    }
+    unsigned char bytes[sizeof(double)];
+    long long integer;
+    if (isIntegral(key, &integer)) {
+        memcpy(bytes, &integer, sizeof(integer));
+    } else {
+        memcpy(bytes, &AS_FLOAT(key), sizeof(double));
+    }
+    for (size_t i = 0; i < sizeof(bytes); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static unsigned vectorLength(Range vector) {
+    return vector.x1 == vector.x2 ? vector.y2 - vector.y1 + 1 :
+                                    vector.x2 - vector.x1 + 1;
+}
+
+// the value of the cell at the given position of the vector
+static Value vectorValue(Range vector, unsigned offset) {
+    Cell *cell = vector.x1 == vector.x2 ?
+                 findCell(vector.x1, vector.y1 + offset) :
+                 findCell(vector.x1 + offset, vector.y1);
+    return cell == NULL ? makeText("", 0, NULL) : cell->value;
+}
+
+static int compareEntries(const void *a, const void *b) {
+    const Entry *first = a, *second = b;
+    int order = compareKeys(first->key, second->key);
+    if (order != 0) {
+        return order;
+    }
+    return first->offset < second->offset ? -1 : first->offset > second->offset;
+}
+
+static LookupIndex *buildIndex(Range vector, bool sorted) {
+    unsigned length = vectorLength(vector);
+    LookupIndex *index = malloc(sizeof(LookupIndex));
+    index->vector = vector;
+    index->sorted = sorted;
+
+    if (sorted) {
+        index->entries = malloc(length * sizeof(Entry));
+        index->length = 0;
+        for (unsigned i = 0; i < length; i++) {
+            Value value = vectorValue(vector, i);
+            if (isKey(value)) {
+                Entry *entry = &index->entries[index->length++];
+                entry->key = value;
+                entry->offset = i;
+            }
+        }
+        qsort(index->entries, index->length, sizeof(Entry), compareEntries);
+        return index;
+    }
+
+    // the first of equal keys is kept
+    index->length = 16;
+    while (index->length < length * 2) {
+        index->length *= 2;
+    }
+    index->entries = malloc(index->length * sizeof(Entry));
+    for (unsigned i = 0; i < index->length; i++) {
+        index->entries[i].offset = NO_OFFSET;
+    }
+    for (unsigned i = 0; i < length; i++) {
+        Value value = vectorValue(vector, i);
+        if (!isKey(value)) {
+            continue;
+        }
+        unsigned hash = hashKey(value);
+        unsigned slot = hash & (index->length - 1);
+        for (; index->entries[slot].offset != NO_OFFSET;
+             slot = (slot + 1) & (index->length - 1)) {
+            if (index->entries[slot].hash == hash &&
+                compareKeys(index->entries[slot].key, value) == 0) {
+                break;
+            }
+        }
+        if (index->entries[slot].offset == NO_OFFSET) {
+            index->entries[slot].key = value;
+            index->entries[slot].hash = hash;
+            index->entries[slot].offset = i;
+        }
+    }
+    return index;
+}
+
+static void freeIndexes(LookupIndex *index) {
+    while (index != NULL) {
+        LookupIndex *next = index->next;
+        free(index->entries);
+        free(index);
+        index = next;
+    }
+}
+
+static bool isSameRange(Range first, Range second) {
+    return first.x1 == second.x1 && first.x2 == second.x2 &&
+           first.y1 == second.y1 && first.y2 == second.y2;
+}
+
+// find the index of the vector, building it if there is none yet
+static const LookupIndex *getIndex(Range vector, bool sorted) {
+    pthread_mutex_lock(&lookupLock);
+    LookupIndex **list;
+    if (vector.x1 == vector.x2) {
+        if (columnIndexes == NULL) {
+            columnIndexes = calloc(MAX_COLS, sizeof(LookupIndex *));
+        }
+        list = &columnIndexes[vector.x1];
+    } else {
+        list = &rowIndexes;
+    }
+    LookupIndex *index;
+    for (index = *list; index != NULL; index = index->next) {
+        if (index->sorted == sorted && isSameRange(index->vector, vector)) {
+            break;
+        }
+    }
+    if (index == NULL) {
+        index = buildIndex(vector, sorted);
+        index->next = *list;
+        *list = index;
+    }
+    pthread_mutex_unlock(&lookupLock);
+    return index;
+}
+
+// the first entry greater than the key (or not smaller if it is not strict)
+static unsigned findBound(const LookupIndex *index, Value key, bool strict) {
+    unsigned low = 0, high = index->length;
+    while (low < high) {
+        unsigned middle = low + (high - low) / 2;
+        int order = compareKeys(index->entries[middle].key, key);
+        if (order < 0 || (order == 0 && strict)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// the first (or last) of the entries equal to the given one
+static long findRun(const LookupIndex *index, unsigned i, bool last) {
+    Value key = index->entries[i].key;
+    i = last ? findBound(index, key, TRUE) - 1 : findBound(index, key, FALSE);
+    return index->entries[i].offset;
+}
+
+static long searchSorted(const LookupIndex *index, Value key, int mode,
+                         bool last) {
+    unsigned low = findBound(index, key, FALSE);
+    bool text = key.type == TYPE_TEXT;
+    if (low < index->length &&
+        compareKeys(index->entries[low].key, key) == 0) {
+        return findRun(index, low, last);
+    }
+    if (mode == MATCH_SMALLER && low > 0 &&
+        (index->entries[low - 1].key.type == TYPE_TEXT) == text) {
+        return findRun(index, low - 1, last);
+    }
+    if (mode == MATCH_LARGER && low < index->length &&
+        (index->entries[low].key.type == TYPE_TEXT) == text) {
+        return findRun(index, low, last);
+    }
+    return -1;
+}
+
+static long searchHash(const LookupIndex *index, Value key) {
+    unsigned hash = hashKey(key);
+    for (unsigned slot = hash & (index->length - 1);
+         index->entries[slot].offset != NO_OFFSET;
+         slot = (slot + 1) & (index->length - 1)) {
+        if (index->entries[slot].hash == hash &&
+            compareKeys(index->entries[slot].key, key) == 0) {
+            return index->entries[slot].offset;
+        }
+    }
+    return -1;
+}
+
+// the same search without an index
+static long scanVector(Range vector, Value key, int mode, bool last) {
+    long found = -1;
+    Value best = key;
+    unsigned length = vectorLength(vector);
+    for (unsigned i = 0; i < length; i++) {
+        Value value = vectorValue(vector, i);
+        if (!isKey(value) ||
+            (value.type == TYPE_TEXT) != (key.type == TYPE_TEXT)) {
+            continue;
+        }
+        int order = compareKeys(value, key);
+        if (order == 0 && mode == MATCH_EXACT) {
+            return i;
+        }
+        if (mode == MATCH_EXACT || (order > 0 && mode == MATCH_SMALLER) ||
+            (order < 0 && mode == MATCH_LARGER)) {
+            continue;
+        }
+        // a key equal to the one found so far is better only if it is the
+        // last one to be found, any key closer to the searched one is
+        int closer = found < 0 ? 1 : compareKeys(value, best) *
+                                     (mode == MATCH_SMALLER ? 1 : -1);
+        if (closer > 0 || (closer == 0 && last)) {
+            found = i;
+            best = value;
+        }
+    }
+    return found;
+}
+
+// find the position of the key in the vector (a part of a single row or
+// column): an equal value, or else the closest smaller (MATCH_SMALLER) or
+// larger (MATCH_LARGER) one; of equal values the first one is found,
+// unless last is set for an approximate match; -1 if there is no match
+long lookupValue(Range vector, Value key, int mode, bool last) {
+    if (!isKey(key)) {
+        return -1;
+    }
+    if (vectorLength(vector) < INDEX_THRESHOLD) {
+        return scanVector(vector, key, mode, last);
+    }
+    if (mode == MATCH_EXACT) {
+        return searchHash(getIndex(vector, FALSE), key);
+    }
+    return searchSorted(getIndex(vector, TRUE), key, mode, last);
+}
+
+static void dropIndexes(LookupIndex **list, unsigned x, unsigned y) {
+    while (*list != NULL) {
+        LookupIndex *index = *list;
+        if (x >= index->vector.x1 && x <= index->vector.x2 &&
+            y >= index->vector.y1 && y <= index->vector.y2) {
+            *list = index->next;
+            free(index->entries);
+            free(index);
+        } else {
+            list = &index->next;
+        }
+    }
+}
+
+// drop the indexes of the vectors holding the cell, its value changed
+void invalidateLookups(unsigned x, unsigned y) {
+    if (columnIndexes != NULL) {
+        dropIndexes(&columnIndexes[x], x, y);
+    }
+    dropIndexes(&rowIndexes, x, y);
+}
+
+void clearLookups(void) {
+    if (columnIndexes != NULL) {
+        for (unsigned x = 0; x < MAX_COLS; x++) {
+            freeIndexes(columnIndexes[x]);
+        }
+        free(columnIndexes);
+        columnIndexes = NULL;
+    }
+    freeIndexes(rowIndexes);
+    rowIndexes = NULL;
+}
@@ -1,327 +1,294 @@
+#define _POSIX_C_SOURCE 200809L
 #include "sheet.h"
+#include <ncurses.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+
+// layout of the screen: the formula and value lines, the column names,
+// then the rows of the grid, each starting with its number, and the status
+// line at the bottom
+#define GRID_TOP 3
+#define ROW_BAR_WIDTH (rowDigits() + 2) // the numbers and two spaces
+#define CELL_WIDTH 9
+
+// the screen is repainted at most this often (in milliseconds) while
+// the sheet is being recalculated or the user is typing
+#define FRAME_TIME 40
 
-Cell cells[SIZE][SIZE]; // this stores all cells' data
 int curX = 0, curY = 0; // cursor coordinates (cell selection)
-char language = LANG_EN;
 
-// this is needed to allow the user to force types for cells
-char types[] = {TYPE_AUTO, TYPE_INT, TYPE_FLOAT, TYPE_TEXT};
+// the viewport: the first column and row shown on the screen and the
+// rectangle of visible cells (in sheet coordinates) waiting to be repainted;
+// cells are drawn straight from the store, nothing is kept per cell, so
+// painting takes time proportional to the size of the screen only
+unsigned originX = 0, originY = 0, viewCols = 1, viewRows = 1;
+bool damaged = FALSE, headersDamaged = TRUE;
+unsigned damageX1, damageY1, damageX2, damageY2;
+
+// the number of digits of the last row of the sheet
+int rowDigits(void) {
+    int digits = 1;
+    for (unsigned long rows = MAX_ROWS; rows >= 10; rows /= 10) {
+        digits++;
+    }
+    return digits;
+}
+
+// heatmap mode (^P): cells are coloured by the time spent evaluating them
+// since the profiler was started, one colour per order of magnitude
+#define HEAT_LEVELS 4
+#define HEAT_BASE 10000 // nanoseconds spent in the coldest cells
+bool heatmap = FALSE;
 
 // language support (English, Polish)
 char *strings[2][NUM_STRINGS] = {
     {
         "Formula", "Value",
         "Save as:", "^Q to cancel", "^Q to quit",
-        "^S or ENTER to save", "Incorrect file name."
+        "^S or ENTER to save", "Incorrect file name.",
+        "Calculating..."
     },
     {
         "Formula", "Wartosc",
         "Zapisz jako:", "^Q by anulowac", "^Q by wyjsc",
-        "^S lub ENTER by zapisac", "Niepoprawna nazwa pliku."
+        "^S lub ENTER by zapisac", "Niepoprawna nazwa pliku.",
+        "Obliczanie..."
     }
 };
-char *errors[2][NUM_ERRORS] = {
-    {
-        "INCORRECT FORMULA!", "TOO MANY ARGUMENTS!", "TOO FEW ARGUMENTS!",
-        "INCORRECT ARGUMENT!", "TOO FEW ARGUMENTS!", "DIVISION BY ZERO!",
-        "OUT OF BOUNDS!", "INFINITE CYCLE!", "NO SUCH FUNCTION!"
-    },
-    {
-        "BLEDNA FORMULA!", "ZA DUZO ARGUMENTOW!", "ZA MALO ARGUMENTOW!",
-        "NIEPOPRAWNY ARGUMENT!", "ZA MALO ARGUMENTOW!", "DZIELENIE PRZEZ ZERO!",
-        "WYJSCIE POZA ZAKRES!", "NIESKONCZONY CYKL!", "NIEISTNIEJACA FUNKCJA!"
+// copy of a cell for display purposes, empty cells are not allocated
+Cell peekCell(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    if (cell != NULL) {
+        return *cell;
     }
-};
-
-void initCell(Cell *cell, WINDOW *pad, unsigned x, unsigned y) {
-    cell->pad = subpad(pad, 1, 9, y, x * 9);
-    memset(cell->formula, '\0', FORMULA_LENGTH);
-    cell->text = malloc(1);
-    cell->text[0] = '\0';
-    cell->textScroll = 0;
-    cell->x = x;
-    cell->y = y;
-    cell->type = TYPE_AUTO;
-    cell->curType = 0;
-    cell->refs = NULL;
+    Cell empty = { 0 };
+    empty.x = x;
+    empty.y = y;
+    empty.formula = "";
+    empty.result = makeText("", 0, NULL);
+    empty.type = TYPE_AUTO;
+    return empty;
 }
 
-// link the "source" and "destination" cells to handle dependencies;
-// this is required so that dependent cells can be updated automatically
-Cell *addCellRef(unsigned srcX, unsigned srcY, unsigned dstX, unsigned dstY) {
-    Cell *src = &(CELL(srcX, srcY));
-    RefNode *cur = src->refs;
-    while (cur != NULL && cur->next != NULL) {
-        if (cur->x == dstX && cur->y == dstY) {
-            return NULL;
-        }
-        cur = cur->next;
-    }
-    RefNode *newRef = malloc(sizeof(RefNode));
-    newRef->x = dstX;
-    newRef->y = dstY;
-    newRef->next = NULL;
-    
-    if (cur == NULL) {
-        src->refs = newRef;
-    } else {
-        cur->next = newRef;
-    }
+// the scroll position needed to show the end of the cell's text
+size_t maxScroll(const Cell *cell) {
+    char buffer[NUMBER_LENGTH];
+    return fmax((double)strlen(cellText(cell, buffer)) - VISIBLE_TEXT_LENGTH,
+                0);
+}
 
-    return src;
+// fit the viewport to the size of the terminal
+void layoutViewport(void) {
+    int cols = (COLS - ROW_BAR_WIDTH) / CELL_WIDTH;
+    int rows = LINES - GRID_TOP - 1;
+    viewCols = cols > 0 ? cols : 1;
+    viewRows = rows > 0 ? rows : 1;
 }
 
-void removeCellRef(unsigned srcX, unsigned srcY, unsigned dstX, unsigned dstY) {
-    Cell *src = &(CELL(srcX, srcY));
-    RefNode *cur = src->refs;
-    if (cur != NULL && cur->x == dstX && cur->y == dstY) {
-        RefNode *next = cur->next;
-        free(cur);
-        src->refs = next;
+// add the cell to the rectangle to be repainted (if it is on the screen)
+void damageCell(unsigned x, unsigned y) {
+    if (x < originX || x >= originX + viewCols ||
+        y < originY || y >= originY + viewRows) {
         return;
     }
-    while (cur != NULL && cur->next != NULL) {
-        RefNode *next = cur->next->next;
-        if (cur->next->x == dstX && cur->next->y == dstY) {
-            free(cur->next);
-            cur->next = next;
-            return;
-        }
-        cur->next = next;
+    if (!damaged) {
+        damageX1 = damageX2 = x;
+        damageY1 = damageY2 = y;
+        damaged = TRUE;
+        return;
     }
+    damageX1 = x < damageX1 ? x : damageX1;
+    damageY1 = y < damageY1 ? y : damageY1;
+    damageX2 = x > damageX2 ? x : damageX2;
+    damageY2 = y > damageY2 ? y : damageY2;
 }
 
-void updateCell(Cell *, char *, bool);
-
-// resolve the destination cell reference, update dependent cells
-void resolveRef(Cell *cell) {
-    RefNode *cur = cell->refs;
-    // iterate over dependent cells and update them
-    while (cur != NULL) {
-        Cell *dst = &(CELL(cur->x, cur->y));
-        Cell *sel = &(CELL(curX, curY));
-        if (cur->x == curX && cur->y == curY) {
-            // cycle - return relevant error code
-            sel->errorCode = ERROR_CYCLE;
-            free(sel->text);
-            ALLOC_SPRINTF(sel->text, "%s", errors[language][ERROR_CYCLE]);
-            strncpy(sel->view, sel->text, 9);
-            mvwprintw(sel->pad, 0, 0, "%-9s", sel->view);
-            sel->type = TYPE_ERROR;
-            mvwaddch(sel->pad, 0, 8, TYPE_ERROR | COLOR_PAIR(4));
-        } else {
-            updateCell(dst, dst->formula, FALSE);
+void damageAll(void) {
+    damaged = TRUE;
+    headersDamaged = TRUE;
+    damageX1 = originX;
+    damageY1 = originY;
+    damageX2 = originX + viewCols - 1;
+    damageY2 = originY + viewRows - 1;
+}
+
+// print the cell's value at its place in the viewport
+void drawCell(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    char buffer[NUMBER_LENGTH];
+    int line = GRID_TOP + y - originY;
+    int column = ROW_BAR_WIDTH + (x - originX) * CELL_WIDTH;
+    int pair = 0;
+    if (x == curX && y == curY) {
+        pair = 3;
+    } else if (heatmap && cell != NULL && cell->stats != NULL) {
+        unsigned long long limit = HEAT_BASE;
+        pair = 5;
+        while (pair < 5 + HEAT_LEVELS - 1 && cell->stats->nanoseconds >= limit) {
+            pair++;
+            limit *= 10;
         }
-        cur = cur->next;
+    }
+    attron(COLOR_PAIR(pair));
+    mvprintw(line, column, "%-9.9s", cell == NULL ? "" : cellText(cell, buffer));
+    attroff(COLOR_PAIR(pair));
+    // draw a green "type" box if the type differs from AUTO
+    if (cell != NULL && cell->type != TYPE_AUTO) {
+        mvaddch(line, column + CELL_WIDTH - 1, cell->type | COLOR_PAIR(4));
     }
 }
 
-// refresh cell value
-void updateCell(Cell *cell, char *formula, bool manual) {
-    char *output;
-    
-    // input formula is parsed here
-    Value value = parse(formula, cell->x, cell->y, manual);
-
-    // if an error was thrown, "freeze" the cell;
-    // input needs to be entered again
-    if (value.type == TYPE_ERROR) {
-        cell->type = TYPE_ERROR;
-        cell->errorCode = GET_ERROR(value);
-    } else {
-        cell->type = types[cell->curType];
+// draw the reference row (numeric indices) and column (alphabetic) bars,
+// the cursor's row and column are highlighted
+void drawHeaders(void) {
+    char name[16];
+    for (unsigned i = 0; i < viewCols; i++) {
+        unsigned x = originX + i;
+        int pair = x == (unsigned)curX ? 3 : x % 2 + 1;
+        // the column name is the cell name without the row number
+        cellName(x, 0, name);
+        name[strcspn(name, "0123456789")] = '\0';
+        int left = (CELL_WIDTH - strlen(name)) / 2;
+        attron(COLOR_PAIR(pair));
+        mvprintw(GRID_TOP - 1, ROW_BAR_WIDTH + i * CELL_WIDTH, "%*s%-*s",
+                 left, "", CELL_WIDTH - left, name);
+        attroff(COLOR_PAIR(pair));
     }
-
-    // return properly formatted data as text
-    if (value.type == TYPE_INT) {
-        ALLOC_SPRINTF(output, "%lld", AS_INT(value));
-    } else if (value.type == TYPE_FLOAT) {
-        ALLOC_SPRINTF(output, "%.3lf", AS_FLOAT(value));
-    } else if (value.type == TYPE_TEXT) {
-        char *text = AS_TEXT(value);
-        ALLOC_SPRINTF(output, "%s", text);
-        free(text);
-    } else if (value.type == TYPE_ERROR) {
-        ALLOC_SPRINTF(output, "%s", errors[language][GET_ERROR(value)]);
+    for (unsigned i = 0; i < viewRows; i++) {
+        unsigned y = originY + i;
+        int pair = y == (unsigned)curY ? 3 : y % 2 + 1;
+        attron(COLOR_PAIR(pair));
+        mvprintw(GRID_TOP + i, 0, "%*u  ", rowDigits(), y + 1);
+        attroff(COLOR_PAIR(pair));
     }
+}
 
-    // populate cell fields based on the received text
-    if (cell->formula != formula) {
-        strcpy(cell->formula, formula);
+// repaint the damaged part of the viewport
+void paintSheet(void) {
+    if (headersDamaged) {
+        drawHeaders();
+        headersDamaged = FALSE;
     }
-    cell->text = realloc(cell->text, strlen(output) + 1);
-    strcpy(cell->text, output);
-    strncpy(cell->view, output, 9);
-    // print the new value on the screen
-    mvwprintw(cell->pad, 0, 0, "%-9s", cell->view);
-    // draw a green "type" box if the type differs from AUTO
-    if (cell->type != TYPE_AUTO) {
-        mvwaddch(cell->pad, 0, 8, cell->type | COLOR_PAIR(4));
+    if (damaged) {
+        for (unsigned y = damageY1; y <= damageY2; y++) {
+            for (unsigned x = damageX1; x <= damageX2; x++) {
+                drawCell(x, y);
+            }
+        }
+        damaged = FALSE;
     }
+}
 
-    free(output);
-
-    cell->textScroll = fmin(fmax(strlen(cell->text) - VISIBLE_TEXT_LENGTH, 0),
-                            cell->textScroll);
-
-    // update dependent cells
-    resolveRef(cell);
+// mark a recalculated cell for repainting (this is called by the thread
+// recalculating the sheet, the sheet is locked meanwhile)
+void cellUpdated(Cell *cell) {
+    damageCell(cell->x, cell->y);
+    cell->textScroll = fmin(maxScroll(cell), cell->textScroll);
 }
 
-// ncurses-related stuff
-void refreshPads(WINDOW *pad, WINDOW *cols, WINDOW *rows,
-                 int scrollX, int scrollY) {
-    prefresh(rows, scrollY, 0, 3, 0, fmin(SIZE + 2, LINES - 1), 7);
-    prefresh(cols, 0, scrollX * 9, 2, 8, 2, 79);
-    prefresh(pad, scrollY, scrollX * 9, 3, 8, fmin(SIZE + 2, LINES - 1), 79);
+// enter a formula into the cell at the cursor, its value and the cells
+// depending on it are then recalculated in the background
+void updateCell(char *formula) {
+    beginEdit();
+    setFormula(&CELL(curX, curY), formula);
+    endEdit(curX, curY);
 }
 
-// cell selection (refresh needed because colors must be updated properly)
-void selectCell(Cell deselect, Cell select,
-                WINDOW *pad, WINDOW *cols, WINDOW *rows,
-                char *formula, unsigned *index) {
-    static int scrollX = 0, scrollY = 0;
+double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1e6;
+}
 
-    // reset formatting on the cell being deselected
-    mvwprintw(deselect.pad, 0, 0, "%-9s", deselect.view);
+// print the formula being entered, scrolled so that its end is visible
+// (where the text cursor is), and move the cursor there
+void drawFormula(const char *formula, unsigned index) {
+    unsigned scroll = index > VISIBLE_TEXT_LENGTH ?
+                      index - VISIBLE_TEXT_LENGTH : 0;
+    mvprintw(0, 0, "%7s: %-71.70s", strings[language][STRING_FORMULA],
+             formula + scroll);
+    if (scroll > 0) {
+        mvaddch(0, 8, '<' | COLOR_PAIR(4));
+    }
+    move(0, 9 + index - scroll);
+}
 
-    // if the deselected cell's type differs from AUTO, draw a green box
-    // denoting the forced type
-    if (deselect.type != TYPE_AUTO) {
-        mvwaddch(deselect.pad, 0, 8, deselect.type | COLOR_PAIR(4));
+// repaint the damaged cells and show whether the sheet is being recalculated
+void refreshScreen(unsigned index) {
+    lockSheet();
+    paintSheet();
+    unlockSheet();
+    move(LINES - 1, 0);
+    clrtoeol();
+    if (recalculating()) {
+        attron(COLOR_PAIR(4));
+        printw("%s", strings[language][STRING_CALCULATING]);
+        attroff(COLOR_PAIR(4));
     }
+    move(0, 9 + fmin(index, VISIBLE_TEXT_LENGTH));
+    refresh();
+}
 
-    // draw the reference row (numeric indices) and column (alphabetic) bars
-    wattron(rows, COLOR_PAIR(deselect.y % 2 + 1));
-    mvwprintw(rows, deselect.y, 0, "   %2d   ", deselect.y + 1);
-    wattroff(rows, COLOR_PAIR(deselect.y % 2 + 1));
-
-    wattron(cols, COLOR_PAIR(deselect.x % 2 + 1));
-    mvwprintw(cols, 0, deselect.x * 9,
-              "    %c    ", ALPHA_BASE + deselect.x);
-    wattroff(cols, COLOR_PAIR(deselect.x % 2 + 1));
-
-    wattron(rows, COLOR_PAIR(3));
-    wattron(cols, COLOR_PAIR(3));
-    mvwprintw(rows, select.y, 0, "   %2d   ", select.y + 1);
-    mvwprintw(cols, 0, select.x * 9,
-              "    %c    ", ALPHA_BASE + select.x);
-    wattroff(rows, COLOR_PAIR(3));
-    wattroff(cols, COLOR_PAIR(3));
-
-    // print the selected cell's value in proper colors
-    wattron(select.pad, COLOR_PAIR(3));
-    mvwprintw(select.pad, 0, 0, "%-9s", select.view);
-    wattroff(select.pad, COLOR_PAIR(3));
-
-    // if the deselected cell's type differs from AUTO, draw a green box
-    // denoting the forced type
-    if (select.type != TYPE_AUTO) {
-        mvwaddch(select.pad, 0, 8, select.type | COLOR_PAIR(4));
+// move the selection from the old position to the cursor, scrolling the
+// viewport if the cursor left it, and repaint what changed
+void selectCell(unsigned oldX, unsigned oldY, char **formula,
+                unsigned *index) {
+    unsigned x = curX, y = curY;
+    unsigned scrollX = originX, scrollY = originY;
+    if (x < originX) {
+        originX = x;
+    } else if (x >= originX + viewCols) {
+        originX = x - viewCols + 1;
+    }
+    if (y < originY) {
+        originY = y;
+    } else if (y >= originY + viewRows) {
+        originY = y - viewRows + 1;
+    }
+    if (originX != scrollX || originY != scrollY) {
+        damageAll();
+    } else {
+        damageCell(oldX, oldY);
+        damageCell(x, y);
+        headersDamaged = headersDamaged || oldX != x || oldY != y;
     }
 
     // copy the local (cell) formula to the global formula
-    strcpy(formula, select.formula);
-    *index = strlen(formula); // text cursor position
+    Cell select = peekCell(x, y);
+    char buffer[NUMBER_LENGTH];
+    const char *text = cellText(&select, buffer);
+    free(*formula);
+    *formula = formulaText(select.formula, x, y);
+    *index = strlen(*formula); // text cursor position
     // print formula and value
-    mvprintw(0, 0, "%7s: %-71s", strings[language][STRING_FORMULA], formula);
+    drawFormula(*formula, *index);
     mvprintw(1, 0, "%7s: %-71.70s",
-             strings[language][STRING_VALUE], select.text + select.textScroll);
-    if (strlen(select.text) > VISIBLE_TEXT_LENGTH) {
+             strings[language][STRING_VALUE], text + select.textScroll);
+    if (strlen(text) > VISIBLE_TEXT_LENGTH) {
         if (select.textScroll > 0) {
             mvaddch(1, 8, '<' | COLOR_PAIR(4));
         }
-        if (select.textScroll < strlen(select.text) - VISIBLE_TEXT_LENGTH) {
+        if (select.textScroll < strlen(text) - VISIBLE_TEXT_LENGTH) {
             mvaddch(1, 79, '>' | COLOR_PAIR(4));
         }
     }
-    // move text cursor to proper position
-    move(0, 9 + strlen(formula));
-
-    // sheet scrolling
-    if (select.x == 0) {
-        scrollX = 0;
-    } else if (select.x == SIZE - 1) {
-        scrollX = 18;
-    } else {
-        int diffX = select.x - scrollX;
-        if (diffX == 6 && select.x != SIZE - 2) {
-            scrollX++;
-        } else if (diffX == 1) {
-            scrollX--;
-        }
-    }
-
-    if (select.y == 0) {
-        scrollY = 0;
-    } else if (select.y == SIZE - 1) {
-        scrollY = fmax(29 - LINES, 0);
-    } else {
-        int diffY = select.y - scrollY;
-        if (diffY == LINES - 7 && select.y != SIZE - 4) {
-            scrollY++;
-        } else if (diffY == 3) {
-            scrollY--;
-        }
-    }
-
-    refreshPads(pad, cols, rows, scrollX, scrollY);
-}
-
-char *getCellText(unsigned x, unsigned y) {
-    char *text = malloc(strlen(CELL(x, y).text) + 1);
-    strcpy(text, CELL(x, y).text);
-    return text;
-}
 
-char getCellType(unsigned x, unsigned y) {
-    return CELL(x, y).type;
-}
-
-int getCellErrorCode(unsigned x, unsigned y) {
-    return CELL(x, y).errorCode;
+    paintSheet();
+    // move text cursor to proper position
+    move(0, 9 + fmin(*index, VISIBLE_TEXT_LENGTH));
 }
 
 void loadFile(char *fileName) {
-    if (fileName != NULL) {
-        FILE *file = fopen(fileName, "rb");
-        if (file != NULL) {
-            char signature[9];
-            char *result = fgets(signature, 9, file);
-            if (result != NULL && strcmp(signature, FILE_SIGNATURE) == 0) {
-                /*curX = */fgetc(file);
-                /*curY = */fgetc(file);
-                while (TRUE) {
-                    curX = fgetc(file);
-                    if (curX == EOF) {
-                        break;
-                    }
-                    curY = fgetc(file);
-                    int type = fgetc(file);
-                    int curType = fgetc(file);
-                    Cell *cell = &(CELL(curX, curY));
-                    cell->type = type;
-                    cell->curType = curType;
-                    fscanf(file, "%zu", &cell->textScroll);
-                    fgetc(file);
-                    size_t length;
-                    fscanf(file, "%zu", &length);
-                    fgetc(file);
-                    fgets(cell->formula, length + 1, file);
-                    updateCell(cell, cell->formula, TRUE);
-                }
-            }
-
-            fclose(file);
-        }
+    if (fileName != NULL && csvSeparator(fileName) != '\0') {
+        importCSV(fileName, csvSeparator(fileName), cellUpdated);
+    } else if (fileName != NULL) {
+        loadSheet(fileName, cellUpdated);
     }
     curX = 0;
     curY = 0;
-    // updateCell(&(CELL(curX, curY)), CELL(curX, curY).formula, TRUE);
 }
 
 bool saveFile(char *defaultName, bool recover, bool quit) {
@@ -419,253 +386,274 @@ bool saveFile(char *defaultName, bool recover, bool quit) {
     }
     strcpy(lastFileName, fileName);
 
-    // saving sheet data to file
-    FILE *file = fopen(fileName, "wb");
-    if (file == NULL) {
-        delwin(saveWin);
-        free(fileName);
-        return FALSE;
-    } else {
-        fprintf(file, FILE_SIGNATURE); // magic number
-        fprintf(file, "%c%c", curX, curY); // selected cell position
-        for (int x = 0; x < SIZE; x++) {
-            for (int y = 0; y < SIZE; y++) {
-                Cell *cell = &(CELL(x, y));
-                if (strlen(cell->formula) > 0 || cell->type != TYPE_AUTO) {
-                    fprintf(file, "%c%c%c%c%zu%c%zu%c",
-                            x, y, cell->type, cell->curType,
-                            cell->textScroll, '\0',
-                            strlen(cell->formula), '\0');
-                    fprintf(file, "%s", cell->formula);
-                }
-            }
-        }
-        fclose(file);
-    }
+    // saving sheet data to file (only the values for CSV and TSV files)
+    bool success = csvSeparator(fileName) != '\0' ?
+                   exportCSV(fileName, csvSeparator(fileName)) :
+                   saveSheet(fileName, curX, curY);
 
     delwin(saveWin);
     free(fileName);
-    return TRUE;
+    return success;
 }
 
+// the error messages change, so every visible cell is repainted
 void toggleLanguage(void) {
     language = (language + 1) % 2;
-    for (int x = 0; x < SIZE; x++) {
-        for (int y = 0; y < SIZE; y++) {
-            Cell *cell = &(CELL(x, y));
-            if (cell->type == TYPE_ERROR) {
-                free(cell->text);
-                ALLOC_SPRINTF(cell->text, "%s",
-                              errors[language][cell->errorCode]);
-                strncpy(cell->view, errors[language][cell->errorCode], 9);
-                mvwprintw(cell->pad, 0, 0, "%-9s", cell->view);
-                mvwaddch(cell->pad, 0, 8, TYPE_ERROR | COLOR_PAIR(4));
-            }
-        }
-    }
+    damageAll();
 }
 
-void init(WINDOW **pad, WINDOW **cols, WINDOW **rows, 
-          char *fileName,
-          char *formula, unsigned *index) {
+void init(char *fileName, char **formula, unsigned *index) {
     initscr();
     keypad(stdscr, TRUE);
     noecho();
     raw();
 
-    *pad = newpad(SIZE, SIZE * 9);
-    *cols = newpad(1, SIZE * 9);
-    *rows = newpad(SIZE, 8);
-
     start_color();
     init_pair(1, COLOR_WHITE, COLOR_RED);
     init_pair(2, COLOR_WHITE, COLOR_BLACK);
     init_pair(3, COLOR_WHITE, COLOR_BLUE);
     init_pair(4, COLOR_BLACK, COLOR_GREEN);
-
-    // draw the reference bars (rows - numeric indices, columns - alphabetical)
-    for (int i = 0; i < SIZE; i++) {
-        wattron(*rows, COLOR_PAIR(i % 2 + 1));
-        wattron(*cols, COLOR_PAIR(i % 2 + 1));
-        mvwprintw(*rows, i, 0, "   %2d   ", i + 1);
-        mvwprintw(*cols, 0, i * 9, "    %c    ", ALPHA_BASE + i);
-        wattroff(*cols, COLOR_PAIR(i % 2 + 1));
-        wattroff(*rows, COLOR_PAIR(i % 2 + 1));
-    }
-    refresh();
-
-    // init cells and select the A1 cell
-    for (int x = 0; x < SIZE; x++) {
-        for (int y = 0; y < SIZE; y++) {
-            initCell(&(CELL(x, y)), *pad, x, y);
-        }
-    }
-
+    // heatmap, from the coldest cells to the hottest
+    init_pair(5, COLOR_BLACK, COLOR_CYAN);
+    init_pair(6, COLOR_BLACK, COLOR_YELLOW);
+    init_pair(7, COLOR_WHITE, COLOR_MAGENTA);
+    init_pair(8, COLOR_WHITE, COLOR_RED);
+    // wait for keys no longer than a frame, to keep repainting meanwhile
+    timeout(FRAME_TIME);
+
+    layoutViewport();
     loadFile(fileName);
-
-    selectCell(CELL(curX, curY), CELL(curX, curY),
-               *pad, *cols, *rows, formula, index);
-
-    refreshPads(*pad, *cols, *rows, 0, 0);
+    startRecalculation(cellUpdated);
+
+    // draw the whole viewport and select the A1 cell
+    lockSheet();
+    damageAll();
+    selectCell(curX, curY, formula, index);
+    unlockSheet();
+    refreshScreen(*index);
 }
 
-void processKeys(WINDOW *pad, WINDOW *cols, WINDOW *rows,
-                 char *fileName, char *formula, unsigned *index) {
+void processKeys(char *fileName, char **formula, unsigned *index) {
     int ch;
+    double lastFrame = 0;
     while ((ch = getch()) != 17) { // 17 is ^Q
         int oldx = curX, oldy = curY;
-        bool selecting = TRUE;
+        // typing only changes the formula being entered, the other keys
+        // read or change the sheet, which has to be locked for that
+        bool selecting = TRUE, locked = FALSE;
         switch (ch) {
             // navigation
             case KEY_UP:
-                curY--;
+                curY = WRAP(curY - 1, MAX_ROWS);
                 break;
             case KEY_RIGHT:
-                curX++;
+                curX = WRAP(curX + 1, MAX_COLS);
                 break;
             case KEY_DOWN:
-                curY++;
+                curY = WRAP(curY + 1, MAX_ROWS);
                 break;
             case KEY_LEFT:
-                curX--;
+                curX = WRAP(curX - 1, MAX_COLS);
+                break;
+            // the terminal was resized, the viewport is laid out again
+            case KEY_RESIZE:
+                lockSheet();
+                locked = TRUE;
+                clear();
+                layoutViewport();
+                damageAll();
                 break;
             // enter key (CR/LF, ASCII 13 and 10, respectively)
             case KEY_ENTER:
             case '\r':
             case '\n':
-                updateCell(&(CELL(curX, curY)), formula, TRUE);
+                updateCell(*formula);
                 break;
             // tab key - toggle the forced type for a cell
             case '\t':
                 {
+                    beginEdit();
                     Cell *cur = &CELL(curX, curY);
                     if (cur->type != TYPE_ERROR) {
-                        cur->curType = (cur->curType + 1) % 4;
+                        cur->curType = (cur->curType + 1) % NUM_TYPES;
                         cur->type = types[cur->curType];
-                        updateCell(cur, cur->formula, TRUE);
+                        char *text = formulaText(cur->formula, curX, curY);
+                        setFormula(cur, text);
+                        free(text);
                     }
+                    endEdit(curX, curY);
                 }
                 break;
             // ^L - language switch
             case 12:
+                lockSheet();
+                locked = TRUE;
                 toggleLanguage();
                 break;
+            // ^P - heatmap (the profiler is started if it was not running)
+            case 16:
+                lockSheet();
+                locked = TRUE;
+                if (!profiling) {
+                    startProfiling();
+                }
+                heatmap = !heatmap;
+                damageAll();
+                break;
             // ^S - save file
             case 19:
             {
+                // the values saved must be up to date
+                waitRecalculation();
+                lockSheet();
+                locked = TRUE;
                 bool success = saveFile(fileName, FALSE, FALSE);
                 while (!success) {
                     success = saveFile(fileName, TRUE, FALSE);
                 }
+                // bring back what the dialog covered
+                touchwin(stdscr);
                 break;
             }
             // home, end, page up and page down - scroll text field
             case KEY_HOME:
-                CELL(curX, curY).textScroll = 0;
+            {
+                lockSheet();
+                locked = TRUE;
+                Cell *cur = findCell(curX, curY);
+                if (cur != NULL) {
+                    cur->textScroll = 0;
+                }
                 break;
+            }
             case KEY_END:
-                CELL(curX, curY).textScroll =
-                    fmax(strlen(CELL(curX, curY).text) -
-                         VISIBLE_TEXT_LENGTH, 0);
+            {
+                lockSheet();
+                locked = TRUE;
+                Cell *cur = findCell(curX, curY);
+                if (cur != NULL) {
+                    cur->textScroll = maxScroll(cur);
+                }
                 break;
+            }
             case KEY_PPAGE:
             {
-                Cell *cur = &(CELL(curX, curY));
-                cur->textScroll =
-                    WRAP(cur->textScroll - 1,
-                         (int)fmax(strlen(cur->text) -
-                                   VISIBLE_TEXT_LENGTH + 1, 0));
+                lockSheet();
+                locked = TRUE;
+                Cell *cur = findCell(curX, curY);
+                if (cur != NULL) {
+                    cur->textScroll = WRAP((int)cur->textScroll - 1,
+                                           (int)maxScroll(cur) + 1);
+                }
                 break;
             }
             case KEY_NPAGE:
             {
-                Cell *cur = &(CELL(curX, curY));
-                cur->textScroll =
-                    WRAP(cur->textScroll + 1,
-                         (int)fmax(strlen(cur->text) -
-                                   VISIBLE_TEXT_LENGTH + 1, 0));
+                lockSheet();
+                locked = TRUE;
+                Cell *cur = findCell(curX, curY);
+                if (cur != NULL) {
+                    cur->textScroll = WRAP((int)cur->textScroll + 1,
+                                           (int)maxScroll(cur) + 1);
+                }
                 break;
             }
             // handle backspace as expected by the user
             case KEY_BACKSPACE:
             {
                 selecting = FALSE;
-                int x, y;
-                getyx(stdscr, y, x);
                 if (*index > 0) {
-                    mvaddch(y, x - 1, ' ');
-                    move(y, x - 1);
-                    formula[--(*index)] = '\0';
+                    (*formula)[--(*index)] = '\0';
+                    drawFormula(*formula, *index);
                 }
                 break;
             }
             // other keys - user input
             default:
                 if (ch >= PRINTABLE_ASCII_START &&
-                    ch <= PRINTABLE_ASCII_END &&
-                    *index < FORMULA_LENGTH) {
-                        formula[(*index)++] = ch;
-                        formula[*index] = '\0';
-                        addch(ch);
+                    ch <= PRINTABLE_ASCII_END) {
+                        *formula = realloc(*formula, *index + 2);
+                        (*formula)[(*index)++] = ch;
+                        (*formula)[*index] = '\0';
+                        drawFormula(*formula, *index);
                 }
                 selecting = FALSE;
                 break;
         }
         if (selecting) {
-            selectCell(CELL(oldx, oldy), CELL(curX, curY), pad, cols, rows,
-                       formula, index);
-        }
-        refresh();
-    }
-}
-
-void cleanUp(WINDOW *pad, WINDOW *cols, WINDOW *rows, char *formula) {
-    // calling updateCell with an empty formula as the argument
-    // causes removal of remaining dependencies from a cell
-    for (int x = 0; x < SIZE; x++) {
-        for (int y = 0; y < SIZE; y++) {
-            updateCell(&(CELL(x, y)), "", TRUE);
+            if (!locked) {
+                lockSheet();
+            }
+            selectCell(oldx, oldy, formula, index);
+            unlockSheet();
         }
-    }
-    // ncurses stuff + free memory used by text in each cell
-    for (int x = 0; x < SIZE; x++) {
-        for (int y = 0; y < SIZE; y++) {
-            delwin(CELL(x, y).pad);
-            free(CELL(x, y).text);
+        double time = now();
+        if (selecting || time - lastFrame >= FRAME_TIME) {
+            refreshScreen(*index);
+            lastFrame = time;
+        } else {
+            refresh();
         }
     }
+}
 
-    // ncurses stuff again
-    delwin(rows);
-    delwin(cols);
-    delwin(pad);
+void cleanUp(void) {
+    stopRecalculation();
+    // free all cells along with their dependencies
+    clearCells();
     endwin();
 }
 
 int main(int argc, char *argv[]) {
-    // the file name to read from / save to
-    char *fileName = NULL;
-    if (argc > 1) {
-        fileName = argv[1];
+    // headless mode, no curses involved
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--eval") == 0) {
+            return runBatch(argc, argv);
+        }
     }
 
-    // the global formula and text cursor position
-    char formula[FORMULA_LENGTH] = { '\0' };
-    unsigned index = 0;
+    // the file name to read from / save to, the number of threads used for
+    // recalculation (--threads N) and the file the evaluation profile is
+    // written to on exit (--profile FILE or SHEET_PROFILE)
+    char *fileName = NULL, *profileName = getenv("SHEET_PROFILE");
+    unsigned threads = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileName = argv[++i];
+        } else {
+            fileName = argv[i];
+        }
+    }
+    startPool(threads);
+    if (profileName != NULL) {
+        startProfiling();
+    }
 
-    // ncurses stuff
-    WINDOW *pad, *cols, *rows;
+    // the global formula (growing as it is typed) and text cursor position
+    char *formula = calloc(1, 1);
+    unsigned index = 0;
 
-    init(&pad, &cols, &rows, fileName, formula, &index);
+    init(fileName, &formula, &index);
 
-    processKeys(pad, cols, rows, fileName, formula, &index);
+    processKeys(fileName, &formula, &index);
+    free(formula);
 
+    // the values saved must be up to date
+    waitRecalculation();
+    lockSheet();
     bool success = saveFile(fileName, FALSE, TRUE);
     while (!success) {
         success = saveFile(fileName, TRUE, TRUE);
     }
+    if (profileName != NULL) {
+        writeProfile(profileName);
+    }
+    unlockSheet();
 
-    cleanUp(pad, cols, rows, formula);
+    cleanUp();
+    stopPool();
 
     return 0;
 }
@@ -6,140 +6,269 @@
 #include <string.h>
 #include <ctype.h>
 
-// these help handle back-references needed to clean up outdated items
-unsigned thisX, thisY;
-RefNode *backRefs[SIZE][SIZE] = {{ NULL }};
-bool manualUpdate = FALSE;
-
-Value computeText(char **);
-Value computeFunction(char **, int);
-Value computeNumber(char **, double, char *);
-Value computeCellAddress(char **, int);
-Value computeRange(Value, int);
-Value getCellValue(unsigned, unsigned);
+// formulas shallower than this are evaluated without allocating the stack
+#define STACK_SIZE 32
+// number of values of a range passed to a function at once
+#define FOLD_CHUNK 64
+
+// binary operators and the functions they call, the lower the precedence,
+// the later they are applied; operators with the same precedence are
+// applied from left to right (except ^, which goes from right to left)
+// and a chain of the same variadic operator, such as 1+2+3, becomes
+// a single call (SUM(1,2,3) here)
+#define LOWEST_PRECEDENCE 1
+static const struct {
+    const char *symbol;
+    const char *function;
+    int precedence;
+} operators[] = {
+    { "<>", "NE", 1 },
+    { "<=", "LTE", 1 },
+    { ">=", "GTE", 1 },
+    { "=", "EQ", 1 },
+    { "<", "LT", 1 },
+    { ">", "GT", 1 },
+    { "+", "SUM", 2 },
+    { "-", "SUB", 2 },
+    { "*", "MUL", 3 },
+    { "/", "DIV", 3 },
+    { "^", "POWER", 4 }
+};
+
+// state of a single evaluation; there is no global state in the parser,
+// so that many cells can be evaluated at the same time
+typedef struct {
+    unsigned x, y; // the cell being evaluated
+    Arena *arena; // where the TEXT produced by functions is allocated
+    size_t reads; // number of cells read (for the profiler)
+} EvalContext;
+
+// state of the formula being compiled
+typedef struct {
+    unsigned x, y; // the cell the formula is compiled for
+    Instr *code;
+    unsigned length, capacity;
+    unsigned depth, maxDepth;
+    int error;
+} Compiler;
+
+bool compileArg(Compiler *, char **, int, unsigned);
+bool compileExpression(Compiler *, char **, int, int, unsigned);
+bool compileOperand(Compiler *, char **, int, unsigned);
+bool compileText(Compiler *, char **);
+bool compileFunction(Compiler *, char **, int);
+bool compileNumber(Compiler *, char **, double, char *);
+bool compileCellAddress(Compiler *, char **, int, unsigned);
+bool isVariadic(int);
+Value computeRange(EvalContext *, Value, int);
+Value getCellValue(EvalContext *, unsigned, unsigned);
 
 bool isOutOfBounds(unsigned x, unsigned y) {
-    return x >= SIZE || y >= SIZE;
+    return x >= MAX_COLS || y >= MAX_ROWS;
 }
 
 void freeString(Value val) {
-    if (val.type == TYPE_TEXT) {
-        free(AS_TEXT(val));
+    if (IS_LONG_TEXT(val)) {
+        free(val.data.text);
     }
 }
 
-// add a back-reference
-void addBackRef(Cell *src) {
-    if (src == NULL) {
-        return;
+// append an instruction, tracking how deep the evaluation stack gets
+void emit(Compiler *compiler, char op, int func, unsigned argc, Value value) {
+    if (compiler->length == compiler->capacity) {
+        compiler->capacity = compiler->capacity == 0 ?
+                             8 : compiler->capacity * 2;
+        compiler->code = realloc(compiler->code,
+                                 compiler->capacity * sizeof(Instr));
     }
-
-    RefNode *cur = backRefs[thisY][thisX];
-    while (cur != NULL && cur->next != NULL) {
-        cur = cur->next;
+    Instr *instr = &compiler->code[compiler->length++];
+    instr->op = op;
+    instr->func = func;
+    instr->argc = argc;
+    instr->value = value;
+
+    if (op == OP_CALL) {
+        compiler->depth -= argc;
     }
-    RefNode *newRef = malloc(sizeof(RefNode));
-    newRef->x = src->x;
-    newRef->y = src->y;
-    newRef->next = NULL;
-
-    if (cur == NULL) {
-        backRefs[thisY][thisX] = newRef;
-    } else {
-        cur->next = newRef;
+    compiler->depth++;
+    if (compiler->depth > compiler->maxDepth) {
+        compiler->maxDepth = compiler->depth;
     }
 }
 
-// clean up back-references, removing dependencies
-// from source cells to destination cells
-void clearBackRefs(void) {
-    RefNode *cur = backRefs[thisY][thisX];
-    if (cur != NULL && cur->next == NULL) {
-        removeCellRef(cur->x, cur->y, thisX, thisY);
-        free(cur);
-        backRefs[thisY][thisX] = NULL;
+// append a call to a function; a call taking only constants is made right
+// away and replaced with its result
+void emitCall(Compiler *compiler, int func, unsigned argc) {
+    Instr *args = compiler->code + compiler->length - argc;
+    bool constant = TRUE;
+    for (unsigned i = 0; i < argc; i++) {
+        if (args[i].op != OP_VALUE || args[i].value.type == TYPE_CRITERION) {
+            constant = FALSE;
+        }
+    }
+    Value value;
+    if (!constant) {
+        value.type = TYPE_AUTO;
+        emit(compiler, OP_CALL, func, argc, value);
         return;
     }
-    while (cur != NULL && cur->next != NULL) {
-        RefNode *next = cur->next;
-        removeCellRef(cur->x, cur->y, thisX, thisY);
-        free(cur);
-        cur = next;
+
+    Value *values = malloc(argc * sizeof(Value));
+    for (unsigned i = 0; i < argc; i++) {
+        values[i] = args[i].value;
     }
-    if (cur != NULL) {
-        removeCellRef(cur->x, cur->y, thisX, thisY);
-        free(cur);
+    Arena arena;
+    initArena(&arena);
+    value = ownValue(callFunction(&arena, func, values, argc));
+    freeArena(&arena);
+    for (unsigned i = 0; i < argc; i++) {
+        freeString(values[i]);
     }
-    backRefs[thisY][thisX] = NULL;
+    free(values);
+
+    compiler->length -= argc;
+    compiler->depth -= argc;
+    emit(compiler, OP_VALUE, -1, 0, value);
 }
 
-// this function handles the actual interpreting, the inCell flag
-// denotes the context - when TRUE, we're dealing with the cell context,
-// which is the deepest recursion-wise
-Value compute(char **input, bool inCell) {
-    Value value;
+// stop compiling, the whole formula then evaluates to the given error
+bool fail(Compiler *compiler, int code) {
+    compiler->error = code;
+    return FALSE;
+}
+
+// an argument has to be followed by a separator or the end of the formula
+bool isArgEnd(char c) {
+    return c == ',' || c == ')' || c == '\0';
+}
 
-    int len = strlen(*input);
+void skipSpaces(char **input) {
+    while ((*input)[0] == ' ') {
+        (*input)++;
+    }
+}
 
-    if (!inCell) {
-        if ((*input)[0] == ',') {
-            (*input)++;
+// find the binary operator at the start of the input (-1 if there is none)
+int findOperator(const char *input) {
+    for (int i = 0; i < (int)(sizeof(operators) / sizeof(operators[0])); i++) {
+        size_t length = strlen(operators[i].symbol);
+        if (strncmp(input, operators[i].symbol, length) == 0) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        len = strcspn(*input, "(),");
+// compile a single argument (or the whole formula if func is negative);
+// func is the index of the enclosing function and arg the position of the
+// argument, needed for ranges
+bool compileArg(Compiler *compiler, char **input, int func, unsigned arg) {
+    return compileExpression(compiler, input, LOWEST_PRECEDENCE, func, arg);
+}
 
-        if (len == 0) {
-            SET_ERROR(value, ERROR_EMPTY);
-            return value;
+// precedence climbing: compile the first operand, then keep applying
+// the operators binding at least as tightly as the given precedence
+// (the right-hand side of each binding more tightly than the operator)
+bool compileExpression(Compiler *compiler, char **input, int precedence,
+                       int func, unsigned arg) {
+    if (!compileOperand(compiler, input, func, arg)) {
+        return FALSE;
+    }
+    while (TRUE) {
+        skipSpaces(input);
+        int op = findOperator(*input);
+        if (op < 0 || operators[op].precedence < precedence) {
+            return TRUE;
         }
+        int i = findFunction(operators[op].function,
+                             strlen(operators[op].function));
+        int next = operators[op].precedence + (operators[op].symbol[0] != '^');
+        unsigned argc = 1;
+        do {
+            (*input) += strlen(operators[op].symbol);
+            if (!compileExpression(compiler, input, next, -1, 0)) {
+                return FALSE;
+            }
+            argc++;
+            skipSpaces(input);
+        } while (isVariadic(i) && findOperator(*input) == op);
+        emitCall(compiler, i, argc);
+    }
+}
 
-        if ((*input)[0] == '"') {
-            return computeText(input);
+// compile an operand of an operator: a value, a cell, a function call,
+// an expression in parentheses or any of these negated (a negative number
+// is a single value, so -2^2 is 4, the same as (-2)^2)
+bool compileOperand(Compiler *compiler, char **input, int func,
+                    unsigned arg) {
+    skipSpaces(input);
+    char c = (*input)[0];
+    if (c == '\0') {
+        return fail(compiler, ERROR_GENERAL);
+    }
+    if (c == ',' || c == ')') {
+        return fail(compiler, ERROR_EMPTY);
+    }
+    if (c == '"') {
+        return compileText(compiler, input);
+    }
+    if ((c == '-' || c == '+') && !isdigit((*input)[1]) &&
+        (*input)[1] != '.') {
+        (*input)++;
+        if (!compileOperand(compiler, input, -1, 0)) {
+            return FALSE;
         }
-
-        if (len < strlen(*input) && len > 1 && (*input)[len] == '(') {
-            return computeFunction(input, len);
+        if (c == '-') {
+            emitCall(compiler, findFunction("NEG", 3), 1);
         }
-
-        if (len > 0 && isupper((*input)[0])) {
-            return computeCellAddress(input, len);
+        return TRUE;
+    }
+    if (c == '(') {
+        (*input)++;
+        if (!compileExpression(compiler, input, LOWEST_PRECEDENCE, -1, 0)) {
+            return FALSE;
         }
+        skipSpaces(input);
+        if ((*input)[0] != ')') {
+            return fail(compiler, ERROR_GENERAL);
+        }
+        (*input)++;
+        return TRUE;
     }
 
-    char *end;
-    double testNum = strtod(*input, &end);
-    if (end - *input == len && len > 0) {
-        return computeNumber(input, testNum, end);
+    int len = 0;
+    while (isalnum((*input)[len])) {
+        len++;
     }
-
-    if (inCell) {
-        value.type = TYPE_TEXT;
-        AS_TEXT(value) = malloc(len + 1);
-        strcpy(AS_TEXT(value), *input);
-        return value;
+    if ((*input)[len] == '(' && len > 1) {
+        return compileFunction(compiler, input, len);
+    }
+    if (isupper(c)) {
+        return compileCellAddress(compiler, input, func, arg);
     }
 
-    SET_ERROR(value, ERROR_GENERAL);
-    return value;
+    char *end;
+    double testNum = strtod(*input, &end);
+    if (end == *input) {
+        return fail(compiler, ERROR_GENERAL);
+    }
+    return compileNumber(compiler, input, testNum, end);
 }
 
 // parse TEXT literals
-Value computeText(char **input) {
-    Value value;
+bool compileText(Compiler *compiler, char **input) {
     int escapes = 0;
     int i;
     for (i = 1; ; i++) {
         if ((*input)[i] == '\0') {
-            SET_ERROR(value, ERROR_BAD_ARG);
-            return value;
+            return fail(compiler, ERROR_BAD_ARG);
         }
         if ((*input)[i] == '\\') {
             if ((*input)[i + 1] == '\\' || (*input)[i + 1] == '"') {
                 escapes++;
                 i++;
             } else {
-                SET_ERROR(value, ERROR_BAD_ARG);
-                return value;
+                return fail(compiler, ERROR_BAD_ARG);
             }
         } else if ((*input)[i] == '"') {
             break;
@@ -147,169 +276,406 @@ Value computeText(char **input) {
     }
     int len = i - escapes - 1;
 
-    value.type = TYPE_TEXT;
-    char *text = AS_TEXT(value) = malloc(len - 1);
+    Value value = allocText(len, NULL);
+    char *text = AS_TEXT(value);
     int j, k;
     for (j = 1, k = 0; j < i; j++) {
-        if (j < i - 1 && (*input)[j] == '\\') {
+        if ((*input)[j] == '\\') {
             j++;
         }
         text[k++] = (*input)[j];
     }
     text[len] = '\0';
+    emit(compiler, OP_VALUE, -1, 0, value);
 
     (*input) += i + 1;
-    return value;
+    return TRUE;
 }
 
-// parse functions in the formula with support for unary and variadic functions;
-// varying number of arguments is simulated here,
-// while the underlying C functions have 2 parameters each
-Value computeFunction(char **input, int len) {
-    Value value, arg1, arg2;
-    for (int i = 0; i < NUM_FUNCS; i++) {
-        if (strncmp(funcNames[i], *input, len) == 0 &&
-            strlen(funcNames[i]) == len) {
-            (*input) += len + 1;
-
-            arg1 = compute(input, FALSE);
-            if (strcmp(funcNames[i], unaryFuncNames[i]) == 0) {
-                if (*input[0] != ')') {
-                    freeString(arg1);
-                    SET_ERROR(value, ERROR_TOO_MANY_ARGS);
-                    return value;
-                }
-                (*input)++;
-                return funcPtrs[i](arg1, arg2);
-            }
+// ranges can only be passed to functions taking any number of arguments
+bool isVariadic(int func) {
+    return functions[func].maxArgs == VARIADIC;
+}
 
-            arg2 = compute(input, FALSE);
-            char type1 = arg1.type;
-            if (arg1.type == TYPE_ERROR) {
-                freeString(arg2);
-                return arg1;
-            }
-            if (arg1.type == TYPE_RANGE) {
-                arg1 = value = computeRange(arg1, i);
-            }
-            if (arg2.type == TYPE_RANGE) {
-                arg2 = computeRange(arg2, i);
-                value = funcPtrs[i](arg1, arg2);
-            }
-            if ((type1 != TYPE_RANGE && arg2.type != TYPE_ERROR) ||
-                GET_ERROR(arg2) != ERROR_EMPTY) {
-                    value = funcPtrs[i](arg1, arg2);
-            } else if (type1 != TYPE_RANGE && arg2.type == TYPE_ERROR &&
-                       GET_ERROR(arg2) == ERROR_EMPTY) {
-                freeString(arg1);
-                freeString(arg2);
-                freeString(value);
-                SET_ERROR(value, ERROR_TOO_FEW_ARGS);
-            }
+// criteria given as constants are compiled once, along with the formula
+void compileCriterionArg(Compiler *compiler) {
+    Instr *instr = &compiler->code[compiler->length - 1];
+    if (instr->op != OP_VALUE) {
+        return;
+    }
+    Criterion *criterion = malloc(sizeof(Criterion));
+    if (!compileCriterion(instr->value, criterion, NULL)) {
+        free(criterion);
+        return;
+    }
+    freeString(instr->value);
+    instr->value.type = TYPE_CRITERION;
+    instr->value.data.criterion = criterion;
+}
 
-            while ((*input)[0] == ',') {
-                (*input)++;
-                Value argN = compute(input, FALSE);
-                if (argN.type == TYPE_RANGE) {
-                    argN = computeRange(argN, i);
-                }
-                value = funcPtrs[i](value, argN);
-            }
-            if (*input[0] != ')') {
-                freeString(value);
-                SET_ERROR(value, ERROR_GENERAL);
-            }
-            (*input)++;
+// compile a call to a function; the arguments are pushed first and the call
+// then takes them all at once (ranges are folded into a single argument
+// beforehand)
+bool compileFunction(Compiler *compiler, char **input, int len) {
+    int i = findFunction(*input, len);
+    if (i < 0) {
+        return fail(compiler, ERROR_NO_SUCH_FUNC);
+    }
+    (*input) += len + 1;
 
-            return value;
+    unsigned argc = 0;
+    bool range = FALSE;
+    while (TRUE) {
+        if (!compileArg(compiler, input, i, argc)) {
+            return FALSE;
+        }
+        if (argc < 32 && (functions[i].criteriaArgs & 1u << argc)) {
+            compileCriterionArg(compiler);
         }
+        argc++;
+        range = compiler->code[compiler->length - 1].op == OP_RANGE;
+        skipSpaces(input);
+        if ((*input)[0] == ')') {
+            break;
+        }
+        if ((*input)[0] != ',') {
+            return fail(compiler, ERROR_GENERAL);
+        }
+        (*input)++;
     }
-    SET_ERROR(value, ERROR_NO_SUCH_FUNC);
-    return value;
+    (*input)++;
+
+    // a single range is a complete call by itself
+    if (argc == 1 && range && isVariadic(i)) {
+        return TRUE;
+    }
+    if (argc > functions[i].maxArgs) {
+        return fail(compiler, ERROR_TOO_MANY_ARGS);
+    }
+    if (argc < functions[i].minArgs) {
+        return fail(compiler, ERROR_TOO_FEW_ARGS);
+    }
+    emitCall(compiler, i, argc);
+    return TRUE;
 }
 
-// compute number (INT or FLOAT)
-Value computeNumber(char **input, double testNum, char *end) {
+// compile number (INT or FLOAT)
+bool compileNumber(Compiler *compiler, char **input,
+                   double testNum, char *end) {
     Value value;
     value.type = TYPE_INT;
     char *tmp;
     AS_INT(value) = strtoll(*input, &tmp, 10);
-    if (tmp[0] == '.') {
+    if (tmp != end) {
         value.type = TYPE_FLOAT;
         AS_FLOAT(value) = testNum;
     }
     *input = end;
-    return value;
+    emit(compiler, OP_VALUE, -1, 0, value);
+    return TRUE;
 }
 
-// compute the address of a single cell or a range of cells
-Value computeCellAddress(char **input, int len) {
+// parse a cell address (such as B7 or XFD1048576) into zero-based coordinates;
+// addresses beyond the sheet are accepted here and rejected by the callers
+bool parseAddress(char **input, unsigned *x, unsigned *y) {
+    unsigned long col = 0, row = 0;
+    char *cur = *input;
+    while (isupper(*cur)) {
+        if (col <= MAX_COLS) {
+            col = col * 26 + (*cur - ALPHA_BASE + 1);
+        }
+        cur++;
+    }
+    if (cur == *input || !isdigit(*cur)) {
+        return FALSE;
+    }
+    while (isdigit(*cur)) {
+        if (row <= MAX_ROWS) {
+            row = row * 10 + (*cur - DIGIT_BASE);
+        }
+        cur++;
+    }
+    *x = fmin(col, MAX_COLS + 1) - 1;
+    *y = row == 0 ? MAX_ROWS : fmin(row, MAX_ROWS + 1) - 1;
+    *input = cur;
+    return TRUE;
+}
+
+// compile the address of a single cell or a range of cells
+bool compileCellAddress(Compiler *compiler, char **input, int func,
+                        unsigned arg) {
     Value value;
-    if (len > 1 && isdigit((*input)[1])) {
-        int x1 = (*input)[0] - ALPHA_BASE;
-        int y1 = (*input)[1] - DIGIT_BASE;
-        (*input) += 2;
-        if (len > 2 && isdigit((*input)[0])) {
-            y1 *= 10;
-            y1 += (*input)[0] - DIGIT_BASE;
-            (*input)++;
+    unsigned x1, y1, x2, y2;
+    if (!parseAddress(input, &x1, &y1)) {
+        return fail(compiler, ERROR_GENERAL);
+    }
+    x2 = x1;
+    y2 = y1;
+    if ((*input)[0] == ':') {
+        (*input)++;
+        if (!parseAddress(input, &x2, &y2)) {
+            return fail(compiler, ERROR_GENERAL);
         }
-        y1--;
-        if (len > 4) {
-            if ((*input)[0] == ':' && isupper((*input)[1])) {
-                int x2 = (*input)[1] - ALPHA_BASE;
-                if (isdigit((*input)[2])) {
-                    int y2 = (*input)[2] - DIGIT_BASE;
-                    (*input) += 3;
-                    if (isdigit((*input)[0])) {
-                        y2 *= 10;
-                        y2 += (*input)[0] - DIGIT_BASE;
-                        (*input)++;
-                    }
-                    y2--;
-                    if (x1 == x2 && y1 == y2) {
-                        return getCellValue(x1, y1);
-                    }
-                    if (isOutOfBounds(x1, y1) || isOutOfBounds(x2, y2)) {
-                        SET_ERROR(value, ERROR_OUT_OF_BOUNDS);
-                    } else {
-                        value.type = TYPE_RANGE;
-                        AS_RANGE(value).x1 = fmin(x1, x2);
-                        AS_RANGE(value).y1 = fmin(y1, y2);
-                        AS_RANGE(value).x2 = fmax(x1, x2);
-                        AS_RANGE(value).y2 = fmax(y1, y2);
-                    }
-                    return value;
-                }
-            }
+    }
+    // ranges have to be whole arguments, cells can be operands
+    char *next = *input;
+    skipSpaces(&next);
+    bool whole = isArgEnd(next[0]);
+    if (!whole && findOperator(next) < 0) {
+        return fail(compiler, ERROR_GENERAL);
+    }
+    if (isOutOfBounds(x1, y1) || isOutOfBounds(x2, y2)) {
+        return fail(compiler, ERROR_OUT_OF_BOUNDS);
+    }
+
+    // stored relative to the cell, so that the code can be shared
+    value.type = TYPE_RANGE;
+    AS_RANGE(value).x1 = (unsigned)fmin(x1, x2) - compiler->x;
+    AS_RANGE(value).y1 = (unsigned)fmin(y1, y2) - compiler->y;
+    AS_RANGE(value).x2 = (unsigned)fmax(x1, x2) - compiler->x;
+    AS_RANGE(value).y2 = (unsigned)fmax(y1, y2) - compiler->y;
+
+    // tables are passed to lookup functions as they are
+    if (whole && func >= 0 && arg < 32 &&
+        (functions[func].rangeArgs & 1u << arg)) {
+        emit(compiler, OP_RANGE, -1, 0, value);
+        return TRUE;
+    }
+    if (x1 == x2 && y1 == y2) {
+        emit(compiler, OP_CELL, -1, 0, value);
+        return TRUE;
+    }
+    // ranges can only be folded by variadic functions
+    if (!whole || func < 0 || !isVariadic(func)) {
+        return fail(compiler, ERROR_BAD_ARG);
+    }
+    emit(compiler, OP_RANGE, func, 0, value);
+    return TRUE;
+}
+
+void freeCode(Instr *code, unsigned length) {
+    for (unsigned i = 0; i < length; i++) {
+        if (code[i].op == OP_VALUE && code[i].value.type == TYPE_CRITERION) {
+            freeCriterion(code[i].value.data.criterion);
+        } else if (code[i].op == OP_VALUE) {
+            freeString(code[i].value);
         }
-        return getCellValue(x1, y1);
     }
-    SET_ERROR(value, ERROR_GENERAL);
-    return value;
+    free(code);
 }
 
-// executing functions on cell ranges (such as A1:C5)
-Value computeRange(Value range, int i) {
+// entry point for the parser module, turns the formula of the cell at x, y
+// into postfix bytecode, which can be run by any cell holding the same
+// formula relative to its position; formulas that fail to compile yield
+// a single error value
+Formula *compile(const char *inputFormula, unsigned x, unsigned y) {
+    unsigned long long start = profiling ? profileClock() : 0;
+    Compiler compiler = { x, y, NULL, 0, 0, 0, 0, -1 };
+    char *formula = (char *)inputFormula;
     Value value;
-    int j = 0;
-    for (int x = AS_RANGE(range).x1;
+
+    if (formula[0] == '=') {
+        formula++;
+        if (compileArg(&compiler, &formula, -1, 0) && formula[0] != '\0') {
+            fail(&compiler, ERROR_GENERAL);
+        }
+    } else {
+        value = makeText(formula, strlen(formula), NULL);
+        emit(&compiler, OP_VALUE, -1, 0, value);
+    }
+
+    if (compiler.error >= 0) {
+        freeCode(compiler.code, compiler.length);
+        compiler.code = NULL;
+        compiler.length = compiler.capacity = 0;
+        compiler.depth = compiler.maxDepth = 0;
+        SET_ERROR(value, compiler.error);
+        emit(&compiler, OP_VALUE, -1, 0, value);
+    }
+
+    Formula *result = malloc(sizeof(Formula));
+    result->code = compiler.code;
+    result->length = compiler.length;
+    result->depth = compiler.maxDepth;
+    if (profiling) {
+        profileParse(start);
+    }
+    return result;
+}
+
+void freeFormula(Formula *formula) {
+    if (formula != NULL) {
+        freeCode(formula->code, formula->length);
+        free(formula);
+    }
+}
+
+// this interprets text stored in a cell of type AUTO
+// as a number (INT or FLOAT) if possible
+bool inferNumber(const char *text, Value *value) {
+    int len = strlen(text);
+    char *end, *tmp;
+    double testNum = strtod(text, &end);
+    if (end - text != len || len == 0) {
+        return FALSE;
+    }
+    value->type = TYPE_INT;
+    AS_INT(*value) = strtoll(text, &tmp, 10);
+    if (tmp != end) {
+        value->type = TYPE_FLOAT;
+        AS_FLOAT(*value) = testNum;
+    }
+    return TRUE;
+}
+
+// convert the result of a formula to the type forced for the cell;
+// TEXT is shared with the result unless it needs to be formatted
+Value castValue(Value result, char type) {
+    Value value = result;
+    if (result.type == TYPE_ERROR || type == TYPE_ERROR) {
+        return value;
+    }
+    if (type == TYPE_AUTO) {
+        if (result.type == TYPE_TEXT) {
+            inferNumber(AS_TEXT(result), &value);
+        }
+    } else if (type == TYPE_INT) {
+        value.type = TYPE_INT;
+        if (result.type == TYPE_FLOAT) {
+            AS_INT(value) = AS_FLOAT(result);
+        } else if (result.type == TYPE_TEXT) {
+            AS_INT(value) = strtoll(AS_TEXT(result), NULL, 10);
+        }
+    } else if (type == TYPE_FLOAT) {
+        value.type = TYPE_FLOAT;
+        if (result.type == TYPE_INT) {
+            AS_FLOAT(value) = AS_INT(result);
+        } else if (result.type == TYPE_TEXT) {
+            AS_FLOAT(value) = strtod(AS_TEXT(result), NULL);
+        }
+    } else if (type == TYPE_TEXT && result.type != TYPE_TEXT) {
+        char buffer[NUMBER_LENGTH];
+        int length;
+        if (result.type == TYPE_INT) {
+            length = sprintf(buffer, "%lld", AS_INT(result));
+        } else {
+            length = sprintf(buffer, "%.3lf", AS_FLOAT(result));
+        }
+        value = makeText(buffer, length, NULL);
+    }
+    return value;
+}
+
+// fold the range with a vectorized kernel if the function has one (SUM,
+// MUL, MIN and MAX) and the range holds only INT or only FLOAT values; otherwise
+// (e.g. when a cell is empty or holds an error) return FALSE and leave it
+// to the sequential fold, which knows how to report it
+bool aggregateRange(EvalContext *context, Value range, int i, Value *result) {
+    int func = functions[i].aggregate;
+    if (func == AGGREGATE_NONE) {
+        return FALSE;
+    }
+
+    // a range containing the cell itself is a cycle
+    if (context->x >= AS_RANGE(range).x1 && context->x <= AS_RANGE(range).x2 &&
+        context->y >= AS_RANGE(range).y1 && context->y <= AS_RANGE(range).y2) {
+        return FALSE;
+    }
+
+    // the values are read from the columnar store, column by column,
+    // in the order of the fold
+    Aggregate aggregate;
+    char type = TYPE_AUTO;
+    for (unsigned x = AS_RANGE(range).x1;
          x <= AS_RANGE(range).x2; x++) {
-        for (int y = AS_RANGE(range).y1;
-             y <= AS_RANGE(range).y2; y++, j++) {
-            if (j == 0) {
-                value = getCellValue(x, y);
-            } else {
-                value = funcPtrs[i](value, getCellValue(x, y));
+        ColumnSpan span;
+        for (unsigned y = AS_RANGE(range).y1;
+             y <= AS_RANGE(range).y2; y += span.length) {
+            if (!numericSpan(x, y, AS_RANGE(range).y2, &span)) {
+                return FALSE;
+            }
+            if (type == TYPE_AUTO) {
+                type = span.type;
+                startAggregate(&aggregate, func, type);
+            } else if (span.type != type) {
+                return FALSE;
+            }
+            if (span.hasNaN &&
+                (func == AGGREGATE_MIN || func == AGGREGATE_MAX)) {
+                return FALSE;
+            }
+            addToAggregate(&aggregate, span.values, span.length);
+        }
+    }
+    if (type == TYPE_AUTO) {
+        return FALSE;
+    }
+    *result = finishAggregate(&aggregate);
+    return TRUE;
+}
+
+// executing functions on cell ranges (such as A1:C5); the values are
+// passed to the function FOLD_CHUNK at a time, each chunk starting with
+// the result of the previous one
+Value foldRange(EvalContext *context, Value range, int i) {
+    Value chunk[FOLD_CHUNK];
+    if (aggregateRange(context, range, i, &chunk[0])) {
+        context->reads += (size_t)(AS_RANGE(range).x2 - AS_RANGE(range).x1 + 1) *
+                          (AS_RANGE(range).y2 - AS_RANGE(range).y1 + 1);
+        return chunk[0];
+    }
+    unsigned length = 0;
+    for (unsigned x = AS_RANGE(range).x1;
+         x <= AS_RANGE(range).x2; x++) {
+        for (unsigned y = AS_RANGE(range).y1;
+             y <= AS_RANGE(range).y2; y++) {
+            chunk[length++] = getCellValue(context, x, y);
+            if (length == FOLD_CHUNK) {
+                chunk[0] = callFunction(context->arena, i, chunk, length);
+                length = 1;
             }
         }
     }
+    return length == 1 ? chunk[0] :
+           callFunction(context->arena, i, chunk, length);
+}
+
+Value computeRange(EvalContext *context, Value range, int i) {
+    if (!profiling) {
+        return foldRange(context, range, i);
+    }
+    unsigned long long start = profileClock();
+    size_t allocations = context->arena->allocations;
+    Value value = foldRange(context, range, i);
+    profileFunction(i, start, context->arena->allocations - allocations);
     return value;
 }
 
-Value getCellValue(unsigned x, unsigned y) {
+Value computeFunction(EvalContext *context, int i, Value *args,
+                      unsigned argc) {
+    if (!profiling) {
+        return callFunction(context->arena, i, args, argc);
+    }
+    unsigned long long start = profileClock();
+    size_t allocations = context->arena->allocations;
+    Value value = callFunction(context->arena, i, args, argc);
+    profileFunction(i, start, context->arena->allocations - allocations);
+    return value;
+}
+
+// a range passed to a function as it is (which then reads the cells)
+Value passRange(EvalContext *context, Value range) {
+    if (context->x >= AS_RANGE(range).x1 && context->x <= AS_RANGE(range).x2 &&
+        context->y >= AS_RANGE(range).y1 && context->y <= AS_RANGE(range).y2) {
+        SET_ERROR(range, ERROR_CYCLE);
+    }
+    return range;
+}
+
+Value getCellValue(EvalContext *context, unsigned x, unsigned y) {
     Value value;
-    if (x == thisX && y == thisY) {
+    context->reads++;
+    if (x == context->x && y == context->y) {
         SET_ERROR(value, ERROR_CYCLE);
         return value;
     }
@@ -317,62 +683,73 @@ Value getCellValue(unsigned x, unsigned y) {
         SET_ERROR(value, ERROR_OUT_OF_BOUNDS);
         return value;
     }
-    // set the dependencies only when the user manually enters data
-    if (manualUpdate) {
-        addBackRef(addCellRef(x, y, thisX, thisY));
-    }
-    char *cellText = getCellText(x, y);
-    char type = getCellType(x, y);
-    if (type == TYPE_AUTO) {
-        char *cellTextBase = cellText;
-        value = compute(&cellText, TRUE);
-        free(cellTextBase);
-    } else {
-        value.type = type;
-
-        if (type == TYPE_TEXT) {
-            AS_TEXT(value) = cellText;
-        } else {
-            if (type == TYPE_INT) {
-                AS_INT(value) = strtoll(cellText, NULL, 10);
-            } else if (type == TYPE_FLOAT) {
-                AS_FLOAT(value) = strtod(cellText, NULL);
-            } else {
-                SET_ERROR(value, getCellErrorCode(x, y));
-            }
-            free(cellText);
-        }
+    // the cell already holds a typed value; its TEXT is only borrowed,
+    // functions never modify or free their arguments
+    Cell *cell = findCell(x, y);
+    if (cell == NULL) {
+        return makeText("", 0, NULL);
     }
+    return cell->value;
+}
 
-    return value;
+// the cells of a range compiled into a formula, as read by the cell at x, y
+// (the offsets wrap around)
+Range placeRange(Range range, unsigned x, unsigned y) {
+    range.x1 += x;
+    range.x2 += x;
+    range.y1 += y;
+    range.y2 += y;
+    return range;
 }
 
-// entry point for the parser module, takes a formula and cell coordinates
-Value parse(const char *inputFormula, unsigned x, unsigned y, bool manual) {
-    thisX = x;
-    thisY = y;
-    char *formula = malloc(strlen(inputFormula) + 1);
-    char *formulaBase = formula;
-    strcpy(formula, inputFormula);
-    if (manual) {
-        clearBackRefs();
-    }
-    manualUpdate = manual;
-    Value value;
-    if (formula[0] == '=') {
-        formula++;
-        value = compute(&formula, FALSE);
-        if (formula[0] != '\0') {
-            freeString(value);
-            SET_ERROR(value, ERROR_GENERAL);
+// run the compiled formula in the context of the given cell; the TEXT
+// produced on the way is taken from the arena, which is reset once
+// the result has been copied out of it
+Value evaluate(const Formula *formula, unsigned x, unsigned y, Arena *arena) {
+    EvalContext context = { x, y, arena, 0 };
+    unsigned long long start = profiling ? profileClock() : 0;
+    size_t allocations = arena->allocations;
+
+    Value buffer[STACK_SIZE];
+    Value *stack = formula->depth > STACK_SIZE ?
+                   malloc(formula->depth * sizeof(Value)) : buffer;
+    unsigned top = 0;
+    Value range;
+    for (unsigned i = 0; i < formula->length; i++) {
+        const Instr *instr = &formula->code[i];
+        switch (instr->op) {
+            case OP_VALUE:
+                stack[top++] = instr->value;
+                break;
+            case OP_CELL:
+                stack[top++] = getCellValue(&context,
+                                            AS_RANGE(instr->value).x1 + x,
+                                            AS_RANGE(instr->value).y1 + y);
+                break;
+            case OP_RANGE:
+                range.type = TYPE_RANGE;
+                AS_RANGE(range) = placeRange(AS_RANGE(instr->value), x, y);
+                stack[top++] = instr->func < 0 ?
+                               passRange(&context, range) :
+                               computeRange(&context, range, instr->func);
+                break;
+            case OP_CALL:
+                top -= instr->argc;
+                stack[top] = computeFunction(&context, instr->func,
+                                             stack + top, instr->argc);
+                top++;
+                break;
         }
-    } else {
-        value.type = TYPE_TEXT;
-        AS_TEXT(value) = malloc(strlen(formula) + 1);
-        strcpy(AS_TEXT(value), formula);
     }
 
-    free(formulaBase);
-
+    Value value = ownValue(stack[0]);
+    if (profiling) {
+        profileCell(findCell(x, y), start, arena->allocations - allocations,
+                    context.reads);
+    }
+    resetArena(arena);
+    if (stack != buffer) {
+        free(stack);
+    }
     return value;
 }
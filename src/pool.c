@@ -0,0 +1,178 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+// a simple work-stealing thread pool: every worker owns a deque of tasks,
+// takes them from the bottom and, once it runs dry, steals from the top
+// of the other workers' deques; the calling thread acts as worker 0
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t top, bottom, capacity;
+} Deque;
+
+static pthread_t *threads = NULL;
+static Deque *deques = NULL;
+static unsigned numWorkers = 1;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static unsigned generation = 0;
+static unsigned busy = 0;
+static bool stopping = FALSE;
+static void (*job)(size_t, unsigned, void *) = NULL;
+static void *jobArg = NULL;
+
+static bool popTask(Deque *deque, size_t *task) {
+    bool found = FALSE;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[--deque->bottom];
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool stealTask(Deque *deque, size_t *task) {
+    bool found = FALSE;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        *task = deque->tasks[deque->top++];
+        found = TRUE;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// run tasks until there are none left in any of the deques
+static void work(unsigned id) {
+    size_t task;
+    while (TRUE) {
+        if (!popTask(&deques[id], &task)) {
+            bool stolen = FALSE;
+            for (unsigned i = 1; i < numWorkers && !stolen; i++) {
+                stolen = stealTask(&deques[(id + i) % numWorkers], &task);
+            }
+            if (!stolen) {
+                return;
+            }
+        }
+        job(task, id, jobArg);
+    }
+}
+
+static void *workerMain(void *arg) {
+    unsigned id = (size_t)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&poolLock);
+    while (TRUE) {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&workReady, &poolLock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen = generation;
+        pthread_mutex_unlock(&poolLock);
+
+        work(id);
+
+        pthread_mutex_lock(&poolLock);
+        if (--busy == 0) {
+            pthread_cond_signal(&workDone);
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+    return NULL;
+}
+
+// start the given number of workers (including the calling thread)
+void startPool(unsigned workers) {
+    stopPool();
+    generation = 0;
+    numWorkers = workers < 1 ? 1 : workers;
+    deques = calloc(numWorkers, sizeof(Deque));
+    threads = calloc(numWorkers, sizeof(pthread_t));
+    for (unsigned i = 0; i < numWorkers; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+    for (unsigned i = 1; i < numWorkers; i++) {
+        pthread_create(&threads[i], NULL, workerMain, (void *)(size_t)i);
+    }
+}
+
+void stopPool(void) {
+    if (deques == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&poolLock);
+    stopping = TRUE;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&poolLock);
+    for (unsigned i = 1; i < numWorkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (unsigned i = 0; i < numWorkers; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tasks);
+    }
+    free(deques);
+    free(threads);
+    deques = NULL;
+    threads = NULL;
+    numWorkers = 1;
+    stopping = FALSE;
+}
+
+unsigned poolSize(void) {
+    return numWorkers;
+}
+
+// run task(i, worker, arg) for every i in [0, count) and wait until all are
+// done; the tasks are dealt out to the workers in contiguous blocks and
+// worker (in [0, poolSize())) tells which of the workers runs the task
+void runParallel(size_t count, void (*task)(size_t, unsigned, void *),
+                 void *arg) {
+    if (deques == NULL || numWorkers == 1) {
+        for (size_t i = 0; i < count; i++) {
+            task(i, 0, arg);
+        }
+        return;
+    }
+
+    for (unsigned i = 0; i < numWorkers; i++) {
+        Deque *deque = &deques[i];
+        size_t first = count * i / numWorkers;
+        size_t last = count * (i + 1) / numWorkers;
+        if (deque->capacity < last - first) {
+            deque->capacity = last - first;
+            deque->tasks = realloc(deque->tasks,
+                                   deque->capacity * sizeof(size_t));
+        }
+        // the owner takes tasks from the bottom, so push them in reverse
+        for (size_t j = 0; j < last - first; j++) {
+            deque->tasks[j] = last - 1 - j;
+        }
+        deque->top = 0;
+        deque->bottom = last - first;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    job = task;
+    jobArg = arg;
+    busy = numWorkers - 1;
+    generation++;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&poolLock);
+
+    work(0);
+
+    pthread_mutex_lock(&poolLock);
+    while (busy > 0) {
+        pthread_cond_wait(&workDone, &poolLock);
+    }
+    pthread_mutex_unlock(&poolLock);
+}
@@ -0,0 +1,156 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sheet.h"
+#include "funcs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// the evaluation profiler: once started, every evaluated cell counts its
+// evaluations, their time, the TEXT it allocated, the cells it read and
+// its depth in the last cascade; every function counts its calls, their
+// (inclusive) time and allocations, and compiling formulas is timed too
+//
+// while it is off, the parser and the engine only test the flag; cells are
+// given their counters by the recalculation (from a single thread), so
+// each of them is updated by the worker evaluating it, while the function
+// counters are shared by the workers and updated atomically
+
+typedef struct {
+    unsigned long long calls, nanoseconds, allocations;
+} FuncStats;
+
+bool profiling = FALSE;
+static FuncStats *funcStats = NULL;
+static FuncStats parseStats;
+
+#define ADD(counter, amount) __atomic_fetch_add(&(counter), (amount), \
+                                                __ATOMIC_RELAXED)
+
+void startProfiling(void) {
+    if (funcStats == NULL) {
+        funcStats = calloc(numFunctions, sizeof(FuncStats));
+    }
+    profiling = TRUE;
+}
+
+unsigned long long profileClock(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+void profileParse(unsigned long long start) {
+    ADD(parseStats.calls, 1);
+    ADD(parseStats.nanoseconds, profileClock() - start);
+}
+
+void profileFunction(int func, unsigned long long start, size_t allocations) {
+    ADD(funcStats[func].calls, 1);
+    ADD(funcStats[func].nanoseconds, profileClock() - start);
+    ADD(funcStats[func].allocations, allocations);
+}
+
+void profileCell(Cell *cell, unsigned long long start, size_t allocations,
+                 size_t reads) {
+    if (cell == NULL || cell->stats == NULL) {
+        return;
+    }
+    cell->stats->evaluations++;
+    cell->stats->nanoseconds += profileClock() - start;
+    cell->stats->allocations += allocations;
+    cell->stats->reads += reads;
+}
+
+// give the cell its counters and start a new cascade
+void resetDepth(Cell *cell) {
+    if (cell->stats == NULL) {
+        cell->stats = calloc(1, sizeof(CellStats));
+    }
+    cell->stats->depth = 0;
+}
+
+// called for the dependents of every recalculated cell (the source), which
+// are one level deeper in the cascade
+void profileDepth(Cell *cell, void *source) {
+    const CellStats *stats = ((Cell *)source)->stats;
+    if (cell->stats != NULL && stats != NULL &&
+        cell->stats->depth < stats->depth + 1) {
+        cell->stats->depth = stats->depth + 1;
+    }
+}
+
+static int compareCells(const void *a, const void *b) {
+    const Cell *first = *(Cell * const *)a;
+    const Cell *second = *(Cell * const *)b;
+    if (first->y != second->y) {
+        return first->y < second->y ? -1 : 1;
+    }
+    return first->x < second->x ? -1 : first->x > second->x;
+}
+
+// write the counters as JSON if the file name ends with .json, as CSV
+// otherwise (one line per cell, function and for parsing); cells go row
+// by row; returns FALSE if the file could not be written
+bool writeProfile(const char *fileName) {
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL) {
+        return FALSE;
+    }
+    size_t length = strlen(fileName);
+    bool json = length >= 5 && strcmp(fileName + length - 5, ".json") == 0;
+
+    size_t count = 0, capacity = 256;
+    Cell **cells = malloc(capacity * sizeof(Cell *));
+    CellIter iter = { 0 };
+    Cell *cell;
+    while ((cell = nextCell(&iter)) != NULL) {
+        if (cell->stats == NULL) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            cells = realloc(cells, capacity * sizeof(Cell *));
+        }
+        cells[count++] = cell;
+    }
+    qsort(cells, count, sizeof(Cell *), compareCells);
+
+    if (json) {
+        fprintf(file, "{\"parse\": {\"count\": %llu, \"total_us\": %.3f},\n"
+                "\"functions\": [", parseStats.calls,
+                parseStats.nanoseconds / 1e3);
+    } else {
+        fprintf(file, "kind,name,count,total_us,allocations,reads,depth\n"
+                "parse,,%llu,%.3f,,,\n", parseStats.calls,
+                parseStats.nanoseconds / 1e3);
+    }
+    for (int i = 0; i < numFunctions; i++) {
+        const FuncStats *stats = &funcStats[i];
+        fprintf(file, json ? "%s\n    {\"function\": \"%s\", \"calls\": %llu, "
+                             "\"total_us\": %.3f, \"allocations\": %llu}" :
+                             "%sfunction,%s,%llu,%.3f,%llu,,\n",
+                json && i > 0 ? "," : "", functions[i].name, stats->calls,
+                stats->nanoseconds / 1e3, stats->allocations);
+    }
+    if (json) {
+        fprintf(file, "\n],\n\"cells\": [");
+    }
+    char name[16];
+    for (size_t i = 0; i < count; i++) {
+        const CellStats *stats = cells[i]->stats;
+        fprintf(file, json ? "%s\n    {\"cell\": \"%s\", \"evaluations\": %llu, "
+                             "\"total_us\": %.3f, \"allocations\": %llu, "
+                             "\"reads\": %llu, \"depth\": %u}" :
+                             "%scell,%s,%llu,%.3f,%llu,%llu,%u\n",
+                json && i > 0 ? "," : "",
+                cellName(cells[i]->x, cells[i]->y, name), stats->evaluations,
+                stats->nanoseconds / 1e3, stats->allocations, stats->reads,
+                stats->depth);
+    }
+    if (json) {
+        fprintf(file, "\n]}\n");
+    }
+    free(cells);
+    return fclose(file) == 0;
+}
@@ -0,0 +1,201 @@
+#include "sheet.h"
+#include "funcs.h"
+#include <stdlib.h>
+#include <string.h>
+
+// runs of cells holding the same formula (relative to their position) one
+// below another, such as a column of =MUL(B1,C1), =MUL(B2,C2) and so on,
+// evaluated a block of rows at a time: every instruction of the shared
+// code works on a whole column of values at once, the cells read come
+// straight from the columnar store (see numericSpan()) and the functions
+// are applied with the column kernels (see applyInts())
+//
+// only formulas made of numbers, cells and functions with a column kernel
+// (SUM, SUB, MUL, DIV, MIN, MAX and NEG) are evaluated this way, and only
+// the blocks in which every cell read holds a number of the same type as
+// the cells next to it; the values are then exactly the same as those of
+// evaluate() (every column has a single type, so INT and FLOAT values are
+// mixed the same way in every row), anything else is left to evaluate()
+
+// rows evaluated at once
+#define BLOCK_ROWS 256
+
+// a value of the evaluation stack, for all the rows of the block
+typedef struct {
+    char type;
+    const void *values; // long long or double, depending on the type
+    void *buffer; // the values computed here (BLOCK_ROWS of them)
+} Column;
+
+bool isColumnFormula(const Formula *formula) {
+    for (unsigned i = 0; i < formula->length; i++) {
+        const Instr *instr = &formula->code[i];
+        if ((instr->op == OP_VALUE && instr->value.type != TYPE_INT &&
+             instr->value.type != TYPE_FLOAT) || instr->op == OP_RANGE ||
+            (instr->op == OP_CALL &&
+             functions[instr->func].column == COLUMN_NONE)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// find the cells read by the rows of the block starting at row y (in
+// column x); the block ends where any of them stops holding numbers of the
+// same type, 0 rows means the first row has to be evaluated by itself
+static unsigned findInputs(const Formula *formula, unsigned x, unsigned y,
+                           unsigned length, ColumnSpan *inputs) {
+    for (unsigned i = 0; i < formula->length; i++) {
+        const Instr *instr = &formula->code[i];
+        if (instr->op != OP_CELL) {
+            continue;
+        }
+        Range range = placeRange(AS_RANGE(instr->value), x, y);
+        if (!numericSpan(range.x1, range.y1, range.y1 + length - 1,
+                         &inputs[i])) {
+            return 0;
+        }
+        if (inputs[i].length < length) {
+            length = inputs[i].length;
+        }
+    }
+    return length;
+}
+
+// the values of the column in the buffer, as FLOAT values
+static double *toFloats(Column *column, unsigned length) {
+    double *fps = column->buffer;
+    if (column->type == TYPE_INT) {
+        const long long *ints = column->values;
+        for (unsigned i = 0; i < length; i++) {
+            fps[i] = ints[i];
+        }
+    } else if (column->values != fps) {
+        memcpy(fps, column->values, length * sizeof(double));
+    }
+    column->type = TYPE_FLOAT;
+    column->values = fps;
+    return fps;
+}
+
+// fold the arguments of a call into the first one, the same way the
+// function would: INT until the first FLOAT argument, FLOAT from then on
+static void applyFunction(int func, Column *args, unsigned argc,
+                          unsigned length, unsigned char *failed,
+                          double *scratch) {
+    int op = functions[func].column;
+    Column *acc = &args[0];
+    if (acc->values != acc->buffer) {
+        memcpy(acc->buffer, acc->values, length * sizeof(long long));
+        acc->values = acc->buffer;
+    }
+    if (op == COLUMN_NEG) {
+        if (acc->type == TYPE_INT) {
+            applyInts(op, acc->buffer, acc->buffer, length, failed);
+        } else {
+            applyFloats(op, acc->buffer, acc->buffer, length, failed);
+        }
+        return;
+    }
+    for (unsigned i = 1; i < argc; i++) {
+        if (acc->type == TYPE_INT && args[i].type == TYPE_INT) {
+            applyInts(op, acc->buffer, args[i].values, length, failed);
+            continue;
+        }
+        if (acc->type == TYPE_INT) {
+            toFloats(acc, length);
+        }
+        const double *values = args[i].values;
+        if (args[i].type == TYPE_INT) {
+            const long long *ints = args[i].values;
+            for (unsigned j = 0; j < length; j++) {
+                scratch[j] = ints[j];
+            }
+            values = scratch;
+        }
+        applyFloats(op, acc->buffer, values, length, failed);
+    }
+}
+
+// evaluate the rows of a block, whose inputs were found already
+static void evaluateBlock(const Formula *formula, Cell **cells,
+                          unsigned length, const ColumnSpan *inputs,
+                          Column *stack, double *scratch) {
+    unsigned char failed[BLOCK_ROWS];
+    memset(failed, 0, length);
+    unsigned top = 0;
+    for (unsigned i = 0; i < formula->length; i++) {
+        const Instr *instr = &formula->code[i];
+        Column *column = &stack[top];
+        switch (instr->op) {
+            case OP_VALUE:
+                column->type = instr->value.type;
+                column->values = column->buffer;
+                for (unsigned j = 0; j < length; j++) {
+                    if (column->type == TYPE_INT) {
+                        ((long long *)column->buffer)[j] = AS_INT(instr->value);
+                    } else {
+                        ((double *)column->buffer)[j] = AS_FLOAT(instr->value);
+                    }
+                }
+                top++;
+                break;
+            case OP_CELL:
+                column->type = inputs[i].type;
+                column->values = inputs[i].values;
+                top++;
+                break;
+            case OP_CALL:
+                top -= instr->argc;
+                applyFunction(instr->func, &stack[top], instr->argc, length,
+                              failed, scratch);
+                top++;
+                break;
+        }
+    }
+
+    for (unsigned j = 0; j < length; j++) {
+        Value value;
+        if (failed[j]) {
+            SET_ERROR(value, ERROR_DIV_0);
+        } else if (stack[0].type == TYPE_INT) {
+            value.type = TYPE_INT;
+            AS_INT(value) = ((const long long *)stack[0].values)[j];
+        } else {
+            value.type = TYPE_FLOAT;
+            AS_FLOAT(value) = ((const double *)stack[0].values)[j];
+        }
+        storeResult(cells[j], value);
+    }
+}
+
+// evaluate a run of cells holding the same formula (see isColumnFormula()),
+// one below another in a column; none of them may read the others
+void evaluateRun(Cell **cells, size_t count, Arena *arena) {
+    const Formula *formula = cells[0]->compiled;
+    ColumnSpan *inputs = malloc(formula->length * sizeof(ColumnSpan));
+    Column *stack = malloc(formula->depth * sizeof(Column));
+    for (unsigned i = 0; i < formula->depth; i++) {
+        stack[i].buffer = malloc(BLOCK_ROWS * sizeof(long long));
+    }
+    double *scratch = malloc(BLOCK_ROWS * sizeof(double));
+
+    size_t length;
+    for (size_t i = 0; i < count; i += length) {
+        length = count - i < BLOCK_ROWS ? count - i : BLOCK_ROWS;
+        length = findInputs(formula, cells[i]->x, cells[i]->y, length, inputs);
+        if (length == 0) {
+            evaluateCell(cells[i], arena);
+            length = 1;
+            continue;
+        }
+        evaluateBlock(formula, cells + i, length, inputs, stack, scratch);
+    }
+
+    for (unsigned i = 0; i < formula->depth; i++) {
+        free(stack[i].buffer);
+    }
+    free(stack);
+    free(inputs);
+    free(scratch);
+}
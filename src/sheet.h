@@ -1,6 +1,19 @@
-#include <ncurses.h>
+#include <stdbool.h>
+#include <stddef.h>
 
-// spreadsheet size (SIZE * SIZE cells)
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+// addressable sheet size (columns A to XFD, rows 1 to 1048576)
+#define MAX_COLS 16384
+#define MAX_ROWS 1048576
+
+// size of the grid rendered by the benchmark (SIZE * SIZE cells, about
+// what fits on a screen)
 #define SIZE 26
 
 // ASCII offsets
@@ -14,26 +27,24 @@
 #define TYPE_TEXT 'T'
 #define TYPE_ERROR 'E'
 #define TYPE_RANGE 'R'
+#define TYPE_CRITERION 'C' // only passed to the conditional aggregates
+// number of types the user can force for a cell (see types[])
+#define NUM_TYPES 4
 
 #define WRAP(num, max) (((num % max) + max) % max)
-// cell access helper macro
-#define CELL(x, y) cells[WRAP(y, SIZE)][WRAP(x, SIZE)]
-// allocate exactly as many bytes as needed and store the value
-#define ALLOC_SPRINTF(ptr, format, val) \
-        ptr = malloc(snprintf(NULL, 0, format, val) + 1); \
-        sprintf(ptr, format, val);
-
+// cell access helper macro (allocates the cell if it is not populated yet)
+#define CELL(x, y) (*touchCell(x, y))
 // macros operating on the Value structure, different views of underlying data
-#define AS_INT(value) value.data.integer
-#define AS_FLOAT(value) value.data.fp
-#define AS_TEXT(value) value.data.text
-#define AS_RANGE(value) value.data.range
+#define AS_INT(value) (value).data.integer
+#define AS_FLOAT(value) (value).data.fp
+#define AS_TEXT(value) ((value).small ? (value).data.chars : (value).data.text)
+#define AS_RANGE(value) (value).data.range
 
 // error code support, utilizes the integer field
 #define SET_ERROR(value, code) value.type = TYPE_ERROR;\
                                value.data.integer = code;
 #define GET_ERROR(value) AS_INT(value)
-#define NUM_ERRORS 9
+#define NUM_ERRORS 10
 #define ERROR_GENERAL 0
 #define ERROR_TOO_MANY_ARGS 1
 #define ERROR_TOO_FEW_ARGS 2
@@ -43,12 +54,13 @@
 #define ERROR_OUT_OF_BOUNDS 6
 #define ERROR_CYCLE 7
 #define ERROR_NO_SUCH_FUNC 8
+#define ERROR_NOT_FOUND 9
 
 #define PRINTABLE_ASCII_START 32
 #define PRINTABLE_ASCII_END 126
 
-// no formula can be longer than this (though values can have indefinite length)
-#define FORMULA_LENGTH 70
+// buffer size big enough for any number formatted for display
+#define NUMBER_LENGTH 320
 
 // maximum range of text (cell value) visible without scrolling
 #define VISIBLE_TEXT_LENGTH 70
@@ -56,11 +68,12 @@
 // ditto, only for the file save dialog
 #define VISIBLE_FILE_NAME_LENGTH 42
 
-// magic number
+// magic numbers (the old format can still be read, only the new one is written)
 #define FILE_SIGNATURE "WSSHEET\x01"
+#define FILE_SIGNATURE_V2 "WSSHEET\x02"
 
 // language support (English, Polish)
-#define NUM_STRINGS 7
+#define NUM_STRINGS 8
 #define STRING_FORMULA 0
 #define STRING_VALUE 1
 #define STRING_SAVE_PROMPT 2
@@ -68,49 +81,238 @@
 #define STRING_SAVE_QUIT 4
 #define STRING_SAVE_CONFIRM 5
 #define STRING_BAD_FILE_NAME 6
+#define STRING_CALCULATING 7
 #define LANG_EN 0
 #define LANG_PL 1
 
+// TEXT this short is stored in the Value itself (in place of the pointer)
+#define SMALL_TEXT_LENGTH 15
+// TEXT stored outside the Value (freed by whoever owns it, if anyone)
+#define IS_LONG_TEXT(value) ((value).type == TYPE_TEXT && !(value).small)
+
+// a rectangle of cells (a single cell when x1 == x2 and y1 == y2)
+typedef struct {
+    unsigned x1, x2, y1, y2;
+} Range;
+
+typedef struct _Criterion Criterion;
+
 // the Value type - stores values of type INT, FLOAT, TEXT, ERROR and RANGE
+// (and the criteria compiled into formulas)
 typedef struct {
     char type;
+    bool small; // the TEXT is stored in chars rather than pointed to by text
     union {
         char *text;
+        char chars[SMALL_TEXT_LENGTH + 1];
         long long integer;
         double fp;
-        struct {
-            char x1, x2, y1, y2;
-        } range;
+        Range range;
+        Criterion *criterion;
     } data;
 } Value;
 
-// this is used for the list of references to destination cells
-// (so that they can be updated when one or more dependencies change)
-typedef struct _RefNode {
+// a condition of the conditional aggregates, such as ">=10" or "a*";
+// an empty TEXT operand stands for an empty cell
+#define CRITERION_EQ 0
+#define CRITERION_NE 1
+#define CRITERION_LT 2
+#define CRITERION_LE 3
+#define CRITERION_GT 4
+#define CRITERION_GE 5
+struct _Criterion {
+    char op;
+    bool wildcard; // the TEXT operand holds * or ?
+    Value operand; // INT, FLOAT or TEXT
+};
+
+// a bump allocator for the TEXT produced while formulas are evaluated
+typedef struct _ArenaBlock ArenaBlock;
+typedef struct {
+    ArenaBlock *first, *current;
+    size_t used;
+    size_t allocations; // number of allocations so far (for the profiler)
+} Arena;
+
+// opcodes of the compiled formulas (postfix bytecode)
+#define OP_VALUE 0 // push a constant
+#define OP_CELL 1 // push the value of a cell
+#define OP_RANGE 2 // push a range of cells folded with a function (or the
+                   // range itself if there is no function)
+#define OP_CALL 3 // call a function on the arguments on top of the stack
+
+// a single instruction; cells and ranges are stored as RANGE values,
+// relative to the cell running the formula (see placeRange())
+typedef struct {
+    char op;
+    int func;
+    unsigned argc;
+    Value value;
+} Instr;
+
+// a formula compiled once, when it is entered, and run on every update
+// (by all the cells holding the same formula relative to their position)
+typedef struct {
+    Instr *code;
+    unsigned length;
+    unsigned depth; // maximum depth of the evaluation stack
+} Formula;
+
+typedef struct {
     unsigned x, y;
-    struct _RefNode *next;
-} RefNode;
+} Position;
+
+// growable array of the cells reading a cell (so that they can be updated
+// when it changes); cells reading it as part of a range are not listed here
+typedef struct {
+    Position *cells;
+    unsigned length, capacity;
+} RefList;
+
+// counters of the evaluation profiler (kept only while it runs)
+typedef struct {
+    unsigned long long evaluations, nanoseconds, allocations, reads;
+    unsigned depth; // the level of the cell in the last cascade
+} CellStats;
 
 // this stores all data associated with a cell
 typedef struct {
-    int x, y;
-    char formula[FORMULA_LENGTH];
-    char *text;
+    unsigned x, y;
+    const char *formula; // interned in the relative form (see formulaText())
+    const Formula *compiled; // shared the same way (NULL until needed)
+    Value result; // what the formula evaluated to (this gets displayed)
+    Value value; // what other cells read (the result with the type forced)
     size_t textScroll;
-    char view[10];
     char type;
     char curType;
-    char errorCode;
-    RefNode *refs;
-    WINDOW *pad;
+    bool dirty; // waiting to be recalculated
+    unsigned pending; // number of dirty cells this one still waits for
+    RefList refs; // cells that depend on this one (not through ranges)
+    Range *precedents; // cells and ranges this one depends on
+    unsigned numPrecedents;
+    CellStats *stats;
 } Cell;
 
-// this parses the formula
-Value parse(const char *, unsigned, unsigned, bool);
-// these operate on references to "destination" cells
-Cell *addCellRef(unsigned, unsigned, unsigned, unsigned);
-void removeCellRef(unsigned, unsigned, unsigned, unsigned);
-// these serve as an interface between "main" and "parser"
-char *getCellText(unsigned, unsigned);
-char getCellType(unsigned, unsigned);
-int getCellErrorCode(unsigned, unsigned);
+// position of an iteration over the populated cells
+typedef struct {
+    size_t block;
+    unsigned slot;
+} CellIter;
+
+// a run of rows of a column holding numbers of the same type
+typedef struct {
+    char type;
+    unsigned length;
+    const void *values; // long long or double, depending on the type
+    bool hasNaN; // some FLOAT value near the run might be NaN
+} ColumnSpan;
+
+// these operate on the sparse cell store
+Cell *findCell(unsigned, unsigned);
+Cell *touchCell(unsigned, unsigned);
+void releaseCell(unsigned, unsigned);
+Cell *nextCell(CellIter *);
+void clearCells(void);
+void setCellResult(Cell *, Value);
+void setCellValues(Cell *, Value, Value);
+// these operate on the columnar copy of the values
+void updateColumn(const Cell *);
+void clearColumn(unsigned, unsigned);
+void clearColumns(void);
+bool numericSpan(unsigned, unsigned, unsigned, ColumnSpan *);
+
+// these allocate TEXT in an arena (or on the heap if the arena is NULL)
+void initArena(Arena *);
+void resetArena(Arena *);
+void freeArena(Arena *);
+char *arenaAlloc(Arena *, size_t);
+Value allocText(size_t, Arena *);
+Value makeText(const char *, size_t, Arena *);
+Value ownValue(Value);
+// these compile formulas and evaluate them
+Formula *compile(const char *, unsigned, unsigned);
+void freeFormula(Formula *);
+Value evaluate(const Formula *, unsigned, unsigned, Arena *);
+Range placeRange(Range, unsigned, unsigned);
+Value castValue(Value, char);
+bool inferNumber(const char *, Value *);
+// these share the formulas (and their compiled forms) among the cells
+const char *internFormula(const char *, size_t, unsigned, unsigned);
+void releaseFormula(const char *);
+const Formula *compiledFormula(const char *, unsigned, unsigned);
+char *formulaText(const char *, unsigned, unsigned);
+// these maintain the dependencies between cells
+void linkRange(Range, unsigned, unsigned);
+void linkRefs(const Formula *, unsigned, unsigned);
+void unlinkRefs(unsigned, unsigned);
+void forEachDependent(const Cell *, void (*)(Cell *, void *), void *);
+void clearRanges(void);
+// these search rows and columns for the lookup functions
+#define MATCH_EXACT 0
+#define MATCH_SMALLER -1 // an equal value or else the closest smaller one
+#define MATCH_LARGER 1 // an equal value or else the closest larger one
+long lookupValue(Range, Value, int, bool);
+void invalidateLookups(unsigned, unsigned);
+void clearLookups(void);
+bool isIntegral(Value, long long *);
+// these evaluate the conditional aggregates (SUMIF and the like)
+#define CONDITIONAL_COUNT 0
+#define CONDITIONAL_SUM 1
+#define CONDITIONAL_AVERAGE 2
+bool compileCriterion(Value, Criterion *, Arena *);
+void freeCriterion(Criterion *);
+bool matchCriterion(const Criterion *, Value);
+Value conditionalAggregate(int, const Range *, const Range *,
+                           const Criterion **, unsigned);
+// these keep the values of cells up to date
+extern char types[NUM_TYPES];
+void setFormula(Cell *, const char *);
+void storeResult(Cell *, Value);
+void evaluateCell(Cell *, Arena *);
+void recalculate(Cell *, void (*)(Cell *));
+void recalculateAll(void (*)(Cell *));
+// these evaluate runs of cells sharing a formula a column at a time
+bool isColumnFormula(const Formula *);
+void evaluateRun(Cell **, size_t, Arena *);
+// these load many formulas at once, recalculating only at the end
+void beginLoad(void);
+void loadFormula(Cell *, const char *);
+void commitLoad(void (*)(Cell *));
+// these recalculate the sheet in the background (for the user interface)
+void startRecalculation(void (*)(Cell *));
+void stopRecalculation(void);
+void lockSheet(void);
+void unlockSheet(void);
+void beginEdit(void);
+void endEdit(unsigned, unsigned);
+bool recalculating(void);
+void waitRecalculation(void);
+// these profile the evaluation
+extern bool profiling;
+void startProfiling(void);
+unsigned long long profileClock(void);
+void profileParse(unsigned long long);
+void profileFunction(int, unsigned long long, size_t);
+void profileCell(Cell *, unsigned long long, size_t, size_t);
+void resetDepth(Cell *);
+void profileDepth(Cell *, void *);
+bool writeProfile(const char *);
+// these format values and read / write files
+extern char language;
+extern char *errors[2][NUM_ERRORS];
+const char *formatValue(const Value *, char *);
+const char *cellText(const Cell *, char *);
+char *cellName(unsigned, unsigned, char *);
+bool loadSheet(const char *, void (*)(Cell *));
+bool saveSheet(const char *, unsigned, unsigned);
+// these import and export the values as CSV (or TSV)
+char csvSeparator(const char *);
+bool importCSV(const char *, char, void (*)(Cell *));
+bool exportCSV(const char *, char);
+// headless mode (sheet --eval)
+int runBatch(int, char *[]);
+// these manage the threads used for recalculation
+void startPool(unsigned);
+void stopPool(void);
+unsigned poolSize(void);
+void runParallel(size_t, void (*)(size_t, unsigned, void *), void *);
@@ -0,0 +1,228 @@
+#include "sheet.h"
+#include <stdlib.h>
+#include <string.h>
+
+// cells are grouped into tiles of BLOCK_COLS * BLOCK_ROWS, the tiles are
+// allocated only when at least one of their cells is populated and they are
+// kept in an open-addressing hash table keyed by the tile coordinates
+#define BLOCK_COLS 8
+#define BLOCK_ROWS 32
+#define BLOCK_CELLS (BLOCK_COLS * BLOCK_ROWS)
+#define MIN_TABLE_SIZE 64
+
+typedef struct {
+    unsigned bx, by;
+    unsigned count;
+    Cell *cells[BLOCK_CELLS];
+} Block;
+
+static Block **table = NULL;
+static size_t tableSize = 0;
+static size_t numBlocks = 0;
+
+static size_t hashBlock(unsigned bx, unsigned by) {
+    size_t hash = bx * 0x9E3779B1u ^ by * 0x85EBCA77u;
+    return (hash ^ (hash >> 15)) & (tableSize - 1);
+}
+
+// returns the slot holding the block or the empty slot where it belongs
+static size_t findSlot(unsigned bx, unsigned by) {
+    size_t i = hashBlock(bx, by);
+    while (table[i] != NULL &&
+           (table[i]->bx != bx || table[i]->by != by)) {
+        i = (i + 1) & (tableSize - 1);
+    }
+    return i;
+}
+
+static void growTable(void) {
+    Block **old = table;
+    size_t oldSize = tableSize;
+    tableSize = oldSize == 0 ? MIN_TABLE_SIZE : oldSize * 2;
+    table = calloc(tableSize, sizeof(Block *));
+    for (size_t i = 0; i < oldSize; i++) {
+        if (old[i] != NULL) {
+            table[findSlot(old[i]->bx, old[i]->by)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// removal with backward shifting, so that no tombstones are needed
+static void removeSlot(size_t i) {
+    size_t mask = tableSize - 1;
+    size_t j = i;
+    table[i] = NULL;
+    while (TRUE) {
+        j = (j + 1) & mask;
+        if (table[j] == NULL) {
+            break;
+        }
+        size_t home = hashBlock(table[j]->bx, table[j]->by);
+        // move the entry back if its home slot is not within (i, j]
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && home <= i && home > j)) {
+            table[i] = table[j];
+            table[j] = NULL;
+            i = j;
+        }
+    }
+    numBlocks--;
+}
+
+static Block *findBlock(unsigned x, unsigned y) {
+    if (tableSize == 0) {
+        return NULL;
+    }
+    return table[findSlot(x / BLOCK_COLS, y / BLOCK_ROWS)];
+}
+
+static unsigned blockIndex(unsigned x, unsigned y) {
+    return (y % BLOCK_ROWS) * BLOCK_COLS + x % BLOCK_COLS;
+}
+
+// get the cell at the given address or NULL if it is not populated
+Cell *findCell(unsigned x, unsigned y) {
+    if (x >= MAX_COLS || y >= MAX_ROWS) {
+        return NULL;
+    }
+    Block *block = findBlock(x, y);
+    return block == NULL ? NULL : block->cells[blockIndex(x, y)];
+}
+
+// get the cell at the given address, allocating it (and its tile) if needed
+Cell *touchCell(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    if (cell != NULL || x >= MAX_COLS || y >= MAX_ROWS) {
+        return cell;
+    }
+
+    if ((numBlocks + 1) * 10 > tableSize * 7) {
+        growTable();
+    }
+    size_t slot = findSlot(x / BLOCK_COLS, y / BLOCK_ROWS);
+    Block *block = table[slot];
+    if (block == NULL) {
+        block = table[slot] = calloc(1, sizeof(Block));
+        block->bx = x / BLOCK_COLS;
+        block->by = y / BLOCK_ROWS;
+        numBlocks++;
+    }
+
+    cell = block->cells[blockIndex(x, y)] = malloc(sizeof(Cell));
+    cell->formula = internFormula("", 0, x, y);
+    cell->compiled = NULL;
+    cell->result = makeText("", 0, NULL);
+    cell->value = cell->result;
+    cell->textScroll = 0;
+    cell->x = x;
+    cell->y = y;
+    cell->type = TYPE_AUTO;
+    cell->curType = 0;
+    cell->dirty = FALSE;
+    cell->pending = 0;
+    cell->refs.cells = NULL;
+    cell->refs.length = cell->refs.capacity = 0;
+    cell->precedents = NULL;
+    cell->numPrecedents = 0;
+    cell->stats = NULL;
+    block->count++;
+
+    return cell;
+}
+
+// the value shares its text with the result unless it had to be converted
+// (short text is stored in the values themselves)
+static void freeValues(Cell *cell) {
+    if (IS_LONG_TEXT(cell->value) &&
+        (!IS_LONG_TEXT(cell->result) ||
+         cell->value.data.text != cell->result.data.text)) {
+        free(cell->value.data.text);
+    }
+    if (IS_LONG_TEXT(cell->result)) {
+        free(cell->result.data.text);
+    }
+}
+
+static void freeCell(Cell *cell) {
+    free(cell->refs.cells);
+    free(cell->precedents);
+    free(cell->stats);
+    releaseFormula(cell->formula);
+    freeValues(cell);
+    free(cell);
+}
+
+// store the result of the cell's formula (the cell takes ownership of it)
+// along with the value read by the cells that depend on it; the columnar
+// copy of the value is updated separately (see updateColumn())
+void setCellResult(Cell *cell, Value result) {
+    setCellValues(cell, result, castValue(result, cell->type));
+}
+
+// the same, with the value already cast to the cell's type (e.g. by another
+// thread, see castValue())
+void setCellValues(Cell *cell, Value result, Value value) {
+    freeValues(cell);
+    cell->result = result;
+    cell->value = value;
+}
+
+// free the cell if it holds no data and nothing depends on it
+void releaseCell(unsigned x, unsigned y) {
+    Cell *cell = findCell(x, y);
+    if (cell == NULL || cell->formula[0] != '\0' ||
+        cell->type != TYPE_AUTO || cell->refs.length > 0 ||
+        cell->numPrecedents > 0) {
+        return;
+    }
+
+    size_t slot = findSlot(x / BLOCK_COLS, y / BLOCK_ROWS);
+    Block *block = table[slot];
+    block->cells[blockIndex(x, y)] = NULL;
+    clearColumn(x, y);
+    freeCell(cell);
+    if (--block->count == 0) {
+        removeSlot(slot);
+        free(block);
+    }
+}
+
+// iterate over all populated cells (in no particular order);
+// the iterator must be zero-initialized before the first call
+Cell *nextCell(CellIter *iter) {
+    for (; iter->block < tableSize; iter->block++, iter->slot = 0) {
+        Block *block = table[iter->block];
+        if (block == NULL) {
+            continue;
+        }
+        while (iter->slot < BLOCK_CELLS) {
+            Cell *cell = block->cells[iter->slot++];
+            if (cell != NULL) {
+                return cell;
+            }
+        }
+    }
+    return NULL;
+}
+
+// free all cells along with the store itself
+void clearCells(void) {
+    for (size_t i = 0; i < tableSize; i++) {
+        if (table[i] != NULL) {
+            for (unsigned j = 0; j < BLOCK_CELLS; j++) {
+                if (table[i]->cells[j] != NULL) {
+                    freeCell(table[i]->cells[j]);
+                }
+            }
+            free(table[i]);
+        }
+    }
+    free(table);
+    clearColumns();
+    clearRanges();
+    clearLookups();
+    table = NULL;
+    tableSize = 0;
+    numBlocks = 0;
+}
@@ -0,0 +1,597 @@
+#include "sheet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// engine regression tests (make test): every test builds a sheet in
+// memory, checks the values computed for it and clears it; the failed
+// checks are reported and the exit status tells whether there were any
+
+// length of the chain recalculated in the background
+#define CHAIN_LENGTH 20000
+// rows of the columns evaluated as runs (see evaluateRun())
+#define RUN_LENGTH 64
+// records of the file imported in many chunks (see importCSV())
+#define CSV_RECORDS 100000
+
+static int failures = 0;
+
+static void check(bool passed, const char *test, const char *what) {
+    if (!passed) {
+        printf("FAIL %s: %s\n", test, what);
+        failures++;
+    }
+}
+
+// whether the cell at x, y holds the given INT
+static bool holdsInt(unsigned x, unsigned y, long long number) {
+    Cell *cell = findCell(x, y);
+    return cell != NULL && cell->result.type == TYPE_INT &&
+           AS_INT(cell->result) == number;
+}
+
+// whether other cells read the given FLOAT from the cell at x, y
+static bool holdsFloat(unsigned x, unsigned y, double number) {
+    Cell *cell = findCell(x, y);
+    return cell != NULL && cell->value.type == TYPE_FLOAT &&
+           AS_FLOAT(cell->value) == number;
+}
+
+// whether the cell at x, y holds the given error
+static bool holdsError(unsigned x, unsigned y, int code) {
+    Cell *cell = findCell(x, y);
+    return cell != NULL && cell->result.type == TYPE_ERROR &&
+           GET_ERROR(cell->result) == code;
+}
+
+// whether the cell at x, y displays the given text
+static bool shows(unsigned x, unsigned y, const char *text) {
+    char buffer[NUMBER_LENGTH];
+    Cell *cell = findCell(x, y);
+    return cell != NULL && strcmp(cellText(cell, buffer), text) == 0;
+}
+
+// the cells recalculated by the last edit, in order
+static Cell *updates[16];
+static unsigned numUpdates;
+
+static void updated(Cell *cell) {
+    if (numUpdates < sizeof(updates) / sizeof(updates[0])) {
+        updates[numUpdates] = cell;
+    }
+    numUpdates++;
+}
+
+// when the cell at x, y was recalculated by the last edit (-1 if it was not)
+static int updatedAt(unsigned x, unsigned y) {
+    for (unsigned i = 0; i < numUpdates; i++) {
+        if (updates[i]->x == x && updates[i]->y == y) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// edit the sheet the way the user interface does
+static void edit(unsigned x, unsigned y, const char *formula) {
+    Cell *cell = touchCell(x, y);
+    setFormula(cell, formula);
+    numUpdates = 0;
+    recalculate(cell, updated);
+}
+
+// edit the sheet in the background, the way the user interface does
+static void editInBackground(unsigned x, unsigned y, const char *formula) {
+    beginEdit();
+    setFormula(touchCell(x, y), formula);
+    endEdit(x, y);
+}
+
+// every dependent is recalculated exactly once, after all of its precedents
+static void testOrder(void) {
+    const char *test = "order";
+    edit(0, 0, "1");
+    edit(1, 0, "=SUM(A1,1)");
+    edit(2, 0, "=SUM(A1,B1)");
+    edit(3, 0, "=SUM(B1,C1,A1)");
+    edit(0, 0, "5");
+
+    check(numUpdates == 4, test, "the number of cells recalculated");
+    check(updatedAt(0, 0) == 0, test, "the edited cell first");
+    check(updatedAt(1, 0) > 0 && updatedAt(2, 0) > updatedAt(1, 0) &&
+          updatedAt(3, 0) > updatedAt(2, 0), test, "the dependents in order");
+    check(holdsInt(1, 0, 6) && holdsInt(2, 0, 11) && holdsInt(3, 0, 22),
+          test, "the values");
+    clearCells();
+}
+
+// the cells of a cycle and the ones depending on them get the cycle error,
+// and are computed again once it is broken
+static void testCycle(void) {
+    const char *test = "cycle";
+    edit(0, 0, "=SUM(B1,1)");
+    edit(2, 0, "=SUM(A1,1)");
+    edit(1, 0, "=SUM(A1,1)");
+
+    check(holdsError(0, 0, ERROR_CYCLE) && holdsError(1, 0, ERROR_CYCLE),
+          test, "the cells of the cycle");
+    check(holdsError(2, 0, ERROR_CYCLE), test, "a dependent of the cycle");
+    edit(1, 0, "5");
+    check(holdsInt(0, 0, 6) && holdsInt(2, 0, 7), test, "the cycle broken");
+    edit(0, 0, "=SUM(A1,1)");
+    check(holdsError(0, 0, ERROR_CYCLE), test, "a cell reading itself");
+    clearCells();
+}
+
+// the bytes of a file (size of them), NULL if it cannot be read
+static unsigned char *readFile(const char *fileName, size_t *size) {
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    size_t capacity = 0;
+    *size = 0;
+    do {
+        capacity = capacity == 0 ? 4096 : capacity * 2;
+        data = realloc(data, capacity);
+        *size += fread(data + *size, 1, capacity - *size, file);
+    } while (*size == capacity);
+    fclose(file);
+    return data;
+}
+
+static void writeFile(const char *fileName, const void *data, size_t size) {
+    FILE *file = fopen(fileName, "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+}
+
+// the cells of the sheet used to test the files, and what they show
+static const char *savedFormulas[] = {
+    "12", "2.5", "some text", "=SUM(A1,B1)", "=CONCAT(C1,\"!\")", "=DIV(A1,0)"
+};
+static const char *savedValues[] = {
+    "12", "2.5", "some text", "14.500", "some text!", "DIVISION BY ZERO!"
+};
+#define NUM_SAVED (sizeof(savedFormulas) / sizeof(savedFormulas[0]))
+
+// the values are stored along with the formulas, and the dependencies are
+// linked again once loaded
+static void testSaveLoad(void) {
+    const char *test = "save and load", *fileName = "test.sht";
+    for (unsigned x = 0; x < NUM_SAVED; x++) {
+        edit(x, 0, savedFormulas[x]);
+    }
+    check(saveSheet(fileName, 0, 0), test, "save");
+    clearCells();
+    check(loadSheet(fileName, NULL), test, "load");
+    for (unsigned x = 0; x < NUM_SAVED; x++) {
+        check(shows(x, 0, savedValues[x]), test, savedValues[x]);
+    }
+    edit(0, 0, "20");
+    check(shows(3, 0, "22.500"), test, "a dependent of a loaded cell");
+    clearCells();
+    remove(fileName);
+}
+
+// files in the old format are read and recalculated
+static void testLoadV1(void) {
+    const char *test = "load v1", *fileName = "test.sht";
+    FILE *file = fopen(fileName, "wb");
+    fwrite(FILE_SIGNATURE, 1, strlen(FILE_SIGNATURE), file);
+    fputc(0, file);
+    fputc(0, file);
+    for (unsigned x = 0; x < NUM_SAVED; x++) {
+        fprintf(file, "%c%c%c%c0%c%u%c%s", x, 0, TYPE_AUTO, 0, 0,
+                (unsigned)strlen(savedFormulas[x]), 0, savedFormulas[x]);
+    }
+    fclose(file);
+    check(loadSheet(fileName, NULL), test, "load");
+    for (unsigned x = 0; x < NUM_SAVED; x++) {
+        check(shows(x, 0, savedValues[x]), test, savedValues[x]);
+    }
+    clearCells();
+    remove(fileName);
+}
+
+// v2 files with anything pointing outside of them or types no cell can
+// hold are not loaded at all
+static void testCorruptFiles(void) {
+    const char *test = "corrupt files", *fileName = "test.sht";
+    for (unsigned x = 0; x < NUM_SAVED; x++) {
+        edit(x, 0, savedFormulas[x]);
+    }
+    saveSheet(fileName, 0, 0);
+    clearCells();
+    size_t size;
+    unsigned char *data = readFile(fileName, &size);
+
+    writeFile(fileName, data, size - 1);
+    check(!loadSheet(fileName, NULL), test, "a truncated file");
+    clearCells();
+    writeFile(fileName, data, 20);
+    check(!loadSheet(fileName, NULL), test, "a truncated header");
+    clearCells();
+    // the forced type of the first record (see saveCell())
+    data[28 + 21] = 200;
+    writeFile(fileName, data, size);
+    check(!loadSheet(fileName, NULL), test, "a forced type out of range");
+    clearCells();
+    data[28 + 21] = 0;
+    // where the formula of the first record starts
+    data[28 + 8 + 3] = 0x7f;
+    writeFile(fileName, data, size);
+    check(!loadSheet(fileName, NULL), test, "a formula out of the file");
+    clearCells();
+    free(data);
+    remove(fileName);
+}
+
+// the background recalculation lets the user interface edit the sheet
+// between slices of cells; an edit may then free an empty cell the
+// recalculation still has to evaluate
+static void testEditDuringRecalculation(void) {
+    const char *test = "edit during recalculation";
+    char formula[32];
+    beginLoad();
+    loadFormula(touchCell(1, 0), "7");
+    loadFormula(touchCell(0, 0), "=SUM(B1,1)");
+    for (unsigned y = 1; y < CHAIN_LENGTH; y++) {
+        sprintf(formula, "=SUM(A%u,1)", y);
+        loadFormula(touchCell(0, y), formula);
+    }
+    commitLoad(NULL);
+    startRecalculation(NULL);
+
+    // emptying B1 recalculates the chain, A1 no longer reading it frees it
+    editInBackground(1, 0, "");
+    bool started = FALSE;
+    while (!started) {
+        lockSheet();
+        started = !shows(0, 0, "8");
+        unlockSheet();
+    }
+    editInBackground(0, 0, "5");
+    waitRecalculation();
+    stopRecalculation();
+
+    sprintf(formula, "%u", 5 + CHAIN_LENGTH - 1);
+    check(shows(0, CHAIN_LENGTH - 1, formula), test, "the end of the chain");
+    check(findCell(1, 0) == NULL, test, "the empty cell was freed");
+    clearCells();
+}
+
+// INT divisions fail for a zero divisor and for the one quotient that does
+// not fit in a long long, LLONG_MIN / -1 (which traps if attempted)
+static void testDivision(void) {
+    const char *test = "division";
+    edit(0, 0, "-9223372036854775808");
+    edit(1, 0, "=DIV(A1,-1)");
+    edit(2, 0, "=DIV(12,-1,2)");
+    edit(3, 0, "=DIV(12,0)");
+    edit(4, 0, "=DIV(SUM(A1,1),-1)");
+
+    check(holdsError(1, 0, ERROR_DIV_0), test, "LLONG_MIN / -1");
+    check(holdsInt(2, 0, -6), test, "12 / -1 / 2");
+    check(holdsError(3, 0, ERROR_DIV_0), test, "12 / 0");
+    check(holdsInt(4, 0, 9223372036854775807LL), test, "(LLONG_MIN + 1) / -1");
+    clearCells();
+}
+
+// the columns of the same formula are evaluated a block of rows at a time,
+// which has to give exactly the values the cells give one by one
+static void checkRuns(const char *test, unsigned x1, unsigned x2) {
+    char buffer[NUMBER_LENGTH], text[NUMBER_LENGTH];
+    Arena arena;
+    initArena(&arena);
+    for (unsigned x = x1; x <= x2; x++) {
+        for (unsigned y = 0; y < RUN_LENGTH; y++) {
+            Cell *cell = findCell(x, y);
+            strcpy(text, cellText(cell, buffer));
+            evaluateCell(cell, &arena);
+            check(strcmp(cellText(cell, buffer), text) == 0, test, text);
+        }
+    }
+    freeArena(&arena);
+}
+
+// the same divisions, evaluated a column at a time
+static void testDivisionRuns(void) {
+    const char *test = "division runs";
+    static const char *numbers[] = { "-9223372036854775808", "6", "0" };
+    char formula[32];
+    beginLoad();
+    for (unsigned y = 0; y < RUN_LENGTH; y++) {
+        loadFormula(touchCell(0, y), numbers[y % 3]);
+        sprintf(formula, "=DIV(A%u,-1)", y + 1);
+        loadFormula(touchCell(1, y), formula);
+        sprintf(formula, "=A%u/-1/2", y + 1);
+        loadFormula(touchCell(2, y), formula);
+        sprintf(formula, "=DIV(12,A%u)", y + 1);
+        loadFormula(touchCell(3, y), formula);
+    }
+    commitLoad(NULL);
+
+    check(holdsError(1, 0, ERROR_DIV_0), test, "LLONG_MIN / -1");
+    check(shows(1, 1, "-6"), test, "6 / -1");
+    check(shows(2, 1, "-3"), test, "6 / -1 / 2");
+    check(holdsError(3, 2, ERROR_DIV_0), test, "12 / 0");
+    checkRuns(test, 1, 3);
+    clearCells();
+}
+
+// a vector long enough to be searched through an index (see lookup.c)
+#define TABLE_ROWS 20
+
+// the lookups match the keys of an unsorted table exactly or approximately,
+// and the index of the table is rebuilt once one of its cells changes
+static void testLookups(void) {
+    const char *test = "lookups";
+    char text[32];
+    for (unsigned y = 0; y < TABLE_ROWS; y++) {
+        unsigned key = (y * 7 % TABLE_ROWS + 1) * 10;
+        sprintf(text, "%u", key);
+        edit(0, y, text);
+        sprintf(text, "n%u", key);
+        edit(1, y, text);
+    }
+    edit(3, 0, "a");
+    edit(4, 0, "B");
+    edit(5, 0, "c");
+    edit(3, 1, "1");
+    edit(4, 1, "2");
+    edit(5, 1, "3");
+
+    edit(2, 0, "=VLOOKUP(70,A1:B20,2,0)");
+    edit(2, 1, "=VLOOKUP(75,A1:B20,2)");
+    edit(2, 2, "=VLOOKUP(75,A1:B20,2,0)");
+    edit(2, 3, "=VLOOKUP(5,A1:B20,2)");
+    edit(2, 4, "=HLOOKUP(\"b\",D1:F2,2,0)");
+    edit(2, 5, "=MATCH(70,A1:A20,0)");
+    edit(2, 6, "=MATCH(75,A1:A20)");
+    edit(2, 7, "=MATCH(75,A1:A20,-1)");
+    edit(2, 8, "=XLOOKUP(75,A1:A20,B1:B20,\"none\")");
+    edit(2, 9, "=XLOOKUP(75,A1:A20,B1:B20,\"none\",-1)");
+    edit(2, 10, "=XLOOKUP(75,A1:A20,B1:B20,\"none\",1)");
+    edit(2, 11, "=XLOOKUP(200,A1:A20,B1:B20)");
+
+    check(shows(2, 0, "n70"), test, "VLOOKUP exact");
+    check(shows(2, 1, "n70"), test, "VLOOKUP approximate");
+    check(holdsError(2, 2, ERROR_NOT_FOUND), test, "VLOOKUP not found");
+    check(holdsError(2, 3, ERROR_NOT_FOUND), test, "VLOOKUP below all keys");
+    check(holdsInt(2, 4, 2), test, "HLOOKUP ignoring case");
+    // the keys are permuted: 60 is in row 16, 70 in row 19 and 80 in row 2
+    check(holdsInt(2, 5, 19) && holdsInt(2, 6, 19), test, "MATCH");
+    check(holdsInt(2, 7, 2), test, "MATCH the next larger");
+    check(shows(2, 8, "none"), test, "XLOOKUP not found");
+    check(shows(2, 9, "n70") && shows(2, 10, "n80"), test, "XLOOKUP modes");
+    check(shows(2, 11, "n200"), test, "XLOOKUP the last key");
+
+    // the row of 70 now holds 700
+    edit(0, 18, "700");
+    check(holdsError(2, 0, ERROR_NOT_FOUND), test, "a changed key");
+    check(shows(2, 1, "n60"), test, "a changed key, approximately");
+    check(holdsInt(2, 6, 16), test, "MATCH after a change");
+    edit(2, 2, "=VLOOKUP(700,A1:B20,2,0)");
+    check(shows(2, 2, "n70"), test, "the new key");
+    clearCells();
+}
+
+// the criteria match TEXT ignoring case and with wildcards, numbers of either
+// type, and empty cells only through "=" and "<>"
+static void testCriteria(void) {
+    const char *test = "criteria";
+    static const char *cells[] = {
+        "apple", "Apricot", "banana", "", "12", "3.5", "apple pie", "7"
+    };
+    static const struct {
+        const char *formula, *value;
+    } checks[] = {
+        { "=COUNTIF(A1:A8,\"a*\")", "3" },
+        { "=COUNTIF(A1:A8,\"?pple\")", "1" },
+        { "=COUNTIF(A1:A8,\"*AN*\")", "1" },
+        { "=SUMIF(A1:A8,\"a*\",B1:B8)", "10" },
+        { "=COUNTIF(A1:A8,\"=\")", "1" },
+        { "=COUNTIF(A1:A8,\"<>\")", "7" },
+        { "=COUNTIF(A1:A8,\"<>apple\")", "7" },
+        { "=SUMIF(A1:A8,\">5\")", "19" },
+        { "=SUMIF(A1:A8,\">3\")", "22.500" },
+        { "=SUMIF(A1:A8,\">=3.5\",B1:B8)", "19" },
+        { "=COUNTIF(B1:B8,4)", "1" },
+        { "=COUNTIF(B1:B8,\"<>4\")", "7" },
+        { "=AVERAGEIF(B1:B8,\">4\")", "6.500" },
+        { "=COUNTIFS(A1:A8,\">0\",B1:B8,\"<8\")", "2" },
+        { "=SUMIFS(B1:B8,A1:A8,\"a*\",B1:B8,\"<>7\")", "3" }
+    };
+    char text[8];
+    for (unsigned y = 0; y < 8; y++) {
+        edit(0, y, cells[y]);
+        sprintf(text, "%u", y + 1);
+        edit(1, y, text);
+    }
+    for (unsigned i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        edit(3, i, checks[i].formula);
+        check(shows(3, i, checks[i].value), test, checks[i].formula);
+    }
+    clearCells();
+}
+
+// the operators follow the usual precedence, a minus sign belongs to the
+// number after it, and whatever depends on no cell is computed once
+static void testOperators(void) {
+    const char *test = "operators";
+    static const struct {
+        const char *formula, *value;
+    } checks[] = {
+        { "=1+2*3", "7" },
+        { "=(1+2)*3", "9" },
+        { "=2-3-4", "-5" },
+        { "=100/10/5", "2" },
+        { "=2^3^2", "512" },
+        { "=-2^2", "4" },
+        { "=-(2^2)", "-4" },
+        { "=10-2^2*3", "-2" },
+        { "=1+2>2", "1" },
+        { "=2*3=6", "1" },
+        { "=1<>1", "0" },
+        { "=A1*2+1", "11" },
+        { "=SUM(A1,1)*2", "12" },
+        { "=1.5*2", "3.000" }
+    };
+    edit(0, 0, "5");
+    for (unsigned i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        edit(1, i, checks[i].formula);
+        check(shows(1, i, checks[i].value), test, checks[i].formula);
+    }
+
+    edit(2, 0, "=2*60*60");
+    check(shows(2, 0, "7200") && findCell(2, 0)->compiled->length == 1,
+          test, "a constant expression");
+    edit(2, 1, "=A1+2*3");
+    check(shows(2, 1, "11") && findCell(2, 1)->compiled->length == 3,
+          test, "a constant part of an expression");
+    clearCells();
+}
+
+// the cells of a formula filled down a column share its text (in the
+// relative form) and compiled form, which an edit of one of them leaves to
+// the others
+static void testSharedFormulas(void) {
+    const char *test = "shared formulas";
+    char text[16];
+    for (unsigned y = 0; y < 5; y++) {
+        sprintf(text, "%u", y + 1);
+        edit(0, y, text);
+        sprintf(text, "=SUM(A%u,10)", y + 1);
+        edit(1, y, text);
+    }
+    bool shared = TRUE;
+    for (unsigned y = 0; y < 5; y++) {
+        Cell *cell = findCell(1, y);
+        shared = shared && cell->formula == findCell(1, 0)->formula &&
+                 cell->compiled == findCell(1, 0)->compiled;
+    }
+    check(shared, test, "a formula filled down");
+    char *formula = formulaText(findCell(1, 3)->formula, 1, 3);
+    check(strcmp(formula, "=SUM(A4,10)") == 0, test, "the text of a cell");
+    free(formula);
+
+    edit(1, 2, "=MAX(A1:A5)");
+    check(shows(1, 2, "5") && shows(1, 1, "12") && shows(1, 3, "14"),
+          test, "one of the cells edited");
+    check(findCell(1, 2)->formula != findCell(1, 0)->formula,
+          test, "the edited cell no longer shares the formula");
+    edit(0, 0, "11");
+    edit(0, 3, "0");
+    check(shows(1, 0, "21") && shows(1, 3, "10") && shows(1, 2, "11"),
+          test, "the cells recalculated");
+    clearCells();
+}
+
+// the values exported to a CSV or TSV file are imported back as they were,
+// quotes, commas and all, and numbers in full rather than as displayed
+static void testRoundTrip(const char *fileName) {
+    static const char *formulas[] = {
+        "=\"say \\\"hi\\\", ok\"", "5\" pipe", "=\"\\\"quoted\\\" first\"",
+        "=CONCAT(\"a,b\",\"\\\"\")", "=COUNTIF(B1:B3,\">1\")", "\"\""
+    };
+    static const char *values[] = {
+        "say \"hi\", ok", "5\" pipe", "\"quoted\" first", "a,b\"", "2", "\"\""
+    };
+    static const char *numberFormulas[] = { "=0.00001*3", "=1/3.0" };
+    static const double numbers[] = { 0.00001 * 3, 1 / 3.0 };
+    unsigned count = sizeof(formulas) / sizeof(formulas[0]);
+    unsigned numberCount = sizeof(numbers) / sizeof(numbers[0]);
+    char separator = csvSeparator(fileName);
+    beginLoad();
+    for (unsigned y = 0; y < count; y++) {
+        loadFormula(touchCell(0, y), formulas[y]);
+        loadFormula(touchCell(1, y), y == 0 ? "1" : "2");
+    }
+    for (unsigned y = 0; y < numberCount; y++) {
+        loadFormula(touchCell(2, y), numberFormulas[y]);
+    }
+    commitLoad(NULL);
+    for (unsigned y = 0; y < count; y++) {
+        check(shows(0, y, values[y]), fileName, formulas[y]);
+    }
+    for (unsigned y = 0; y < numberCount; y++) {
+        check(holdsFloat(2, y, numbers[y]), fileName, numberFormulas[y]);
+    }
+
+    check(exportCSV(fileName, separator), fileName, "export");
+    clearCells();
+    check(importCSV(fileName, separator, NULL), fileName, "import");
+    for (unsigned y = 0; y < count; y++) {
+        check(shows(0, y, values[y]), fileName, values[y]);
+    }
+    for (unsigned y = 0; y < numberCount; y++) {
+        check(holdsFloat(2, y, numbers[y]), fileName, "a number in full");
+    }
+    clearCells();
+    remove(fileName);
+}
+
+// records are cut into chunks following the quotes of the fields starting
+// with one; quotes anywhere else are just characters
+static void testQuotes(void) {
+    const char *test = "quotes", *fileName = "test.csv";
+    FILE *file = fopen(fileName, "w");
+    for (unsigned y = 0; y < CSV_RECORDS; y++) {
+        if (y % 7 == 0) {
+            fprintf(file, "\"line\nbreak \"\"%u\"\"\",%u\n", y, y);
+        } else {
+            fprintf(file, "x\"y%u,%u\n", y, y);
+        }
+    }
+    fclose(file);
+    check(importCSV(fileName, ',', NULL), test, "import");
+    check(shows(0, 0, "line\nbreak \"0\""), test, "a quoted field");
+    check(shows(0, 1, "x\"y1"), test, "a quote in a field");
+    char text[32];
+    for (unsigned y = 0; y < CSV_RECORDS; y += 997) {
+        sprintf(text, "%u", y);
+        check(shows(1, y, text), test, text);
+    }
+    sprintf(text, "x\"y%u", CSV_RECORDS - 1);
+    check(shows(0, CSV_RECORDS - 1, text), test, "the last record");
+    check(findCell(0, CSV_RECORDS) == NULL, test, "the number of records");
+    clearCells();
+    remove(fileName);
+
+    // TSV has no quoting at all
+    fileName = "test.tsv";
+    file = fopen(fileName, "w");
+    fprintf(file, "\"a\"\"b\"\t\"c\nd\t\"\n");
+    fclose(file);
+    check(importCSV(fileName, '\t', NULL), test, "import");
+    check(shows(0, 0, "\"a\"\"b\""), test, "TSV quotes");
+    check(shows(1, 0, "\"c"), test, "a TSV quote");
+    check(shows(0, 1, "d"), test, "a TSV record");
+    clearCells();
+    remove(fileName);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned threads = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    startPool(threads);
+    testOrder();
+    testCycle();
+    testSaveLoad();
+    testLoadV1();
+    testCorruptFiles();
+    testEditDuringRecalculation();
+    testDivision();
+    testDivisionRuns();
+    testLookups();
+    testCriteria();
+    testOperators();
+    testSharedFormulas();
+    testRoundTrip("test.csv");
+    testRoundTrip("test.tsv");
+    testQuotes();
+    stopPool();
+    printf("%s\n", failures == 0 ? "all tests passed" : "some tests failed");
+    return failures == 0 ? 0 : 1;
+}